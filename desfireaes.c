@@ -20,29 +20,49 @@
 #include <aes/esp_aes.h>
 #include "esp_log.h"
 #include "esp_random.h"
+#include "esp_timer.h"
 #else
 #include <stdio.h>
-#include <err.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#ifdef	__linux__
+#include <ucontext.h>             // df_async
+#include <sys/mman.h>
+#endif
+#include <errno.h>
+#include <sys/random.h>
+#include <time.h>
 #endif
 
 #include <string.h>
+#include <stdlib.h>
 #include <ctype.h>
 
 #include "desfireaes.h"
 
+#ifdef	DF_SDT
+#include <sys/sdt.h>            // USDT probes (provider desfire), see probes/
+#define	PROBE(...)	STAP_PROBEV(desfire,__VA_ARGS__)
+#else
+#define	PROBE(...)
+#endif
+
 //#define DEBUG ESP_LOG_INFO
 //#define DEBUG_CMAC
 
-#ifdef DEBUG
 static void
-dump (const char *prefix, unsigned int len, unsigned char *data)
-{
+dump (df_t * d, const char *prefix, unsigned int len, const unsigned char *data)
+{                               // Debug output, to the session's debug function if set
+   if (d && d->debug)
+   {
+      d->debug (d->obj, prefix, len, data);
+      return;
+   }
+#ifdef DEBUG
 #ifdef ESP_PLATFORM
    ESP_LOG_BUFFER_HEX_LEVEL (prefix, data, len, DEBUG);
 #else
@@ -52,26 +72,47 @@ dump (const char *prefix, unsigned int len, unsigned char *data)
       fprintf (stderr, " %02X", data[n]);
    fprintf (stderr, "\n");
 #endif
-}
-#else
-#define dump(p,l,d)
 #endif
+}
 
 // Random
-#ifdef	ESP_PLATFORM
-#define	fill_random	esp_fill_random
-#else
-static void
+static const char *
 fill_random (unsigned char *buf, size_t size)
 {                               // Create our random A value
-   int f = open ("/dev/urandom", O_RDONLY);
-   if (f < 0)
-      err (1, "random");
-   if (read (f, buf, size) != size)
-      err (1, "random");
-   close (f);
+#ifdef	ESP_PLATFORM
+   esp_fill_random (buf, size);
+#else
+   while (size)
+   {                            // No file handle, so nothing shared between sessions
+#ifdef	__linux__
+      ssize_t l = getrandom (buf, size, 0);
+      if (l < 0 && errno == EINTR)
+         continue;
+      if (l <= 0)
+         return "Random failed";
+#else
+      size_t l = (size > 256 ? 256 : size);     // getentropy limit
+      if (getentropy (buf, l))
+         return "Random failed";
+#endif
+      buf += l;
+      size -= l;
+   }
+#endif
+   return NULL;
 }
+
+static unsigned long long
+now (void)
+{                               // Monotonic time (ns), only used for stats
+#ifdef	ESP_PLATFORM
+   return esp_timer_get_time () * 1000ULL;
+#else
+   struct timespec t;
+   clock_gettime (CLOCK_MONOTONIC, &t);
+   return t.tv_sec * 1000000000ULL + t.tv_nsec;
 #endif
+}
 
 #ifndef ESP_PLATFORM
 const char *
@@ -257,7 +298,7 @@ static void
 cmac (df_t * d, unsigned int len, unsigned char *data)
 {                               // Process CMAC
 #ifdef DEBUG_CMAC
-   dump ("CMAC of", len, data);
+   dump (d, "CMAC of", len, data);
 #endif
    unsigned char temp[d->blocklen];     // For last block
    int last = len - (len % d->blocklen ? : len ? d->blocklen : 0);
@@ -279,14 +320,14 @@ cmac (df_t * d, unsigned int len, unsigned char *data)
    if (last < len)
       doencrypt (d->ctx, d->cipher, d->blocklen, d->sk0, d->cmac, NULL, temp, len - last);
 #ifdef DEBUG_CMAC
-   dump ("CMAC", d->blocklen, d->cmac);
+   dump (d, "CMAC", d->blocklen, d->cmac);
 #endif
 }
 
 unsigned int
 df_crc (unsigned int len, const unsigned char *data)
 {
-   dump ("CRC", len, data);
+   dump (NULL, "CRC", len, data);
    unsigned int poly = 0xEDB88320;
    unsigned int crc = 0xFFFFFFFF;
    int n,
@@ -314,6 +355,14 @@ add_crc (unsigned int len, const unsigned char *src, unsigned char *dst)
    return 4;                    // Len
 }
 
+// Library errors that are not card status, exported so they can be recognised by address
+const char df_err_dx[] = "Dx fail";
+const char df_err_auth[] = "Auth failed";
+const char df_err_crc[] = "Rx CRC fail";
+const char df_err_cmac[] = "Rx CMAC fail";
+const char df_err_nokey[] = "No key for key version";
+const char df_err_stack[] = "Too big for df_async stack";
+
 const char *
 df_err (unsigned char c)
 {                               // Error code name
@@ -367,25 +416,33 @@ df_err (unsigned char c)
    return "Rx status error response";
 }
 
-#define TXMAX 55
+// Exchange states
+#define	DX_IDLE	0
+#define	DX_SEND	1               // Sending multi part command
+#define	DX_RECV	2               // Sending (last part of) command and receiving response
+#define	DX_DONE	3               // Exchanges complete (or failed)
+
 const char *
-df_dx (df_t * d, unsigned char cmd, unsigned int max, unsigned char *buf, unsigned int len, unsigned char txenc,
-       unsigned char rxenc, unsigned int *rlen, const char *name)
-{                               // Data exchange, see include file for more details
+df_dx_start (df_t * d, unsigned char cmd, unsigned int max, unsigned char *buf, unsigned int len, unsigned char txenc,
+             unsigned int rxenc, unsigned int *rlen, const char *name)
+{                               // Start data exchange, see include file for more details
+   df_dx_t *x = &d->dxs;
+   x->state = DX_IDLE;
+   if (d->stats)
+      x->t0 = now ();
    if (rlen)
       *rlen = 0;                // default
-   unsigned char tmp[17];
    if (!buf)
    {
-      buf = tmp;
-      max = sizeof (tmp);
+      buf = x->tmp;
+      max = sizeof (x->tmp);
    }
    // Set command
    if (cmd)
       buf[0] = cmd;
    else
       cmd = buf[0];
-   dump ("Tx", len, buf);
+   dump (d, "Tx", len, buf);
    if (cmd == 0xAA || cmd == 0x1A || cmd == 0x0A || cmd == 0x5A)
       d->blocklen = 0;
    if (df_isauth (d))
@@ -397,7 +454,7 @@ df_dx (df_t * d, unsigned char cmd, unsigned int max, unsigned char *buf, unsign
          cmac (d, len, buf);    // CMAC update
          memcpy (buf + len, d->cmac, 8);
          len += 8;
-         dump ("Tx(cmac)", len, buf);
+         dump (d, "Tx(cmac)", len, buf);
       } else if (txenc)
       {                         // Encrypt
          if (((len + 4) | 15) + 1 > max)
@@ -407,98 +464,176 @@ df_dx (df_t * d, unsigned char cmd, unsigned int max, unsigned char *buf, unsign
          // Padding
          while ((len - txenc) % d->blocklen)
             buf[len++] = 0;
-         dump ("Pre enc", len, buf);
+         dump (d, "Pre enc", len, buf);
          doencrypt (d->ctx, d->cipher, d->blocklen, d->sk0, d->cmac, buf + txenc, buf + txenc, len - txenc);
-         dump ("Tx(enc)", len, buf);
+         dump (d, "Tx(enc)", len, buf);
       } else
          cmac (d, len, buf);    // CMAC update
    }
-   // Send buf
-   if (len > TXMAX)
-   {                            // Multi part
-      unsigned char *p = buf,
-         *e = buf + len;
-      while (e - p >= TXMAX)
-      {                         // Send initial parts
-         if (p > buf)
-            *--p = 0xAF;
-         dump ("Tx(raw)", TXMAX, p);
-         const char *errstr = name;
-         int b = d->dx (d->obj, TXMAX, p, 1, &errstr);
-         if (b < 0)
-         {
-            if (!errstr || errstr == name)
-               errstr = "Dx fail";
-            return errstr;
-         }
-         dump ("Rx(raw)", b, p);
-         if (!b)
-         {
-            df_deauth (d);
-            return "";          // Card gone
-         }
-         if (*p != 0xAF)
-         {
-            df_deauth (d);
-            return "Tx expected AF";
-         }
-         p += TXMAX;
+   x->buf = x->p = buf;
+   x->max = max;
+   x->len = len;
+   x->cmd = cmd;
+   x->rxenc = rxenc;
+   x->rlen = rlen;
+   x->name = x->cmdname = name;
+   x->err = NULL;
+   x->dxfail = 0;
+   x->txmax = (d->txmax > 1 ? d->txmax : DF_TXMAX);
+   x->state = (len > x->txmax ? DX_SEND : DX_RECV);     // Multi part, or one frame
+   PROBE (dx__start, d, cmd, len, name);
+   if (d->stats)
+   {
+      x->cryptons = now () - x->t0;
+      x->dxns = 0;
+      x->frames = x->txbytes = x->rxbytes = 0;
+   }
+   return NULL;
+}
+
+unsigned int
+df_dx_frame (df_t * d, unsigned char **data, unsigned int *max, const char **name)
+{                               // Next frame to send
+   df_dx_t *x = &d->dxs;
+   if (data)
+      *data = x->p;
+   if (name)
+      *name = x->name;
+   unsigned int len = 0;
+   if (x->state == DX_SEND)
+   {
+      if (max)
+         *max = 1;
+      len = x->txmax;
+   } else if (x->state == DX_RECV)
+   {
+      if (max)
+         *max = x->buf + x->max - x->p;
+      len = x->len;
+   }
+   if (!len)
+      return 0;
+   dump (d, "Tx(raw)", len, x->p);
+   PROBE (frame__tx, d, x->cmd, len, x->name);
+   if (d->stats)
+   {
+      x->frames++;
+      x->txbytes += len;
+      x->t1 = now ();
+   }
+   return len;
+}
+
+void
+df_dx_response (df_t * d, int b, const char *errstr)
+{                               // Response to frame
+   df_dx_t *x = &d->dxs;
+   if (x->state != DX_SEND && x->state != DX_RECV)
+      return;
+   PROBE (frame__rx, d, x->cmd, b, errstr);
+   if (d->stats)
+   {
+      x->dxns += now () - x->t1;
+      if (b > 0)
+         x->rxbytes += b;
+   }
+   unsigned char *p = x->p,
+      *buf = x->buf;
+   if (b < 0)
+   {
+      if (!errstr || errstr == x->name)
+         errstr = df_err_dx;
+      x->err = errstr;
+      x->dxfail = 1;
+      x->state = DX_DONE;
+      return;
+   }
+   dump (d, "Rx(raw)", b, p);
+   if (!b)
+   {
+      df_deauth (d);
+      x->err = "";              // Card gone
+      x->state = DX_DONE;
+      return;
+   }
+   if (x->state == DX_SEND)
+   {                            // Sent initial parts
+      if (*p != 0xAF)
+      {
+         df_deauth (d);
+         x->err = "Tx expected AF";
+         x->state = DX_DONE;
+         return;
       }
-      memcpy (buf + 1, p, e - p);
-      buf[0] = 0xAF;
-      len = e - p + 1;
+      p += x->txmax;
+      unsigned char *e = buf + x->len;
+      if (e - p >= x->txmax)
+         *--p = 0xAF;           // Next part
+      else
+      {                         // Last part
+         memcpy (buf + 1, p, e - p);
+         buf[0] = 0xAF;
+         x->len = e - p + 1;
+         p = buf;
+         x->state = DX_RECV;
+      }
+      x->p = p;
+      return;
+   }
+   // Receive data
+   if (p > buf)
+   {                            // Move status back
+      *buf = *p;
+      memmove (p, p + 1, --b);
    }
-   {                            // Receive data
-      unsigned char *p = buf,
-         *e = buf + max;
-      while (p < e)
+   if (!b && *buf == 0xAF)
+      x->state = DX_DONE;       // we have no data to send
+   else
+   {
+      p += b;
+      unsigned char cmd = x->cmd;
+      if (*buf != 0xAF || cmd == 0xAA || cmd == 0x1A || cmd == 0x0A)
+         x->state = DX_DONE;    // done
+      else if (p == buf + x->max)
       {
-         dump ("Tx(raw)", len, p);
-         const char *errstr = name;
-         int b = d->dx (d->obj, len, p, e - p, &errstr);
-         if (b < 0)
-         {
-            if (!errstr || errstr == name)
-               errstr = "Dx fail";
-            return errstr;
-         }
-         dump ("Rx(raw)", b, p);
-         if (!b)
-         {
-            df_deauth (d);
-            return "";          // Card gone
-         }
-         if (p > buf)
-         {                      // Move status back
-            *buf = *p;
-            memmove (p, p + 1, --b);
-         }
-         if (!b && *buf == 0xAF)
-            break;              // we have no data to send
-         p += b;
-         if (*buf != 0xAF || cmd == 0xAA || cmd == 0x1A || cmd == 0x0A)
-            break;              // done
-         if (p == e)
-            return "Rx No space";
-         len = 1;               // Next part to send
+         x->err = "Rx No space";
+         x->state = DX_DONE;
+      } else
+      {
+         x->len = 1;            // Next part to send
          *p = 0xAF;
-         name = "More";
+         x->name = "More";
       }
-      len = p - buf;
    }
+   x->p = p;
+}
+
+static const char *
+dx_end (df_t * d)
+{                               // Finish data exchange, checking response
+   df_dx_t *x = &d->dxs;
+   if (x->err)
+      return x->err;
+   unsigned char *buf = x->buf;
+   unsigned int len = x->p - buf;
+   unsigned int rxenc = x->rxenc;
+   unsigned int *rlen = x->rlen;
+   if (len == 1 && *buf && *buf != 0xAF)
+      rxenc = 0;                // Error status only, nothing to decrypt, so the status is reported
    // Post process
    if (df_isauth (d))
    {
       if (rxenc)
       {                         // Encrypted
-         if (len != ((rxenc + 3) | 15) + 2)
+         if (len != ((rxenc + 2) | 15) + 2)
             return "Rx Bad encrypted length";
          decrypt (d->ctx, d->cipher, d->blocklen, d->sk0, d->cmac, buf + 1, buf + 1, len - 1);
-         dump ("Dec", len, buf);
+         dump (d, "Dec", len, buf);
          unsigned int c = buf4 (rxenc);
          buf[rxenc] = buf[0];   // Status at end of payload
          if (c != df_crc (rxenc, buf + 1))
-            return "Rx CRC fail";
+            return df_err_crc;
+         len = rxenc;
       } else if (len > 1)
       {                         // Check CMAC
          if (len < 9)
@@ -508,7 +643,7 @@ df_dx (df_t * d, unsigned char cmd, unsigned int max, unsigned char *buf, unsign
          buf[len] = buf[0];     // status on end
          cmac (d, len, buf + 1);        // CMAC update
          if (c1 != d->cmac[0] || memcmp (d->cmac + 1, buf + len + 1, 7))
-            return "Rx CMAC fail";
+            return df_err_cmac;
       }
    } else if (rxenc && len != rxenc)
       return "Rx unexpected length";
@@ -522,16 +657,253 @@ df_dx (df_t * d, unsigned char cmd, unsigned int max, unsigned char *buf, unsign
       df_deauth (d);            // Errors kick us out
       return df_err (*buf);
    }
-   dump ("Rx", len, buf);
+   dump (d, "Rx", len, buf);
    return NULL;
 }
 
+static void
+stats_add (df_stats_t * s, df_dx_t * x, const char *e, unsigned long long ns)
+{                               // Record a df_dx
+   df_stat_t *t = s->stat,
+      *end = s->stat + s->count;
+   while (t < end && t->name != x->cmdname && (!t->name || !x->cmdname || strcmp (t->name, x->cmdname)))
+      t++;                      // Names are usually the same constant string so pointer matches
+   if (t == end)
+   {
+      if (s->count == DF_STATS_MAX)
+      {
+         s->overflow++;
+         return;
+      }
+      s->count++;
+      t->name = x->cmdname;
+   }
+   t->calls++;
+   if (e)
+      t->errors++;
+   t->frames += x->frames;
+   t->txbytes += x->txbytes;
+   t->rxbytes += x->rxbytes;
+   t->ns += ns;
+   t->dxns += x->dxns;
+   t->cryptons += x->cryptons;
+   if (ns > t->maxns)
+      t->maxns = ns;
+   t->hist[df_stats_bucket (ns)]++;
+}
+
+const char *
+df_dx_end (df_t * d)
+{                               // Finish data exchange, checking response
+   df_dx_t *x = &d->dxs;
+   if (x->state != DX_DONE)
+      return "Exchange not complete";
+   x->state = DX_IDLE;
+   if (!d->stats)
+   {
+      const char *e = dx_end (d);
+      PROBE (dx__done, d, x->cmd, x->cmdname, e);
+      return e;
+   }
+   unsigned long long t = now ();
+   const char *e = dx_end (d);
+   unsigned long long n = now ();
+   x->cryptons += n - t;
+   stats_add (d->stats, x, e, n - x->t0);
+   PROBE (dx__done, d, x->cmd, x->cmdname, e);
+   return e;
+}
+
+const char *
+df_dx (df_t * d, unsigned char cmd, unsigned int max, unsigned char *buf, unsigned int len, unsigned char txenc,
+       unsigned int rxenc, unsigned int *rlen, const char *name)
+{                               // Data exchange, see include file for more details
+   const char *e = df_dx_start (d, cmd, max, buf, len, txenc, rxenc, rlen, name);
+   if (e)
+      return e;
+   unsigned char *data;
+   while ((len = df_dx_frame (d, &data, &max, &name)))
+   {
+      const char *errstr = name;
+      d->dxcount++;
+      int b = d->dx (d->obj, len, data, max, &errstr);
+      df_dx_response (d, b, errstr);
+   }
+   return df_dx_end (d);
+}
+
+#ifdef	DF_ASYNC
+struct df_async_s
+{                               // Resumable session
+   df_t *d;
+   void *obj;                   // Original d->obj
+   df_dx_func_t *dx;            // Original d->dx
+   df_async_func_t *func;       // Function being run
+   void *arg;
+   const char *result;          // Result from func
+   unsigned char running;       // func has not returned
+   // Frame being exchanged
+   unsigned char *data;
+   unsigned int len;
+   unsigned int max;
+   int b;
+   const char *errstr;
+   ucontext_t caller;
+   ucontext_t task;
+   unsigned char *map;          // Guard then stack
+   size_t mapsize;
+   unsigned int stacksize;
+   unsigned char *stack;
+};
+
+// Guard below the df_async stack, no access, so an overflow faults rather than corrupting memory. This is more than a page
+// as the read/write functions have buffers on the stack sized for the data, and these are written from the bottom up.
+#define	ASYNC_GUARD	65536
+
+static int
+async_dx (void *obj, unsigned int len, unsigned char *data, unsigned int max, const char **errstr)
+{                               // Data exchange, called in func, passes frame to caller and waits for response
+   df_async_t *a = obj;
+   a->data = data;
+   a->len = len;
+   a->max = max;
+   a->errstr = *errstr;
+   swapcontext (&a->task, &a->caller);
+   *errstr = a->errstr;
+   return a->b;
+}
+
+static void
+async_run (unsigned int hi, unsigned int lo)
+{                               // Run the function (pointer passed as two ints for makecontext)
+   df_async_t *a = (df_async_t *) (((unsigned long long) hi << 32) | lo);
+   a->result = a->func (a->d, a->arg);
+   a->running = 0;
+   a->len = 0;
+}
+
+df_async_t *
+df_async_new (df_t * d, unsigned int stack)
+{
+   if (!stack)
+      stack = 32768;
+   long page = sysconf (_SC_PAGESIZE);
+   if (page <= 0)
+      page = 4096;
+   stack = (stack + page - 1) / page * page;
+   df_async_t *a = malloc (sizeof (*a));
+   if (!a)
+      return NULL;
+   memset (a, 0, sizeof (*a));
+   a->mapsize = ASYNC_GUARD + stack;
+   a->map = mmap (NULL, a->mapsize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (a->map == MAP_FAILED)
+   {
+      free (a);
+      return NULL;
+   }
+   a->stack = a->map + ASYNC_GUARD;
+   if (mprotect (a->stack, stack, PROT_READ | PROT_WRITE))
+   {
+      munmap (a->map, a->mapsize);
+      free (a);
+      return NULL;
+   }
+   a->stacksize = stack;
+   a->d = d;
+   a->obj = d->obj;
+   a->dx = d->dx;
+   d->obj = a;
+   d->dx = async_dx;
+   return a;
+}
+
+static unsigned int
+async_resume (df_async_t * a, unsigned char **data, unsigned int *max)
+{                               // Run func until it has a frame to send or is done
+   a->len = 0;
+   swapcontext (&a->caller, &a->task);
+   if (data)
+      *data = a->data;
+   if (max)
+      *max = a->max;
+   return a->len;
+}
+
+unsigned int
+df_async_start (df_async_t * a, df_async_func_t * func, void *arg, unsigned char **data, unsigned int *max)
+{                               // Start running func
+   if (a->running)
+   {
+      a->result = "Already running";
+      return 0;
+   }
+   a->func = func;
+   a->arg = arg;
+   a->result = NULL;
+   a->running = 1;
+   getcontext (&a->task);
+   a->task.uc_stack.ss_sp = a->stack;
+   a->task.uc_stack.ss_size = a->stacksize;
+   a->task.uc_link = &a->caller;
+   unsigned long long p = (unsigned long long) a;
+   makecontext (&a->task, (void (*)(void)) async_run, 2, (unsigned int) (p >> 32), (unsigned int) p);
+   return async_resume (a, data, max);
+}
+
+unsigned int
+df_async_response (df_async_t * a, int b, const char *errstr, unsigned char **data, unsigned int *max)
+{                               // Response to frame, continue running func
+   if (!a->running)
+      return 0;
+   a->b = b;
+   if (errstr)
+      a->errstr = errstr;
+   return async_resume (a, data, max);
+}
+
+const char *
+df_async_result (df_async_t * a)
+{
+   if (a->running)
+      return "Not finished";
+   return a->result;
+}
+
+void
+df_async_free (df_async_t * a)
+{
+   if (!a)
+      return;
+   a->d->obj = a->obj;
+   a->d->dx = a->dx;
+   munmap (a->map, a->mapsize);
+   free (a);
+}
+
+// Stack the library needs below a read/write buffer, for df_dx and crypto (measured under 4KB in all)
+#define	ASYNC_MARGIN	6144
+
+static int
+async_fits (df_t * d, unsigned int len)
+{                               // If under df_async, is there room for a len byte buffer on the stack (else it could skip the guard)
+   if (d->dx != async_dx)
+      return 1;
+   df_async_t *a = d->obj;
+   unsigned char here;
+   return &here > a->stack && (size_t) (&here - a->stack) >= (size_t) len + ASYNC_MARGIN;
+}
+#else
+#define	async_fits(d,len)	1
+#endif
+
 const char *
 df_init (df_t * d, void *obj, df_dx_func_t * dx)
 {                               // Initialise
    memset (d, 0, sizeof (*d));
    d->obj = obj;
    d->dx = dx;
+   d->txmax = DF_TXMAX;
 #ifndef	ESP_PLATFORM
    if (!(d->ctx = EVP_CIPHER_CTX_new ()))
       return "Unable to make CTX";
@@ -539,6 +911,96 @@ df_init (df_t * d, void *obj, df_dx_func_t * dx)
    return NULL;
 }
 
+void
+df_free (df_t * d)
+{                               // Free
+#ifndef	ESP_PLATFORM
+   if (d->ctx)
+      EVP_CIPHER_CTX_free (d->ctx);
+#endif
+   memset (d, 0, sizeof (*d));
+}
+
+#define	SESSION_FORMAT	1
+
+static void
+zap (void *p, size_t len)
+{                               // Zero key material, volatile so not optimised away as a dead store
+   volatile unsigned char *v = p;
+   while (len--)
+      *v++ = 0;
+}
+
+const char *
+df_export (df_t * d, unsigned char snapshot[DF_SESSION_LEN])
+{                               // Export session
+   if (d->dxs.state != DX_IDLE)
+      return "Exchange in progress";
+   unsigned char *p = snapshot;
+   *p++ = SESSION_FORMAT;
+   *p++ = d->blocklen;
+   *p++ = d->keyno;
+   memcpy (p, d->aid, 3);
+   p += 3;
+   memcpy (p, d->sk0, 16);
+   p += 16;
+   memcpy (p, d->sk1, 16);
+   p += 16;
+   memcpy (p, d->sk2, 16);
+   p += 16;
+   memcpy (p, d->cmac, 16);
+   p += 16;
+   unsigned int c = df_crc (p - snapshot, snapshot);
+   *p++ = c;
+   *p++ = c >> 8;
+   *p++ = c >> 16;
+   *p++ = c >> 24;
+   df_deauth (d);               // Handed off
+   zap (d->sk0, sizeof (d->sk0));       // Only the importer has the session now
+   zap (d->sk1, sizeof (d->sk1));
+   zap (d->sk2, sizeof (d->sk2));
+   zap (d->cmac, sizeof (d->cmac));
+   return NULL;
+}
+
+const char *
+df_import (df_t * d, const unsigned char snapshot[DF_SESSION_LEN])
+{                               // Import session
+   if (d->dxs.state != DX_IDLE)
+      return "Exchange in progress";
+   const unsigned char *p = snapshot;
+   if (*p++ != SESSION_FORMAT)
+      return "Bad session format";
+   unsigned int c = df_crc (DF_SESSION_LEN - 4, snapshot);
+   if (snapshot[DF_SESSION_LEN - 4] != (c & 0xFF) || snapshot[DF_SESSION_LEN - 3] != ((c >> 8) & 0xFF)
+       || snapshot[DF_SESSION_LEN - 2] != ((c >> 16) & 0xFF) || snapshot[DF_SESSION_LEN - 1] != (c >> 24))
+      return "Bad session CRC";
+   unsigned char blocklen = *p++;
+#ifdef	ESP_PLATFORM
+   if (blocklen && blocklen != 16)
+      return "Bad session key type";
+#else
+   if (blocklen == 8)
+      d->cipher = EVP_des_ede_cbc ();
+   else if (blocklen == 16)
+      d->cipher = EVP_aes_128_cbc ();
+   else if (blocklen)
+      return "Bad session key type";
+#endif
+   d->blocklen = blocklen;
+   d->keyno = *p++;
+   memcpy (d->aid, p, 3);
+   p += 3;
+   memcpy (d->sk0, p, 16);
+   p += 16;
+   memcpy (d->sk1, p, 16);
+   p += 16;
+   memcpy (d->sk2, p, 16);
+   p += 16;
+   memcpy (d->cmac, p, 16);
+   return NULL;
+}
+
 const char *
 df_select_application (df_t * d, const unsigned char aid[3])
 {                               // Select an AID (NULL means AID 0)
@@ -604,10 +1066,10 @@ df_get_key_version (df_t * d, unsigned char keyno, unsigned char *version)
    return e;
 }
 
-const char *
-df_authenticate_general (df_t * d, unsigned char keyno, unsigned char blocklen, const unsigned char *key
+static const char *
+authenticate (df_t * d, unsigned char keyno, unsigned char blocklen, const unsigned char *key
 #ifndef	ESP_PLATFORM
-                         , const EVP_CIPHER * cipher
+              , const EVP_CIPHER * cipher
 #endif
    )
 {                               // Authenticate for specified key len
@@ -628,7 +1090,8 @@ df_authenticate_general (df_t * d, unsigned char keyno, unsigned char blocklen,
    int keylen = rlen - 1;
    if (keylen != 8 && keylen != 16)
       return "Bad 1st response length for auth";
-   fill_random (d->sk1, keylen);
+   if ((e = fill_random (d->sk1, keylen)))
+      return e;
    // Decode B value
    memset (d->cmac, 0, keylen);
    decrypt (d->ctx, cipher, keylen, key, d->cmac, d->sk2, buf + 1, keylen);
@@ -648,10 +1111,12 @@ df_authenticate_general (df_t * d, unsigned char keyno, unsigned char blocklen,
       return e;
    // Check A'
    if (memcmp (buf + 1, d->sk1 + 1, keylen - 1) || buf[keylen] != d->sk1[0])
-      return "Auth failed";
+      return df_err_auth;
    // Mark as logged in
-   dump ("A", keylen, d->sk1);
-   dump ("B", keylen, d->sk2);
+#ifdef	DEBUG                  // Key material only when built for debug
+   dump (d, "A", keylen, d->sk1);
+   dump (d, "B", keylen, d->sk2);
+#endif
    memcpy (d->sk0 + 0, d->sk1 + 0, 4);
    memcpy (d->sk0 + 4, d->sk2 + 0, 4);
    if (keylen == 8)
@@ -693,14 +1158,33 @@ df_authenticate_general (df_t * d, unsigned char keyno, unsigned char blocklen,
       memcpy (d->sk1 + 8, d->sk1, 8);
       memcpy (d->sk2 + 8, d->sk2, 8);
    }
-   dump ("SK0", keylen, d->sk0);
-   dump ("SK1", keylen, d->sk1);
-   dump ("SK2", keylen, d->sk2);
+#ifdef	DEBUG
+   dump (d, "SK0", keylen, d->sk0);
+   dump (d, "SK1", keylen, d->sk1);
+   dump (d, "SK2", keylen, d->sk2);
+#endif
    // Reset CMAC
    memset (d->cmac, 0, keylen);
    return NULL;
 }
 
+const char *
+df_authenticate_general (df_t * d, unsigned char keyno, unsigned char blocklen, const unsigned char *key
+#ifndef	ESP_PLATFORM
+                         , const EVP_CIPHER * cipher
+#endif
+   )
+{                               // Authenticate for specified key len
+   PROBE (auth__start, d, keyno, blocklen);
+   const char *e = authenticate (d, keyno, blocklen, key
+#ifndef	ESP_PLATFORM
+                                 , cipher
+#endif
+      );
+   PROBE (auth__done, d, keyno, blocklen, e);
+   return e;
+}
+
 const char *
 df_authenticate (df_t * d, unsigned char keyno, const unsigned char key[16])
 {                               // Authenticate with a key (AES)
@@ -786,6 +1270,119 @@ df_change_key (df_t * d, unsigned char keyno, unsigned char version, const unsig
    return NULL;
 }
 
+const char *
+df_provision_keys (df_t * d, unsigned char keys, const unsigned char *old[], const unsigned char version[], const unsigned char *key[])
+{                               // Change application keys with fewest authentications the key settings allow
+#define	OLD(n)	(old?old[n]:NULL)
+#define	KEY(n)	(key?key[n]:NULL)
+#define	VER(n)	(version?version[n]:0)
+   if (!keys || keys > 14)
+      return "Bad number of keys";
+   const char *e;
+   unsigned char settings;
+   if ((e = df_get_key_settings (d, &settings, NULL)))
+   {                            // Not free to list, the application master key can
+      if (!*e || (e = df_authenticate (d, 0, OLD (0))) || (e = df_get_key_settings (d, &settings, NULL)))
+         return e;
+   }
+   if (!(settings & DF_SET_MASTER_CHANGE))
+      return "Application master key is frozen";        // Key 0 is always changed, so fail before changing any others
+   unsigned char changer = (settings >> 4);
+   if (changer == 0xF && keys > 1)
+      return "Application keys are frozen";
+   if (changer == 0xE || changer == 0xF)
+   {                            // Each key changes itself
+      for (int n = 0; n < keys; n++)
+         if ((e = df_authenticate (d, n, OLD (n))) || (e = df_change_key (d, n, VER (n), OLD (n), KEY (n))))
+            return e;
+      return NULL;
+   }
+   if (changer >= keys)
+      return "ChangeKey key not being provisioned";
+   // One session as the ChangeKey key, for all other keys (key 0 can only be changed by key 0)
+   if ((!df_isauth (d) || d->keyno != changer) && (e = df_authenticate (d, changer, OLD (changer))))
+      return e;
+   for (int n = 1; n < keys; n++)
+      if (n != changer && (e = df_change_key (d, n, VER (n), OLD (n), KEY (n))))
+         return e;
+   if ((e = df_change_key (d, changer, VER (changer), OLD (changer), KEY (changer))))
+      return e;                 // Changing own key ends session
+   if (changer && ((e = df_authenticate (d, 0, OLD (0))) || (e = df_change_key (d, 0, VER (0), OLD (0), KEY (0)))))
+      return e;
+   return NULL;
+#undef	OLD
+#undef	KEY
+#undef	VER
+}
+
+static const char *
+format_probe (df_t * d, unsigned char version, const unsigned char *key, const char **try)
+{                               // Work out which keys df_format should try, and in what order, using cheap queries not failed auths
+   // try is set to a string of S (supplied AES key), Z (zero AES key), D (zero DES key)
+   const char *e;
+   *try = (key ? "SZD" : "ZD"); // Don't know, try everything
+   // Get out of existing application / session first
+   if ((df_isauth (d) || d->aid[0] || d->aid[1] || d->aid[2]) && (e = df_select_application (d, NULL)))
+      return e;
+   unsigned char keynos = 0;
+   if ((e = df_get_key_settings (d, NULL, &keynos)))
+   {                            // Not allowed to list, see if the hardware can even do AES
+      if (!*e)
+         return e;              // Card gone
+      unsigned char ver[28];
+      if ((e = df_get_version (d, ver)))
+         return *e ? NULL : e;
+      if (!ver[3])
+         *try = "D";            // Original DESFire, no AES
+      return NULL;
+   }
+   if (!(keynos & 0x80))
+   {                            // DES (or 3DES) master key, so must be new card with zero DES key
+      *try = "D";
+      return NULL;
+   }
+   *try = "Z";
+   if (!key)
+      return NULL;
+   unsigned char currentversion = 0;
+   if ((e = df_get_key_version (d, 0, &currentversion)))
+   {
+      if (!*e)
+         return e;
+      *try = "SZ";
+   } else
+      *try = (currentversion == version ? "SZ" : "ZS");
+   return NULL;
+}
+
+const char *
+df_format_plan (df_t * d, unsigned char version, const unsigned char key[16], const char **plan)
+{                               // Report how df_format would authenticate, without changing anything
+   const char *try = NULL;
+   const char *e = format_probe (d, version, key, &try);
+   if (!plan)
+      return e;
+   *plan = NULL;
+   if (e)
+      return e;
+   const char *plans[][2] = {
+      {"SZD", "Unknown key type, try supplied AES key, then zero AES key, then zero DES key"},
+      {"ZD", "Unknown key type, try zero AES key, then zero DES key"},
+      {"SZ", "AES, try supplied key, then zero key"},
+      {"ZS", "AES, try zero key, then supplied key"},
+      {"Z", "AES, zero key"},
+#ifdef	ESP_PLATFORM
+      {"D", "DES, cannot format"},
+#else
+      {"D", "DES, zero key, convert to AES"},
+#endif
+   };
+   for (int n = 0; n < sizeof (plans) / sizeof (*plans); n++)
+      if (!strcmp (try, plans[n][0]))
+         *plan = plans[n][1];
+   return NULL;
+}
+
 const char *
 df_format (df_t * d, unsigned char version, const unsigned char key[16])
 {                               // Format card
@@ -798,29 +1395,32 @@ df_format (df_t * d, unsigned char version, const unsigned char key[16])
       0
    };
    const unsigned char *currentkey = NULL;
-   const char *e = NULL;
-   // Get out of existing application / session first
-   if ((df_isauth (d) || d->aid[0] || d->aid[1] || d->aid[1]) && (e = df_select_application (d, NULL)))
+   const char *try = NULL;
+   const char *e = format_probe (d, version, key, &try);
+   if (e)
       return e;
    e = "Not formatted";
-   // Try supplied key
-   if (e && key)
-      e = df_authenticate (d, 0, currentkey = key);
-   // Try zero AES key
-   if (e)
-      e = df_authenticate (d, 0, currentkey = zero);
-   if (!e)
-      e = df_dx (d, 0xFC, 0, NULL, 1, 0, 0, NULL, "Format");    // Not DES, format (does not change key)
+   char des = 0;
+   for (const char *t = try; *t && e; t++)
+      switch (*t)
+      {
+      case 'S':
+         e = df_authenticate (d, 0, currentkey = key);
+         break;
+      case 'Z':
+         e = df_authenticate (d, 0, currentkey = zero);
+         break;
 #ifndef	ESP_PLATFORM
-   else
-   {                            // If all else fails, try DES with zero key
-      e = df_des_authenticate (d, 0, currentkey = zero);
-      if (!e)
-         e = df_dx (d, 0xFC, 0, NULL, 1, 0, 0, NULL, "Format"); // Format the card anyway in case DES had stuff
-      if (!e)
-         e = df_change_key (d, 0x80, 0, NULL, NULL);    // Change to AES
-   }
+      case 'D':
+         e = df_des_authenticate (d, 0, currentkey = zero);
+         des = 1;
+         break;
 #endif
+      }
+   if (!e)
+      e = df_dx (d, 0xFC, 0, NULL, 1, 0, 0, NULL, "Format");    // Format (does not change key, and DES may have had stuff)
+   if (!e && des)
+      e = df_change_key (d, 0x80, 0, NULL, NULL);       // Change to AES
    if (!e)
       e = df_authenticate (d, 0, currentkey);   // Re-auth after format or change key
    if (!e)
@@ -895,6 +1495,8 @@ df_write_data (df_t * d, unsigned char fileno, char type, unsigned char comms, u
 {
    if (type != 'D' && type != 'B' && type != 'L' && type != 'C')
       return "Bad file type";
+   if (!async_fits (d, len + 32))
+      return df_err_stack;
    unsigned char buf[len + 32];
    unsigned int n = 1;
    wbuf1 (fileno);
@@ -904,7 +1506,7 @@ df_write_data (df_t * d, unsigned char fileno, char type, unsigned char comms, u
    n += len;
    return df_dx (d, type == 'D'
                  || type == 'B' ? 0x3D : 0x3B, sizeof (buf), buf, n, (comms & DF_MODE_ENC) ? 8 : (comms & DF_MODE_CMAC) ? 0xFF : 0,
-                 0, NULL, "Write Data");
+                 0, NULL, type == 'D' || type == 'B' ? "Write Data" : "Write Record");
 }
 
 const char *
@@ -960,7 +1562,7 @@ df_get_file_ids (df_t * d, unsigned long long *ids)
    unsigned long long i = 0;
    while (rlen--)
       if (buf[1 + rlen] < 64)
-         i |= (1 << buf[1 + rlen]);
+         i |= (1ULL << buf[1 + rlen]);
    *ids = i;
    return NULL;
 }
@@ -1057,12 +1659,14 @@ const char *
 df_read_data (df_t * d, unsigned char fileno, unsigned char comms, unsigned int offset, unsigned int len, unsigned char *data)
 {
    unsigned int rlen;
+   if (!async_fits (d, len + 32))
+      return df_err_stack;
    unsigned char buf[len + 32];
    unsigned int n = 1;
    wbuf1 (fileno);
    wbuf3 (offset);
    wbuf3 (len);
-   const char *e = df_dx (d, 0xBD, sizeof (buf), buf, n, 0, (comms & DF_MODE_ENC) ? 8 : 0, &rlen, "Read Data");
+   const char *e = df_dx (d, 0xBD, sizeof (buf), buf, n, 0, (comms & DF_MODE_ENC) ? len + 1 : 0, &rlen, "Read Data");
    if (e)
       return e;
    if (rlen != len + 1)
@@ -1077,12 +1681,14 @@ df_read_records (df_t * d, unsigned char fileno, unsigned char comms, unsigned i
                  unsigned char *data)
 {
    unsigned int rlen;
+   if (!async_fits (d, recs * rsize + 32))
+      return df_err_stack;
    unsigned char buf[recs * rsize + 32];
    unsigned int n = 1;
    wbuf1 (fileno);
    wbuf3 (record);
    wbuf3 (recs);
-   const char *e = df_dx (d, 0xBB, sizeof (buf), buf, n, 0, (comms & DF_MODE_ENC) ? recs * rsize : 0, &rlen, "Read Records");
+   const char *e = df_dx (d, 0xBB, sizeof (buf), buf, n, 0, (comms & DF_MODE_ENC) ? recs * rsize + 1 : 0, &rlen, "Read Records");
    if (e)
       return e;
    if (rlen != recs * rsize + 1)
@@ -1099,7 +1705,7 @@ df_get_value (df_t * d, unsigned char fileno, unsigned char comms, unsigned int
    unsigned char buf[32];
    unsigned int n = 1;
    wbuf1 (fileno);
-   const char *e = df_dx (d, 0x6C, sizeof (buf), buf, n, 0, (comms & DF_MODE_ENC) ? 4 : 0, &rlen, "Get Value");
+   const char *e = df_dx (d, 0x6C, sizeof (buf), buf, n, 0, (comms & DF_MODE_ENC) ? 5 : 0, &rlen, "Get Value");
    if (e)
       return e;
    if (rlen != 5)
@@ -1109,6 +1715,62 @@ df_get_value (df_t * d, unsigned char fileno, unsigned char comms, unsigned int
    return NULL;
 }
 
+static const char *
+read_auth (df_t * d, unsigned char fileno, unsigned char *comms, unsigned short *access, const unsigned char *key, int value,
+           unsigned char *mode)
+{                               // Authenticate if needed to read file, sets comms mode to use
+   unsigned char c = 0;
+   unsigned short a = DF_ACCESS_UNKNOWN;
+   if (!comms)
+      comms = &c;
+   if (!access)
+      access = &a;
+   const char *e;
+   if (*access == DF_ACCESS_UNKNOWN
+       && (e = df_get_file_settings (d, fileno, NULL, comms, access, NULL, NULL, NULL, NULL, NULL, NULL)))
+      return e;
+   *mode = *comms;
+   unsigned char k[3] = { DF_ACCESS_READ (*access), DF_ACCESS_RW (*access), value ? DF_ACCESS_WRITE (*access) : DF_ACCESS_NEVER };
+   int n;
+   for (n = 0; n < sizeof (k) && k[n] != DF_ACCESS_FREE; n++);
+   if (n < sizeof (k))
+   {                            // Free access
+      if (!df_isauth (d))
+         *mode = 0;             // Plain
+      return NULL;
+   }
+   if (df_isauth (d))
+      for (n = 0; n < sizeof (k); n++)
+         if (d->keyno == k[n])
+            return NULL;        // Already authenticated with a key that can read
+   for (n = 0; n < sizeof (k) && k[n] >= 14; n++);
+   if (n == sizeof (k))
+      return "No read access";
+   return df_authenticate (d, k[n], key);
+}
+
+const char *
+df_read_data_auto (df_t * d, unsigned char fileno, unsigned char *comms, unsigned short *access, const unsigned char key[16],
+                   unsigned int offset, unsigned int len, unsigned char *data)
+{                               // Read data, authenticating only if needed
+   unsigned char mode;
+   const char *e = read_auth (d, fileno, comms, access, key, 0, &mode);
+   if (e)
+      return e;
+   return df_read_data (d, fileno, mode, offset, len, data);
+}
+
+const char *
+df_get_value_auto (df_t * d, unsigned char fileno, unsigned char *comms, unsigned short *access, const unsigned char key[16],
+                   unsigned int *value)
+{                               // Get value, authenticating only if needed
+   unsigned char mode;
+   const char *e = read_auth (d, fileno, comms, access, key, 1, &mode);
+   if (e)
+      return e;
+   return df_get_value (d, fileno, mode, value);
+}
+
 const char *
 df_credit (df_t * d, unsigned char fileno, unsigned char comms, unsigned int delta)
 {
@@ -1138,3 +1800,361 @@ df_debit (df_t * d, unsigned char fileno, unsigned char comms, unsigned int delt
    wbuf4 (delta);
    return df_dx (d, 0xDC, sizeof (buf), buf, n, (comms & DF_MODE_CMAC) ? 0xFF : 0, 0, NULL, "Debit");
 }
+
+void
+df_stats_reset (df_stats_t * s)
+{
+   memset (s, 0, sizeof (*s));
+}
+
+const df_stat_t *
+df_stats_find (const df_stats_t * s, const char *name)
+{
+   for (unsigned int n = 0; n < s->count; n++)
+      if (s->stat[n].name == name || (s->stat[n].name && name && !strcmp (s->stat[n].name, name)))
+         return &s->stat[n];
+   return NULL;
+}
+
+unsigned int
+df_stats_bucket (unsigned long long ns)
+{                               // Log linear, 8 buckets per power of 2, so within 12.5%
+   if (ns < 8)
+      return ns;
+   unsigned int p = 63 - __builtin_clzll (ns);
+   unsigned int b = (p - 2) * 8 + ((ns >> (p - 3)) & 7);
+   if (b >= DF_STATS_BUCKETS)
+      b = DF_STATS_BUCKETS - 1;
+   return b;
+}
+
+unsigned long long
+df_stats_bucket_ns (unsigned int b)
+{
+   if (b < 8)
+      return b;
+   return (8ULL + (b & 7)) << (b / 8 - 1);
+}
+
+unsigned long long
+df_stats_percentile (const df_stat_t * t, double percent)
+{
+   unsigned long long want = t->calls * percent / 100,
+      n = 0;
+   for (unsigned int b = 0; b < DF_STATS_BUCKETS; b++)
+      if ((n += t->hist[b]) > want || n == t->calls)
+      {
+         unsigned long long ns = (b + 1 < DF_STATS_BUCKETS ? df_stats_bucket_ns (b + 1) - 1 : t->maxns);
+         return ns < t->maxns ? ns : t->maxns;
+      }
+   return 0;
+}
+
+void
+df_stats_dump (const df_stats_t * s, FILE * f)
+{                               // Times in ms
+   fprintf (f, "%-24s %6s %5s %6s %8s %8s %8s %8s %8s %8s %8s %8s\n", "Command", "Calls", "Errs", "Frames", "Tx", "Rx", "Avg",
+            "RF", "Crypto", "50%", "99%", "Max");
+   for (unsigned int n = 0; n < s->count; n++)
+   {
+      const df_stat_t *t = &s->stat[n];
+      if (!t->calls)
+         continue;
+      fprintf (f, "%-24s %6u %5u %6u %8llu %8llu %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f\n", t->name ? : "?", t->calls, t->errors,
+               t->frames, t->txbytes, t->rxbytes, t->ns / 1e6 / t->calls, t->dxns / 1e6 / t->calls, t->cryptons / 1e6 / t->calls,
+               df_stats_percentile (t, 50) / 1e6, df_stats_percentile (t, 99) / 1e6, t->maxns / 1e6);
+   }
+   if (s->overflow)
+      fprintf (f, "%u calls not recorded\n", s->overflow);
+}
+
+const char *
+df_txn (df_t * d, df_txn_t * t, unsigned int steps, const df_txn_step_t * step)
+{                               // Run a transaction, resuming if the card goes
+   t->resumes = 0;
+   unsigned int n = 0,
+      resume = 0;               // Steps before resume are done, only select and authenticate are run again
+   int pending = -1;            // First step with uncommitted changes
+   while (n < steps)
+   {
+      const df_txn_step_t *s = &step[n];
+      if (n < resume && !(s->flags & (DF_TXN_SELECT | DF_TXN_AUTH)))
+      {                         // Done already
+         n++;
+         continue;
+      }
+      if (n == resume && t->resumes && t->uidset && df_isauth (d))
+      {                         // Check it is the same card
+         unsigned char uid[7];
+         const char *e = df_get_uid (d, uid);
+         if (!e && memcmp (uid, t->uid, sizeof (uid)))
+            e = "Different card";
+         if (e)
+         {
+            t->step = n;
+            return e;
+         }
+      }
+      const char *e = s->func (d, s->arg);
+      if (!e)
+      {
+         if ((s->flags & DF_TXN_PENDING) && pending < 0)
+            pending = n;
+         if (s->flags & DF_TXN_COMMIT)
+            pending = -1;
+         n++;
+         continue;
+      }
+      t->step = n;
+      if (*e && (e != d->dxs.err || !d->dxs.dxfail))
+         return e;              // Not a card or transport failure
+      if (s->flags & DF_TXN_COMMIT)
+         return "Commit status unknown";
+      if (!t->reactivate || t->resumes >= t->retries)
+         return e;
+      t->resumes++;
+      df_deauth (d);
+      if ((e = t->reactivate (t->obj)))
+         return e;
+      if (n > resume)
+         resume = n;
+      if (pending >= 0 && pending < resume)
+         resume = pending;      // Uncommitted changes were lost
+      pending = -1;
+      for (n = resume; n && !(step[n - 1].flags & DF_TXN_SELECT); n--);
+      if (n)
+         n--;                   // Last select before resume
+   }
+   return NULL;
+}
+
+void
+df_keyring_init (df_keyring_t * r)
+{
+   memset (r, 0, sizeof (*r));
+}
+
+void
+df_keyring_free (df_keyring_t * r)
+{
+   if (r->keys)
+      memset (r->keys, 0, sizeof (*r->keys) * r->max);  // Don't leave keys lying around
+   free (r->keys);
+   df_keyring_init (r);
+}
+
+const char *
+df_keyring_add (df_keyring_t * r, const unsigned char aid[3], unsigned char keyno, unsigned char version, const unsigned char key[16])
+{                               // Add key to key ring
+   if (r->num == r->max)
+   {
+      df_keyring_key_t *n = realloc (r->keys, sizeof (*r->keys) * (r->max + 8));
+      if (!n)
+         return "Out of memory";
+      r->keys = n;
+      r->max += 8;
+   }
+   df_keyring_key_t *k = &r->keys[r->num++];
+   memset (k, 0, sizeof (*k));
+   if (aid)
+      memcpy (k->aid, aid, sizeof (k->aid));
+   k->keyno = (keyno & 15);
+   k->version = version;
+   if (key)
+      memcpy (k->key, key, sizeof (k->key));
+   return NULL;
+}
+
+const unsigned char *
+df_keyring_find (df_keyring_t * r, const unsigned char aid[3], unsigned char keyno, unsigned char version, const unsigned char *after)
+{                               // Find (next) key for version
+   unsigned char zero[3] = { 0 };
+   if (!aid)
+      aid = zero;
+   keyno &= 15;
+   unsigned int n = 0;
+   if (after)
+      n = (after - r->keys[0].key) / sizeof (*r->keys) + 1;
+   for (; n < r->num; n++)
+      if (r->keys[n].keyno == keyno && r->keys[n].version == version && !memcmp (r->keys[n].aid, aid, 3))
+         return r->keys[n].key;
+   return NULL;
+}
+
+const char *
+df_keyring_authenticate (df_t * d, df_keyring_t * r, unsigned char keyno, const unsigned char **key)
+{                               // Authenticate with key from ring that matches the key version on the card
+   if (key)
+      *key = NULL;
+   unsigned char version;
+   const char *e = df_get_key_version (d, keyno, &version);
+   if (e)
+      return e;
+   const unsigned char *k = df_keyring_find (r, d->aid, keyno, version, NULL);
+   if (!k)
+      return df_err_nokey;
+   while (k && (e = df_authenticate (d, keyno, k)) && *e)
+      k = df_keyring_find (r, d->aid, keyno, version, k);       // Same version, try next
+   if (!e && key)
+      *key = k;
+   return e;
+}
+
+static const char *
+scan_auth (df_t * d, df_keyring_t * r, unsigned char keyno, unsigned char version)
+{                               // Authenticate for scan, using known key version
+   if (df_isauth (d) && d->keyno == keyno)
+      return NULL;
+   if (!r)
+      return "No keys";
+   const unsigned char *k = NULL;
+   const char *e = df_err_nokey;
+   while ((k = df_keyring_find (r, d->aid, keyno, version, k)) && (e = df_authenticate (d, keyno, k)) && *e);
+   return e;
+}
+
+static const char *
+scan_app (df_t * d, df_keyring_t * r, df_scan_app_t * a)
+{                               // Scan selected application, returns fatal error, else error stored in a->error
+   const char *e;
+   int n = 0;
+   if ((e = df_get_key_settings (d, &a->settings, &a->keynos)))
+   {                            // Listing not free, need application master key
+      if (!*e || (e = df_get_key_version (d, n++, &a->keyver[0])))
+         return e;
+      if ((e = scan_auth (d, r, 0, a->keyver[0])) || (e = df_get_key_settings (d, &a->settings, &a->keynos)))
+         return *e ? (a->error = e, NULL) : e;
+   }
+   for (; n < (a->keynos & 15) && n < 14; n++)
+      if ((e = df_get_key_version (d, n, &a->keyver[n])))
+         return *e ? (a->error = e, NULL) : e;
+   if (!(a->settings & DF_SET_LIST) && !(df_isauth (d) && !d->keyno) && (e = scan_auth (d, r, 0, a->keyver[0])))
+      return *e ? (a->error = e, NULL) : e;
+   unsigned long long ids;
+   if ((e = df_get_file_ids (d, &ids)))
+      return *e ? (a->error = e, NULL) : e;
+   for (n = 0; n < 64 && a->files < sizeof (a->file) / sizeof (*a->file); n++)
+      if (ids & (1ULL << n))
+      {
+         df_scan_file_t *f = &a->file[a->files++];
+         f->fileno = n;
+         if ((e = df_get_file_settings (d, n, &f->type, &f->comms, &f->access, &f->size, &f->min, &f->max, &f->recs, &f->limited,
+                                        &f->lc)))
+            return *e ? (a->error = e, NULL) : e;
+      }
+   // Values, free ones first (or any we can read in current session), then one authentication per key needed
+   unsigned int need = 0;       // Keys we need for values
+   for (n = 0; n < a->files; n++)
+   {
+      df_scan_file_t *f = &a->file[n];
+      if (f->type != 'V')
+         continue;
+      unsigned char k[3] = { DF_ACCESS_READ (f->access), DF_ACCESS_WRITE (f->access), DF_ACCESS_RW (f->access) };
+      int q;
+      for (q = 0; q < 3 && k[q] != DF_ACCESS_FREE && !(df_isauth (d) && d->keyno == k[q]); q++);
+      if (q < 3)
+      {
+         if ((e = df_get_value (d, f->fileno, df_isauth (d) ? f->comms : 0, &f->value)))
+            return *e ? (a->error = e, NULL) : e;
+         f->got_value = 1;
+      } else
+         for (q = 0; q < 3; q++)
+            if (k[q] < 14)
+               need |= (1 << k[q]);
+   }
+   for (int key = 0; key < 14 && key < (a->keynos & 15); key++)
+      if ((need & (1 << key)) && !scan_auth (d, r, key, a->keyver[key]))
+         for (n = 0; n < a->files; n++)
+         {
+            df_scan_file_t *f = &a->file[n];
+            if (f->type != 'V' || f->got_value
+                || (DF_ACCESS_READ (f->access) != key && DF_ACCESS_WRITE (f->access) != key && DF_ACCESS_RW (f->access) != key))
+               continue;
+            if ((e = df_get_value (d, f->fileno, f->comms, &f->value)))
+               return *e ? (a->error = e, NULL) : e;
+            f->got_value = 1;
+         }
+   return NULL;
+}
+
+const char *
+df_scan (df_t * d, df_keyring_t * r, df_scan_t * scan)
+{                               // Scan whole card
+   memset (scan, 0, sizeof (*scan));
+   unsigned int dxcount = d->dxcount;
+   const char *e;
+#define	note(x) do{if((e=(x))){if(!*e)goto done;scan->error=e;}}while(0)
+   if ((e = df_select_application (d, NULL)))
+      goto done;
+   note (df_get_version (d, scan->ver));
+   note (df_get_key_version (d, 0, &scan->keyver));
+   const char *authfail = NULL; // Master key authentication failed, so not tried again
+   if ((e = df_get_key_settings (d, &scan->settings, &scan->keynos)))
+   {                            // Listing not free, need master key
+      if (!*e)
+         goto done;
+      if ((e = scan_auth (d, r, 0, scan->keyver)))
+         authfail = e;
+      else
+         e = df_get_key_settings (d, &scan->settings, &scan->keynos);
+      if (e)
+      {
+         if (!*e)
+            goto done;
+         scan->error = e;
+      }
+   }
+   note (df_free_memory (d, &scan->mem));
+   if (!(scan->settings & DF_SET_LIST) && !(df_isauth (d) && !d->keyno)
+       && (authfail || (e = scan_auth (d, r, 0, scan->keyver))))
+   {
+      if (e && !*e)
+         goto done;
+      scan->error = authfail ? : e;
+      e = NULL;
+      goto done;                // Can't list applications
+   }
+   unsigned char aids[28 * 3];
+   unsigned int num = 0;
+   note (df_get_application_ids (d, &num, sizeof (aids), aids));
+   if (e)
+   {
+      e = NULL;
+      goto done;
+   }
+   if (num > sizeof (aids) / 3)
+      num = sizeof (aids) / 3;
+   if (num && !(scan->app = calloc (num, sizeof (*scan->app))))
+   {
+      e = "Out of memory";
+      goto done;
+   }
+   scan->apps = num;
+   for (int n = 0; n < num; n++)
+   {
+      df_scan_app_t *a = &scan->app[n];
+      memcpy (a->aid, aids + n * 3, 3);
+      if ((e = df_select_application (d, a->aid)))
+      {
+         if (!*e)
+            goto done;
+         a->error = e;
+         continue;
+      }
+      if ((e = scan_app (d, r, a)))
+         goto done;
+   }
+   e = NULL;
+#undef	note
+ done:
+   scan->dx = d->dxcount - dxcount;
+   return e;
+}
+
+void
+df_scan_free (df_scan_t * scan)
+{
+   free (scan->app);
+   scan->app = NULL;
+   scan->apps = 0;
+}
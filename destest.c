@@ -10,18 +10,701 @@
 #include <err.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
+#include <pthread.h>
 #include <desfireaes.h>
+#include "dfemu.h"
+#include "pn532.h"
 
 int debug = 0;
+int sessions = 100;
+
+typedef struct stress_s stress_t;
+struct stress_s
+{                               // One thread of sessions
+   pthread_t thread;
+   dfemu_t *card;               // Card for this thread
+   unsigned int debugs;         // Debug calls for this thread's sessions
+   const char *fail;            // Set if failed
+   df_stats_t *stats;           // Stats for sessions, if set
+};
+
+static void
+stress_debug (void *obj, const char *prefix, unsigned int len, const unsigned char *data)
+{                               // Debug for a session, checks output comes to the right session
+   stress_t *t = obj;
+   t->debugs++;
+   if (!t->fail && (!prefix || (len && !data)))
+      t->fail = "Bad debug call";
+}
+
+static int
+stress_dx (void *obj, unsigned int len, unsigned char *data, unsigned int max, const char **errstr)
+{
+   stress_t *t = obj;
+   return dfemu_dx (t->card, len, data, max, errstr);
+}
+
+static const char *
+stress_session (stress_t * t, unsigned int n)
+{                               // One session, a new card issued and read back
+   const char *e;
+   df_t d;
+   if ((e = df_init (&d, t, stress_dx)))
+      return e;
+   d.debug = stress_debug;
+   d.stats = t->stats;
+   unsigned char master[16],
+     key[16],
+     data[100],
+     rd[100];
+   memset (master, 0x4D, sizeof (master));      // Same card each time, so same master key
+   memset (key, n + 1, sizeof (key));
+   for (int i = 0; i < sizeof (data); i++)
+      data[i] = n + i;
+   unsigned char aid[3] = { 1, 2, 3 };
+   const unsigned char *keys[] = { key };
+   unsigned char ver[] = { 1 };
+   unsigned int value;
+   if (!(e = df_format (&d, 1, master)) &&
+       !(e = df_create_application (&d, aid, 0xEB, 1)) &&
+       !(e = df_select_application (&d, aid)) &&
+       !(e = df_provision_keys (&d, 1, NULL, ver, keys)) &&
+       !(e = df_authenticate (&d, 0, key)) &&
+       !(e = df_create_file (&d, 1, 'D', 3, 0x0000, sizeof (data), 0, 0, 0, 0, 0)) &&
+       !(e = df_write_data (&d, 1, 'D', 3, 0, sizeof (data), data)) &&
+       !(e = df_create_file (&d, 2, 'V', 3, 0x0000, 0, 0, 1000, 0, n, 0)) &&
+       !(e = df_read_data (&d, 1, 3, 0, sizeof (rd), rd)) && !(e = df_get_value (&d, 2, 3, &value)))
+   {
+      if (memcmp (rd, data, sizeof (data)))
+         e = "Data mismatch";
+      else if (value != n)
+         e = "Value mismatch";
+   }
+   df_free (&d);
+   return e;
+}
+
+static void *
+stress_thread (void *arg)
+{
+   stress_t *t = arg;
+   for (int n = 0; n < sessions && !t->fail; n++)
+   {
+      dfemu_present (t->card, 0, 0);    // New session
+      dfemu_present (t->card, 1, 0);
+      t->fail = stress_session (t, n);
+   }
+   return NULL;
+}
+
+static double
+stress (int threads)
+{                               // Run sessions on threads, returns sessions per second
+   stress_t *t = calloc (threads, sizeof (*t));
+   if (!t)
+      errx (1, "malloc");
+   struct timespec start,
+     end;
+   clock_gettime (CLOCK_MONOTONIC, &start);
+   for (int n = 0; n < threads; n++)
+   {
+      if (!(t[n].card = dfemu_new ()))
+         errx (1, "dfemu_new");
+      if (pthread_create (&t[n].thread, NULL, stress_thread, &t[n]))
+         errx (1, "Cannot start thread");
+   }
+   for (int n = 0; n < threads; n++)
+      pthread_join (t[n].thread, NULL);
+   clock_gettime (CLOCK_MONOTONIC, &end);
+   for (int n = 0; n < threads; n++)
+   {
+      if (t[n].fail)
+         errx (1, "Thread %d failed: %s", n, t[n].fail);
+      if (!t[n].debugs)
+         errx (1, "Thread %d had no debug calls", n);
+      dfemu_free (t[n].card);
+   }
+   free (t);
+   double s = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+   return threads * sessions / s;
+}
+
+// Transaction resume check, the card leaves the field at each frame of a transaction in turn
+typedef struct txn_s txn_t;
+struct txn_s
+{
+   dfemu_t *card;
+   unsigned char aid[3];
+   unsigned char key[16];
+   unsigned int value;
+};
+
+static const char *
+txn_select (df_t * d, void *arg)
+{
+   txn_t *t = arg;
+   return df_select_application (d, t->aid);
+}
+
+static const char *
+txn_auth (df_t * d, void *arg)
+{
+   txn_t *t = arg;
+   return df_authenticate (d, 0, t->key);
+}
+
+static const char *
+txn_credit (df_t * d, void *arg)
+{
+   return df_credit (d, 2, 3, 10);
+}
+
+static const char *
+txn_debit (df_t * d, void *arg)
+{
+   return df_debit (d, 2, 3, 3);
+}
+
+static const char *
+txn_commit (df_t * d, void *arg)
+{
+   return df_commit (d);
+}
+
+static const char *
+txn_nospace (df_t * d, void *arg)
+{                               // Read with a buffer too small, fails the same way every time
+   unsigned char buf[60] = { 0, 1, 0, 0, 0, 200, 0, 0 };
+   return df_dx (d, 0xBD, sizeof (buf), buf, 8, 0, 0, NULL, "Read Data");
+}
+
+static const char *
+txn_value (df_t * d, void *arg)
+{
+   txn_t *t = arg;
+   return df_get_value (d, 2, 3, &t->value);
+}
+
+static const char *
+txn_reactivate (void *obj)
+{
+   txn_t *t = obj;
+   dfemu_present (t->card, 1, 0);
+   return NULL;
+}
+
+static const char *
+txn_check (void)
+{                               // Returns error or NULL if OK
+   txn_t t = {.aid = {1, 2, 3} };
+   const df_txn_step_t steps[] = {
+      {txn_select, &t, DF_TXN_SELECT},
+      {txn_auth, &t, DF_TXN_AUTH},
+      {txn_credit, &t, DF_TXN_PENDING},
+      {txn_debit, &t, DF_TXN_PENDING},
+      {txn_commit, &t, DF_TXN_COMMIT},
+      {txn_value, &t},
+   };
+   const char *e = NULL;
+   unsigned int frames = 0;
+   for (unsigned int drop = 1; !e && (!frames || drop <= frames + 1); drop++)
+   {
+      df_t d;
+      if (!(t.card = dfemu_new ()))
+         return "dfemu_new";
+      if (!(e = df_init (&d, t.card, dfemu_dx)) &&
+          !(e = df_create_application (&d, t.aid, 0xEB, 1)) &&
+          !(e = df_select_application (&d, t.aid)) &&
+          !(e = df_authenticate (&d, 0, t.key)) && !(e = df_create_file (&d, 2, 'V', 3, 0x0000, 0, 0, 1000, 0, 100, 0)))
+      {
+         unsigned int start = dfemu_frames (t.card);
+         df_txn_t x = {.reactivate = txn_reactivate,.obj = &t,.retries = 1,.uidset = 1 };
+         memcpy (x.uid, dfemu_uid (t.card), sizeof (x.uid));
+         dfemu_present (t.card, 0, 0);
+         dfemu_present (t.card, 1, frames ? drop : 0);  // First run without drop to count frames
+         t.value = 0;
+         e = df_txn (&d, &x, sizeof (steps) / sizeof (*steps), steps);
+         if (!frames)
+         {
+            frames = dfemu_frames (t.card) - start;
+            drop = 0;
+         }
+         if (e && !strcmp (e, "Commit status unknown"))
+         {                      // Card must have all or none of the changes
+            dfemu_present (t.card, 1, 0);
+            if (!(e = df_select_application (&d, t.aid)) && !(e = df_authenticate (&d, 0, t.key))
+                && !(e = df_get_value (&d, 2, 3, &t.value)) && t.value == 100)
+               t.value = 107;   // Not committed, also OK
+         }
+         if (!e && t.value != 107)
+            e = "Transaction resume value wrong";
+         if (debug)
+            fprintf (stderr, "Drop %u resumes %u step %u %s\n", drop, x.resumes, x.step, e ? : "OK");
+      }
+      df_free (&d);
+      dfemu_free (t.card);
+   }
+   if (!e)
+   {                            // An error that is not the card or transport is not retried, even on a commit step
+      const df_txn_step_t nospace[] = {
+         {txn_select, &t, DF_TXN_SELECT},
+         {txn_auth, &t, DF_TXN_AUTH},
+         {txn_nospace, &t, DF_TXN_COMMIT},
+      };
+      df_t d;
+      if (!(t.card = dfemu_new ()))
+         return "dfemu_new";
+      if (!(e = df_init (&d, t.card, dfemu_dx)) &&
+          !(e = df_create_application (&d, t.aid, 0xEB, 1)) &&
+          !(e = df_select_application (&d, t.aid)) &&
+          !(e = df_authenticate (&d, 0, t.key)) && !(e = df_create_file (&d, 1, 'D', 0, 0xEEEE, 200, 0, 0, 0, 0, 0)))
+      {
+         df_txn_t x = {.reactivate = txn_reactivate,.obj = &t,.retries = 1 };
+         e = df_txn (&d, &x, sizeof (nospace) / sizeof (*nospace), nospace);
+         if (!e || strcmp (e, "Rx No space"))
+            e = "Transaction buffer error reported wrong";
+         else if (x.resumes)
+            e = "Transaction retried buffer error";
+         else
+            e = NULL;
+      }
+      df_free (&d);
+      dfemu_free (t.card);
+   }
+   return e;
+}
+
+static const char *
+txmax_check (void)
+{                               // Bigger command frames, same data, fewer frames
+   unsigned int frames[2] = { };
+   const char *e = NULL;
+   for (int n = 0; !e && n < 2; n++)
+   {
+      df_t d;
+      dfemu_t *card = dfemu_new ();
+      if (!card)
+         return "dfemu_new";
+      unsigned char data[250],
+        rd[250],
+        aid[3] = { 1, 2, 3 },
+        key[16] = { };
+      for (int i = 0; i < sizeof (data); i++)
+         data[i] = i * 7;
+      if (!(e = df_init (&d, card, dfemu_dx)))
+      {
+         if (n)
+            d.txmax = 247;      // 256 byte FSC
+         unsigned int start = dfemu_frames (card);
+         if (!(e = df_create_application (&d, aid, 0xEB, 1)) && !(e = df_select_application (&d, aid)) &&
+             !(e = df_authenticate (&d, 0, key)) && !(e = df_create_file (&d, 1, 'D', 0, 0xEEEE, sizeof (data), 0, 0, 0, 0, 0)) &&
+             !(e = df_write_data (&d, 1, 'D', 0, 0, sizeof (data), data)))
+            frames[n] = dfemu_frames (card) - start;
+         if (!e && !(e = df_read_data (&d, 1, 0, 0, sizeof (rd), rd)) && memcmp (rd, data, sizeof (data)))
+            e = "txmax data mismatch";
+      }
+      df_free (&d);
+      dfemu_free (card);
+   }
+   if (!e && frames[1] >= frames[0])
+      e = "txmax did not reduce frames";
+   if (debug)
+      fprintf (stderr, "Set up and write frames %u at txmax %u, %u at 247\n", frames[0], DF_TXMAX, frames[1]);
+   return e;
+}
+
+static const char *
+stats_check (void)
+{                               // Check stats add up
+   df_stats_t stats = { };
+   stress_t t = {.stats = &stats };
+   if (!(t.card = dfemu_new ()))
+      return "dfemu_new";
+   const char *e = stress_session (&t, 1);
+   unsigned int frames = 0,
+      calls = 0;
+   for (unsigned int n = 0; !e && n < stats.count; n++)
+   {
+      const df_stat_t *s = &stats.stat[n];
+      frames += s->frames;
+      calls += s->calls;
+      unsigned long long total = 0;
+      for (unsigned int b = 0; b < DF_STATS_BUCKETS; b++)
+         total += s->hist[b];
+      if (total != s->calls || s->dxns + s->cryptons > s->ns || df_stats_percentile (s, 50) > s->maxns)
+         e = "Stats inconsistent";
+   }
+   if (!e && frames != dfemu_frames (t.card))
+      e = "Stats frames mismatch";
+   if (!e && (!calls || !df_stats_find (&stats, "Read Data")))
+      e = "Stats missing";
+   if (debug)
+      
+   dfemu_free (t.card);
+   return e;
+}
+
+static const char *
+auto_check (void)
+{                               // Read data and get value, authenticating only if needed, free and keyed access
+   dfemu_t *card = dfemu_new ();
+   if (!card)
+      return "dfemu_new";
+   df_t d;
+   const char *e;
+   unsigned char aid[3] = { 1, 2, 3 },
+      key[16] = { },
+      data[300],
+      rd[300];
+   for (int i = 0; i < sizeof (data); i++)
+      data[i] = i * 3;
+   if (!(e = df_init (&d, card, dfemu_dx)) &&
+       !(e = df_create_application (&d, aid, 0xEB, 1)) && !(e = df_select_application (&d, aid)) &&
+       !(e = df_authenticate (&d, 0, key)) &&
+       !(e = df_create_file (&d, 1, 'D', 0, 0xEEEE, sizeof (data), 0, 0, 0, 0, 0)) &&
+       !(e = df_create_file (&d, 2, 'D', 3, 0x0000, sizeof (data), 0, 0, 0, 0, 0)) &&
+       !(e = df_create_file (&d, 3, 'V', 0, 0xEEEE, 0, 0, 1000, 0, 42, 0)) &&
+       !(e = df_create_file (&d, 4, 'V', 3, 0x0000, 0, 0, 1000, 0, 43, 0)) &&
+       !(e = df_write_data (&d, 1, 'D', 0, 0, sizeof (data), data)) &&
+       !(e = df_write_data (&d, 2, 'D', 3, 0, sizeof (data), data)) && !(e = df_select_application (&d, aid)))
+   {
+      unsigned int value = 0;
+      if (!(e = df_read_data_auto (&d, 1, NULL, NULL, key, 0, sizeof (rd), rd)) && memcmp (rd, data, sizeof (rd)))
+         e = "Free read data mismatch";
+      if (!e && !(e = df_get_value_auto (&d, 3, NULL, NULL, key, &value)) && value != 42)
+         e = "Free value mismatch";
+      if (!e && df_isauth (&d))
+         e = "Authenticated for free access";
+      for (unsigned int len = 255; !e && len <= 300; len += 45)
+      {                         // Encrypted responses over 255 bytes
+         memset (rd, 0, sizeof (rd));
+         if (!(e = df_read_data_auto (&d, 2, NULL, NULL, key, 0, len, rd)) && memcmp (rd, data, len))
+            e = "Keyed read data mismatch";
+      }
+      if (!e && !(e = df_get_value_auto (&d, 4, NULL, NULL, key, &value)) && value != 43)
+         e = "Keyed value mismatch";
+      if (!e && !df_isauth (&d))
+         e = "Not authenticated for keyed access";
+   }
+   df_free (&d);
+   dfemu_free (card);
+   return e;
+}
+
+static const char *
+format_check (void)
+{                               // df_format_plan for each kind of card, and df_format authentications (failures show on Handshake)
+   dfemu_t *card = dfemu_new ();
+   if (!card)
+      return "dfemu_new";
+   df_t d;
+   df_stats_t stats = { };
+   const char *e,
+    *plan = NULL;
+   unsigned char key[16];
+   memset (key, 0x4B, sizeof (key));
+   const df_stat_t *s;
+   if (!(e = df_init (&d, card, dfemu_dx)))
+   {
+      d.stats = &stats;
+      if (!(e = df_format_plan (&d, 0, NULL, &plan)) && (!plan || strcmp (plan, "DES, zero key, convert to AES")))
+         e = "New card not planned as DES";
+      else if (!e && !(e = df_format (&d, 0, NULL)) && (!(s = df_stats_find (&stats, "Authenticate DES")) || s->calls != 1))
+         e = "New card did not format with DES key";
+      else if (!e && (s = df_stats_find (&stats, "Handshake")) && s->errors)
+         e = "New card format tried AES key";
+   }
+   if (!e && !(e = df_format_plan (&d, 0, NULL, &plan)) && strcmp (plan, "AES, zero key"))
+      e = "Zero AES card not planned as zero key";
+   if (!e && !(e = df_format (&d, 1, key)) && !(e = df_format_plan (&d, 1, key, &plan))
+       && strcmp (plan, "AES, try supplied key, then zero key"))
+      e = "Keyed card not planned as supplied key first";
+   if (!e)
+   {                            // Supplied key first, so no failed authentication
+      df_stats_reset (&stats);
+      if (!(e = df_format (&d, 1, key)) && (s = df_stats_find (&stats, "Handshake")) && s->errors)
+         e = "Keyed card format tried zero key";
+   }
+   if (!e && !(e = df_format_plan (&d, 2, key, &plan)) && strcmp (plan, "AES, try zero key, then supplied key"))
+      e = "Key version mismatch not planned as zero key first";
+   if (!e)
+   {                            // Zero key first fails once, then supplied key
+      df_stats_reset (&stats);
+      if (!(e = df_format (&d, 2, key)) && (!(s = df_stats_find (&stats, "Handshake")) || s->errors != 1))
+         e = "Key version mismatch format did not try zero key then supplied key";
+   }
+   df_free (&d);
+   dfemu_free (card);
+   return e;
+}
+
+static const char *
+provision_check (void)
+{                               // Provision three keys under each ChangeKey access, twice (from zero keys, then from those keys)
+   static const unsigned char settings[] = { 0x0B, 0xEB, 0x1B, 0xFB, 0x1A };
+   dfemu_t *card = dfemu_new ();
+   if (!card)
+      return "dfemu_new";
+   df_t d;
+   const char *e = df_init (&d, card, dfemu_dx);
+   unsigned char keys[2][3][16],
+     ver[2][3];
+   const unsigned char *k[2][3];
+   for (int r = 0; r < 2; r++)
+      for (int n = 0; n < 3; n++)
+      {
+         memset (keys[r][n], 0x20 + r * 3 + n, 16);
+         k[r][n] = keys[r][n];
+         ver[r][n] = r * 3 + n + 1;
+      }
+   for (int s = 0; !e && s < sizeof (settings); s++)
+   {
+      unsigned char aid[3] = { 1, 2, 3 + s };
+      if ((e = df_select_application (&d, NULL)) || (e = df_create_application (&d, aid, settings[s], 3))
+          || (e = df_select_application (&d, aid)))
+         break;
+      for (int r = 0; !e && r < 2; r++)
+      {
+         e = df_provision_keys (&d, 3, r ? k[0] : NULL, ver[r], k[r]);
+         if (!(settings[s] & DF_SET_MASTER_CHANGE))
+         {                      // Master key frozen, nothing changed
+            if (!e)
+               e = "Provisioned with master key frozen";
+            else if (strcmp (e, "Application master key is frozen"))
+               break;
+            e = NULL;
+            for (int n = 0; !e && n < 3; n++)
+               e = df_authenticate (&d, n, NULL);
+            break;
+         }
+         if (settings[s] >> 4 == 0xF)
+         {                      // Frozen, only key 0 can change (itself), the others keep their old keys
+            if (!e)
+               e = "Provisioned frozen keys";
+            else if (strcmp (e, "Application keys are frozen"))
+               break;
+            else if ((e = df_provision_keys (&d, 1, r ? k[0] : NULL, ver[r], k[r])))
+               break;
+            for (int n = 1; !e && n < 3; n++)
+               e = df_authenticate (&d, n, NULL);
+            if (!e)
+               e = df_authenticate (&d, 0, k[r][0]);
+            continue;
+         }
+         for (int n = 0; !e && n < 3; n++)
+         {
+            unsigned char v;
+            if (!(e = df_authenticate (&d, n, k[r][n])) && !(e = df_get_key_version (&d, n, &v)) && v != ver[r][n])
+               e = "Provisioned key version wrong";
+         }
+      }
+      if (e && debug)
+         fprintf (stderr, "Provision settings %02X: %s\n", settings[s], e);
+   }
+   df_free (&d);
+   dfemu_free (card);
+   return e;
+}
+
+static const char *
+keyring_check (void)
+{                               // Keys chosen by key version, and no more tried once the card has gone
+   dfemu_t *card = dfemu_new ();
+   if (!card)
+      return "dfemu_new";
+   df_t d;
+   const char *e;
+   unsigned char key[4][16];
+   for (int n = 0; n < 4; n++)
+      memset (key[n], 0x10 + n, sizeof (key[n]));
+   df_keyring_t ring;
+   df_keyring_init (&ring);
+   if (!(e = df_init (&d, card, dfemu_dx)) && !(e = df_format (&d, 2, key[2])) &&
+       !(e = df_keyring_add (&ring, NULL, 0, 1, key[1])) && !(e = df_keyring_add (&ring, NULL, 0, 2, key[0])) &&
+       !(e = df_keyring_add (&ring, NULL, 0, 2, key[2])) && !(e = df_keyring_add (&ring, NULL, 0, 3, key[3])) &&
+       !(e = df_select_application (&d, NULL)))
+   {
+      const unsigned char *k = NULL;
+      unsigned int start = d.dxcount;
+      if (!(e = df_keyring_authenticate (&d, &ring, 0, &k)))
+      {                         // Get Key Version, then both version 2 keys (2 each), not versions 1 or 3
+         if (!k || memcmp (k, key[2], 16))
+            e = "Keyring used wrong key";
+         else if (d.dxcount - start != 5)
+            e = "Keyring tried keys for other versions";
+      }
+      if (!e)
+      {                         // Card leaves during the first (wrong) key, the next key is not tried
+         dfemu_present (card, 0, 0);
+         dfemu_present (card, 1, 3);     // Select, Get Key Version, then gone at Authenticate
+         start = d.dxcount;
+         if (!(e = df_select_application (&d, NULL)))
+         {
+            e = df_keyring_authenticate (&d, &ring, 0, &k);
+            if (!e || *e)
+               e = "Keyring did not report card gone";
+            else if (d.dxcount - start != 3)
+               e = "Keyring tried keys after card gone";
+            else
+               e = NULL;
+         }
+      }
+   }
+   df_keyring_free (&ring);
+   df_free (&d);
+   dfemu_free (card);
+   return e;
+}
+
+static const char *
+scan_check (void)
+{                               // Scan a card that needs the master key to list, with the wrong key and then the right one
+   dfemu_t *card = dfemu_new ();
+   if (!card)
+      return "dfemu_new";
+   df_t d;
+   const char *e;
+   unsigned char master[16],
+     wrong[16],
+     aid[3] = { 1, 2, 3 },
+     zero[16] = { };
+   memset (master, 0x4D, sizeof (master));
+   memset (wrong, 0x57, sizeof (wrong));
+   df_keyring_t ring;
+   df_keyring_init (&ring);
+   if (!(e = df_init (&d, card, dfemu_dx)) && !(e = df_format (&d, 1, master)) && !(e = df_authenticate (&d, 0, master)) &&
+       !(e = df_create_application (&d, aid, 0xEB, 1)) && !(e = df_select_application (&d, aid)) &&
+       !(e = df_authenticate (&d, 0, zero)) && !(e = df_create_file (&d, 1, 'V', 0, 0xEEEE, 0, 0, 1000, 0, 42, 0)) &&
+       !(e = df_select_application (&d, NULL)) && !(e = df_authenticate (&d, 0, master)) &&
+       !(e = df_change_key_settings (&d, DF_SET_DEFAULT & ~DF_SET_LIST)) && !(e = df_keyring_add (&ring, NULL, 0, 1, wrong)))
+   {
+      df_scan_t scan;
+      unsigned int start = dfemu_frames (card);
+      if (!(e = df_scan (&d, &ring, &scan)))
+      {                         // Select, Get Version, Get Key Version, Get Key Settings, Authenticate (2), Free Memory
+         if (!scan.error || scan.apps)
+            e = "Scan listed without master key";
+         else if (scan.dx != dfemu_frames (card) - start)
+            e = "Scan frame count mismatch";
+         else if (scan.dx != 7)
+            e = "Scan retried master key authentication";
+      }
+      df_scan_free (&scan);
+      if (!e && !(e = df_keyring_add (&ring, NULL, 0, 1, master)) && !(e = df_scan (&d, &ring, &scan)))
+      {                         // Wrong key tried first, then the right one, and the application is scanned
+         if (scan.error || scan.apps != 1 || scan.app[0].error || scan.app[0].files != 1 || !scan.app[0].file[0].got_value
+             || scan.app[0].file[0].value != 42)
+            e = "Scan with master key incomplete";
+      }
+      df_scan_free (&scan);
+   }
+   df_keyring_free (&ring);
+   df_free (&d);
+   dfemu_free (card);
+   return e;
+}
+
+static const char *
+export_check (void)
+{                               // Session exported from one df_t and carried on in another, and a corrupt snapshot rejected
+   dfemu_t *card = dfemu_new ();
+   if (!card)
+      return "dfemu_new";
+   df_t a,
+     b;
+   const char *e;
+   unsigned char master[16],
+     aid[3] = { 1, 2, 3 },
+     zero[16] = { },
+     snapshot[DF_SESSION_LEN];
+   memset (master, 0x4D, sizeof (master));
+   unsigned int value = 0;
+   if (!(e = df_init (&a, card, dfemu_dx)) && !(e = df_init (&b, card, dfemu_dx)) && !(e = df_format (&a, 1, master))
+       && !(e = df_authenticate (&a, 0, master)) && !(e = df_create_application (&a, aid, 0xEB, 1))
+       && !(e = df_select_application (&a, aid)) && !(e = df_authenticate (&a, 0, zero))
+       && !(e = df_create_file (&a, 1, 'V', 3, 0x0000, 0, 0, 1000, 0, 42, 0)) && !(e = df_export (&a, snapshot)))
+   {
+      unsigned char sk[sizeof (a.sk0) + sizeof (a.sk1) + sizeof (a.sk2)] = { };
+      if (df_isauth (&a))
+         e = "Export left session authenticated";
+      else if (memcmp (a.sk0, sk, sizeof (a.sk0)) || memcmp (a.sk1, sk, sizeof (a.sk1)) || memcmp (a.sk2, sk, sizeof (a.sk2)))
+         e = "Export left session keys";
+      else
+      {
+         unsigned char bad[DF_SESSION_LEN];
+         memcpy (bad, snapshot, sizeof (bad));
+         bad[10] ^= 1;          // In sk0
+         if (!(e = df_import (&b, bad)) || strcmp (e, "Bad session CRC"))
+            e = "Import accepted bad CRC";
+         else if (df_isauth (&b))
+            e = "Import of bad snapshot authenticated";
+         else if (!(e = df_import (&b, snapshot)) && !(e = df_get_value (&b, 1, 3, &value)) && value != 42)
+            e = "Imported session read wrong value";
+      }
+   }
+   df_free (&a);
+   df_free (&b);
+   dfemu_free (card);
+   return e;
+}
+
+static const char *
+autopoll_check (void)
+{                               // InAutoPoll response with one and two type A targets, and a FeliCa target then a type A target
+   static const unsigned char target[] = { 0x03, 0x44, 0x20, 7, 0x04, 1, 2, 3, 4, 5, 6, 6, 0x75, 0x77, 0x81, 2, 0x80 };
+   static const unsigned char felica[] = { 0x12, 0x01, 0x01, 0x2E, 1, 2, 3, 4, 5, 6, 7, 1, 2, 3, 4, 5, 6, 7, 8 };
+   for (int test = 0; test < 3; test++)
+   {
+      int cards = (test ? 2 : 1),
+         typea = (test == 2 ? 1 : cards);
+      unsigned char buf[100],
+        copy[sizeof (buf)],
+       *b = buf;
+      *b++ = cards;
+      for (int n = 0; n < cards; n++)
+      {
+         if (test == 2 && !n)
+         {
+            *b++ = 0x11;        // FeliCa 212kbps, not type A
+            *b++ = sizeof (felica) + 1;
+            *b++ = n + 1;       // Tg
+            memcpy (b, felica, sizeof (felica));
+            b += sizeof (felica);
+            continue;
+         }
+         *b++ = (n ? 0x20 : 0x10);      // MIFARE, ISO/IEC14443-4A
+         *b++ = sizeof (target) + 1;
+         *b++ = n + 1;          // Tg
+         memcpy (b, target, sizeof (target));
+         b[4] += n;             // Different UID
+         b += sizeof (target);
+      }
+      memcpy (copy, buf, sizeof (buf));
+      unsigned char nfcid[MAXNFCID],
+        ats[MAXATS];
+      if (pn532_autopoll_parse (buf, b - buf, nfcid, ats) != typea)
+         return "InAutoPoll parse wrong number of cards";
+      if (nfcid[0] != 7 || nfcid[1] != 0x04 + (test == 2) || ats[0] != 6 || ats[1] != 0x75)
+         return "InAutoPoll parse wrong first target";
+      if (memcmp (buf, copy, sizeof (buf)))
+         return "InAutoPoll parse changed the response";
+      if (pn532_autopoll_parse (buf, b - buf - 1, nfcid, ats) >= 0)
+         return "InAutoPoll parse accepted short response";
+   }
+   return NULL;
+}
 
 int
 main (int argc, const char *argv[])
 {
+   int threads = 0;
    poptContext optCon;          // context for parsing command-line options
    {                            // POPT
       const struct poptOption optionsTable[] = {
 //      {"string", 's', POPT_ARG_STRING, &string, 0, "String", "string"},
 //      {"string-default", 'S', POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &string, 0, "String", "string"},
+         {"threads", 't', POPT_ARG_INT, &threads, 0, "Stress test sessions on emulated cards in parallel", "N"},
+         {"sessions", 's', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &sessions, 0, "Sessions per thread for stress test", "N"},
          {"debug", 'v', POPT_ARG_NONE, &debug, 0, "Debug"},
          POPT_AUTOHELP {}
       };
@@ -43,6 +726,33 @@ main (int argc, const char *argv[])
    const char *fail = df_check_des ();
    if (fail)
       errx (0, "Fail: %s", fail);
+   if ((fail = txn_check ()))
+      errx (0, "Fail: %s", fail);
+   if ((fail = stats_check ()))
+      errx (0, "Fail: %s", fail);
+   if ((fail = txmax_check ()))
+      errx (0, "Fail: %s", fail);
+   if ((fail = auto_check ()))
+      errx (0, "Fail: %s", fail);
+   if ((fail = format_check ()))
+      errx (0, "Fail: %s", fail);
+   if ((fail = provision_check ()))
+      errx (0, "Fail: %s", fail);
+   if ((fail = keyring_check ()))
+      errx (0, "Fail: %s", fail);
+   if ((fail = scan_check ()))
+      errx (0, "Fail: %s", fail);
+   if ((fail = autopoll_check ()))
+      errx (0, "Fail: %s", fail);
+   if ((fail = export_check ()))
+      errx (0, "Fail: %s", fail);
+
+   if (threads > 0)
+   {                            // Stress test, one thread as a base line, then all threads
+      double one = stress (1);
+      double all = stress (threads);
+      printf ("1 thread %.0f sessions/s, %d threads %.0f sessions/s, scaling %.2f\n", one, threads, all, all / one);
+   }
 
    poptFreeContext (optCon);
    return 0;
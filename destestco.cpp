@@ -0,0 +1,130 @@
+// desfireaes_co.hpp test, many coroutine sessions interleaved frame by frame on emulated cards (C++20)
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <memory>
+#include <err.h>
+#include <desfireaes_co.hpp>
+extern "C"
+{
+#include "dfemu.h"
+}
+
+struct transport
+{                               // One card, the frame is exchanged by the loop in main, not in the awaitable
+   dfemu_t *card = nullptr;
+   unsigned char *data = nullptr;
+   unsigned int len = 0,
+      max = 0;
+   int b = 0;
+   std::coroutine_handle <> waiting;
+   struct awaitable
+   {
+      transport & t;
+      bool await_ready () noexcept
+      {
+         return false;
+      }
+      void await_suspend (std::coroutine_handle <> h) noexcept
+      {
+         t.waiting = h;
+      }
+      int await_resume () noexcept
+      {
+         return t.b;
+      }
+   };
+   awaitable exchange (unsigned char *d, unsigned int l, unsigned int m)
+   {
+      data = d;
+      len = l;
+      max = m;
+      return awaitable { *this };
+   }
+};
+
+typedef desfire::session < transport > session_t;
+
+static desfire::task < const char *>job (session_t & s, transport & t, unsigned int n)
+{                               // One session: set up and read back a file and value, then errors map to the right codes
+   std::array < unsigned char, 3 > aid { 1, 2, 3 };
+   std::array < unsigned char, 16 > key { },
+   wrong;
+   wrong.fill (0x57);
+   unsigned char data[300],
+     rd[300];
+   for (unsigned int i = 0; i < sizeof (data); i++)
+      data[i] = n + i;
+   unsigned int value = 0;
+   std::error_code e;
+   if ((e = co_await s.run ([aid] (df_t * d) { return df_create_application (d, aid.data (), 0xEB, 1); }))
+       || (e = co_await s.select_application (aid)) || (e = co_await s.authenticate (0, key))
+       || (e = co_await s.run ([n] (df_t * d) { return df_create_file (d, 1, 'D', 3, 0x0000, 300, 0, 0, 0, 0, 0); }))
+       || (e = co_await s.run ([n] (df_t * d) { return df_create_file (d, 2, 'V', 3, 0x0000, 0, 0, 1000, 0, n, 0); }))
+       || (e = co_await s.write_data (1, 'D', 3, 0, sizeof (data), data))
+       || (e = co_await s.read_data (1, 3, 0, sizeof (rd), rd)) || (e = co_await s.credit (2, 3, 5))
+       || (e = co_await s.commit ()) || (e = co_await s.get_value (2, 3, value)))
+      co_return s.message ();
+   if (memcmp (rd, data, sizeof (data)))
+      co_return "Data mismatch";
+   if (value != n + 5)
+      co_return "Value mismatch";
+   if ((e = co_await s.read_data (9, 3, 0, sizeof (rd), rd)) != desfire::errc::not_found)
+      co_return "File not found not mapped";
+   static unsigned char big[100000];
+   if ((e = co_await s.read_data (1, 3, 0, sizeof (big), big)) != desfire::errc::length || s.message () != df_err_stack)
+      co_return "Read too big for stack not refused";
+   if ((e = co_await s.authenticate (0, wrong)) != desfire::errc::authentication)
+      co_return "Authentication error not mapped";
+   dfemu_present (t.card, 0, 0);
+   if ((e = co_await s.select_application (aid)) != desfire::errc::card_gone)
+      co_return "Card gone not mapped";
+   co_return nullptr;
+}
+
+int
+main (int argc, const char *argv[])
+{
+   unsigned int sessions = (argc > 1 ? atoi (argv[1]) : 200);
+   std::vector < std::unique_ptr < transport >> t;
+   std::vector < std::unique_ptr < session_t >> s;
+   std::vector < desfire::task < const char *>>j;
+   for (unsigned int n = 0; n < sessions; n++)
+   {
+      t.push_back (std::make_unique < transport > ());
+      if (!(t[n]->card = dfemu_new ()))
+         errx (1, "dfemu_new");
+      s.push_back (std::make_unique < session_t > (*t[n]));
+      j.push_back (job (*s[n], *t[n], n));
+      j[n].start ();
+   }
+   unsigned int frames = 0;
+   for (bool waiting = true; waiting;)
+   {                            // One frame for each waiting session in turn
+      waiting = false;
+      for (auto & x:t)
+         if (x->waiting)
+         {
+            const char *errstr = nullptr;
+            x->b = dfemu_dx (x->card, x->len, x->data, x->max, &errstr);
+            frames++;
+            std::exchange (x->waiting, { }).resume ();
+            waiting = true;
+         }
+   }
+   for (unsigned int n = 0; n < sessions; n++)
+   {
+      if (!j[n].done ())
+         errx (1, "Fail: session %u not done", n);
+      if (const char *e = j[n].result ())
+         errx (1, "Fail: session %u: %s", n, *e ? e : "Card gone");
+   }
+   s.clear ();
+   for (auto & x:t)
+      dfemu_free (x->card);
+   if (argc > 1)
+      printf ("%u sessions, %u frames\n", sessions, frames);
+   return 0;
+}
@@ -0,0 +1,72 @@
+// DesfireSession (desfireaes.hpp) test against the emulated card, built as C++17 (destest17) and C++20 (destest20)
+
+#include <cstdio>
+#include <cstring>
+#include <array>
+#include <err.h>
+#include <desfireaes.hpp>
+extern "C"
+{
+#include "dfemu.h"
+}
+
+static const char *
+session_check (void)
+{                               // Returns error or NULL if OK
+   dfemu_t *card = dfemu_new ();
+   if (!card)
+      return "dfemu_new";
+   const char *e = nullptr;
+   df_stats_t stats { };
+   {
+      desfire::DesfireSession s (card, dfemu_dx);
+      s.df ()->stats = &stats;
+      std::array < unsigned char, 3 > aid { 1, 2, 3 };
+      std::array < unsigned char, 16 > key { };
+      unsigned char data[100],
+        rd[100],
+        rec[16],
+        ver[28],
+        uid[7];
+      for (unsigned int i = 0; i < sizeof (data); i++)
+         data[i] = i * 5;
+      memset (rec, 0x52, sizeof (rec));
+      unsigned int mem = 0,
+         value = 0;
+      unsigned char keyver = 0xFF;
+      desfire::DesfireSession m (std::move (s));        // Moved session still works
+      if (!(e = m.get_version (ver)) && !(e = m.free_memory (mem)) && !(e = df_create_application (m.df (), aid.data (), 0xEB, 1))
+          && !(e = m.select_application (aid)) && !(e = m.get_key_version (0, keyver)) && !(e = m.authenticate (0, key))
+          && !(e = m.get_uid (uid)) && !(e = df_create_file (m.df (), 1, 'D', 3, 0x0000, sizeof (data), 0, 0, 0, 0, 0))
+          && !(e = df_create_file (m.df (), 2, 'L', 3, 0x0000, sizeof (rec), 0, 0, 3, 0, 0))
+          && !(e = df_create_file (m.df (), 3, 'V', 3, 0x0000, 0, 0, 1000, 0, 100, 0))
+          && !(e = m.write_data (1, 3, 0, data)) && !(e = m.read_data (1, 3, 0, rd))
+          && !(e = m.write_record (2, 3, 0, rec)) && !(e = m.credit (3, 3, 10)) && !(e = m.debit (3, 3, 3)) && !(e = m.commit ())
+          && !(e = m.get_value (3, 3, value)))
+      {
+         unsigned char rr[sizeof (rec)] = { };
+         if (ver[0] != 4 || !mem || keyver)
+            e = "Card information wrong";
+         else if (memcmp (uid, dfemu_uid (card), sizeof (uid)))
+            e = "UID mismatch";
+         else if (memcmp (rd, data, sizeof (data)))
+            e = "Data mismatch";
+         else if (value != 107)
+            e = "Value mismatch";
+         else if (!(e = m.read_records (2, 3, 0, 1, rr)) && memcmp (rr, rec, sizeof (rec)))
+            e = "Record mismatch";
+      }
+      if (!e && (!df_stats_find (&stats, "Write Data") || !df_stats_find (&stats, "Write Record")))
+         e = "Stats command names wrong";
+   }
+   dfemu_free (card);
+   return e;
+}
+
+int
+main ()
+{
+   if (const char *fail = session_check ())
+      errx (1, "Fail (C++%ld): %s", __cplusplus / 100 % 100, fail);
+   return 0;
+}
@@ -0,0 +1,1041 @@
+/* Emulated DESFire EV1 card, for testing without hardware */
+/* (c) Copyright 2022 Andrews & Arnold Ltd, Adrian Kennard */
+/*
+ * This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include "desfireaes.h"
+#include "dfemu.h"
+
+#define	APPS	28              /* Max applications */
+#define	FILES	32              /* Max files per application */
+#define	MEMORY	8192            /* Card size */
+
+/* Status codes */
+#define	OK		0x00
+#define	NO_CHANGE	0x0C
+#define	OUT_OF_EEPROM	0x0E
+#define	ILLEGAL		0x1C
+#define	INTEGRITY	0x1E
+#define	NO_SUCH_KEY	0x40
+#define	LENGTH		0x7E
+#define	PERMISSION	0x9D
+#define	PARAMETER	0x9E
+#define	APP_NOT_FOUND	0xA0
+#define	AUTH_ERROR	0xAE
+#define	MORE		0xAF
+#define	BOUNDARY	0xBE
+#define	DUPLICATE	0xDE
+#define	FILE_NOT_FOUND	0xF0
+
+typedef struct file_s file_t;
+struct file_s
+{
+   char type;                   /* 0 for no file, else D/B/V/L/C */
+   unsigned char comms;
+   unsigned short access;
+   unsigned int size;           /* Data size, or record size */
+   unsigned int recs;           /* Max records */
+   unsigned int count;          /* Records in use */
+   unsigned int pending;        /* Record pending commit */
+   int min,
+     max,
+     value,
+     limited,
+     delta;                     /* Value file */
+   unsigned char lc;
+   unsigned char *data;         /* Data (or records) */
+   unsigned char *backup;       /* Uncommitted data for backup or records */
+};
+
+typedef struct app_s app_t;
+struct app_s
+{
+   unsigned char aid[3];
+   unsigned char settings;
+   unsigned char keys;          /* Number of keys, and 0x80 for AES */
+   unsigned char key[14][16];
+   unsigned char ver[14];
+   file_t file[FILES];
+};
+
+struct dfemu_s
+{
+   unsigned char uid[7];
+   unsigned char config;
+   unsigned char present;       /* Card in field */
+   unsigned int drop;           /* Frames until card leaves field, 0 for never */
+   unsigned int frame;          /* Max frame size */
+   unsigned int frames;         /* Frames exchanged */
+   app_t picc;                  /* Master application, key 0 is card master key */
+   app_t *app[APPS];
+   app_t *sel;                  /* Selected application */
+   /* Session */
+   EVP_CIPHER_CTX *ctx;
+   const EVP_CIPHER *cipher;
+   int keyno;                   /* Authenticated key, -1 if not */
+   int authing;                 /* Key being authenticated, -1 if not */
+   unsigned char blocklen;
+   unsigned char rnd[16];       /* RndB during authentication */
+   unsigned char sk0[16];
+   unsigned char sk1[16];
+   unsigned char sk2[16];
+   unsigned char iv[16];
+   /* Frames */
+   unsigned char rx[1024];      /* Command being received */
+   unsigned int rxlen;
+   unsigned int rxwant;
+   unsigned char tx[1024];      /* Response being sent, status at start */
+   unsigned int txlen;
+   unsigned int txpos;
+};
+
+static void
+fill_random (unsigned char *buf, size_t size)
+{
+   if (RAND_bytes (buf, size) != 1)
+      memset (buf, 0x5A, size);
+}
+
+static void
+cbc (dfemu_t * e, const EVP_CIPHER * cipher, int blocklen, const unsigned char *key, int enc, unsigned char *buf, int len)
+{                               /* CBC in place, updating iv */
+   unsigned char next[16];
+   if (!enc)
+      memcpy (next, buf + len - blocklen, blocklen);
+   int n;
+   EVP_CipherInit_ex (e->ctx, cipher, NULL, key, e->iv, enc);
+   EVP_CIPHER_CTX_set_padding (e->ctx, 0);
+   EVP_CipherUpdate (e->ctx, buf, &n, buf, len);
+   EVP_CipherFinal_ex (e->ctx, buf + n, &n);
+   memcpy (e->iv, enc ? buf + len - blocklen : next, blocklen);
+}
+
+static void
+cmac (dfemu_t * e, unsigned int len, const unsigned char *data)
+{                               /* CMAC, updating iv */
+   unsigned int b = e->blocklen;
+   unsigned char buf[len + b];
+   memcpy (buf, data, len);
+   unsigned int last = (len && !(len % b)) ? len - b : len - len % b;
+   const unsigned char *sk = e->sk1;
+   if (len - last < b)
+   {
+      buf[len++] = 0x80;
+      while (len % b)
+         buf[len++] = 0;
+      sk = e->sk2;
+   }
+   for (unsigned int i = 0; i < b; i++)
+      buf[last + i] ^= sk[i];
+   cbc (e, e->cipher, b, e->sk0, 1, buf, len);
+}
+
+static void
+subkey (unsigned char *k, int b)
+{
+   unsigned char x = (k[0] & 0x80) ? (b == 8 ? 0x1B : 0x87) : 0;
+   for (int n = 0; n < b - 1; n++)
+      k[n] = (k[n] << 1) | (k[n + 1] >> 7);
+   k[b - 1] = (k[b - 1] << 1) ^ x;
+}
+
+static void
+deauth (dfemu_t * e)
+{
+   e->keyno = -1;
+   e->authing = -1;
+   e->blocklen = 0;
+}
+
+static void
+abort_txn (dfemu_t * e)
+{                               /* Discard uncommitted changes */
+   for (int f = 0; f < FILES; f++)
+   {
+      file_t *F = &e->sel->file[f];
+      F->delta = 0;
+      F->pending = 0;
+      if (F->type == 'B')
+         memcpy (F->backup, F->data, F->size);
+   }
+}
+
+static unsigned int
+memory (dfemu_t * e)
+{                               /* Free memory */
+   unsigned int used = 0;
+   for (int a = 0; a < APPS; a++)
+      if (e->app[a])
+      {
+         used += 32;
+         for (int f = 0; f < FILES; f++)
+         {
+            file_t *F = &e->app[a]->file[f];
+            if (F->type)
+               used += 32 + (F->type == 'V' ? 0 : F->size * (F->recs ? : 1));
+         }
+      }
+   return used > MEMORY ? 0 : MEMORY - used;
+}
+
+static void
+free_app (app_t * a)
+{
+   for (int f = 0; f < FILES; f++)
+   {
+      free (a->file[f].data);
+      free (a->file[f].backup);
+   }
+   free (a);
+}
+
+dfemu_t *
+dfemu_new (void)
+{                               /* New blank card, DES zero master key */
+   dfemu_t *e = calloc (1, sizeof (*e));
+   if (!e)
+      return NULL;
+   if (!(e->ctx = EVP_CIPHER_CTX_new ()))
+   {
+      free (e);
+      return NULL;
+   }
+   fill_random (e->uid, sizeof (e->uid));
+   e->uid[0] = 0x04;            /* NXP */
+   e->picc.settings = 0x0F;
+   e->picc.keys = 1;
+   e->sel = &e->picc;
+   e->present = 1;
+   e->frame = 60;
+   deauth (e);
+   return e;
+}
+
+void
+dfemu_free (dfemu_t * e)
+{
+   if (!e)
+      return;
+   for (int a = 0; a < APPS; a++)
+      if (e->app[a])
+         free_app (e->app[a]);
+   EVP_CIPHER_CTX_free (e->ctx);
+   free (e);
+}
+
+void
+dfemu_present (dfemu_t * e, int present, unsigned int drop)
+{                               /* Card in or out of field, or leaves after drop frames */
+   if (!present || !e->present)
+   {                            /* Reactivation, back to PICC level, uncommitted changes lost */
+      abort_txn (e);
+      deauth (e);
+      e->sel = &e->picc;
+      e->txlen = e->txpos = e->rxlen = e->rxwant = 0;
+   }
+   e->present = present;
+   e->drop = drop;
+}
+
+unsigned int
+dfemu_frames (dfemu_t * e)
+{
+   return e->frames;
+}
+
+const unsigned char *
+dfemu_uid (dfemu_t * e)
+{
+   return e->uid;
+}
+
+static int
+respond (dfemu_t * e, unsigned char status, unsigned int len, const unsigned char *data, int enc)
+{                               /* Set up response, adding CMAC or encryption if authenticated */
+   e->txpos = 0;
+   e->tx[0] = status;
+   if (len)
+      memcpy (e->tx + 1, data, len);
+   e->txlen = 1 + len;
+   if (status != OK && status != MORE)
+   {
+      deauth (e);
+      e->txlen = 1;
+   } else if (e->blocklen && status == OK)
+   {
+      if (enc)
+      {                         /* CRC and encrypt */
+         e->tx[e->txlen] = status;
+         unsigned int c = df_crc (len + 1, e->tx + 1);
+         e->txlen = 1 + len;
+         e->tx[e->txlen++] = c;
+         e->tx[e->txlen++] = c >> 8;
+         e->tx[e->txlen++] = c >> 16;
+         e->tx[e->txlen++] = c >> 24;
+         while ((e->txlen - 1) % e->blocklen)
+            e->tx[e->txlen++] = 0;
+         cbc (e, e->cipher, e->blocklen, e->sk0, 1, e->tx + 1, e->txlen - 1);
+      } else
+      {                         /* CMAC */
+         e->tx[e->txlen] = status;
+         cmac (e, len + 1, e->tx + 1);
+         memcpy (e->tx + e->txlen, e->iv, 8);
+         e->txlen += 8;
+      }
+   }
+   return 0;
+}
+
+#define	fail(s)	return respond(e,s,0,NULL,0)
+#define	ok(l,d)	return respond(e,OK,l,d,0)
+#define	b2(n)	(c[(n)]+(c[(n)+1]<<8))
+#define	b3(n)	(c[(n)]+(c[(n)+1]<<8)+(c[(n)+2]<<16))
+#define	b4(n)	(c[(n)]+(c[(n)+1]<<8)+(c[(n)+2]<<16)+(c[(n)+3]<<24))
+
+static int
+authkey (dfemu_t * e, unsigned char keyno)
+{                               /* Authenticated with this key */
+   return e->blocklen && e->keyno == keyno;
+}
+
+static int
+rights (dfemu_t * e, unsigned short a, int read, int write)
+{                               /* Check access rights, -1 if not allowed, 0 for plain, 1 for comms as file */
+   unsigned char k[2] = { 0xF, 0xF };
+   int n = 0;
+   if (read)
+      k[n++] = (a >> 12) & 15;
+   if (write)
+      k[n++] = (a >> 8) & 15;
+   unsigned char rw = (a >> 4) & 15;
+   if (k[0] == 0xE || k[1] == 0xE || rw == 0xE)
+      return e->blocklen ? 1 : 0;
+   if ((k[0] < 14 && authkey (e, k[0])) || (k[1] < 14 && authkey (e, k[1])) || (rw < 14 && authkey (e, rw)))
+      return 1;
+   return -1;
+}
+
+static int
+unwrap (dfemu_t * e, unsigned char *c, unsigned int *lenp, int mode, unsigned int from)
+{                               /* Check incoming command, mode 0 plain, 1 CMAC appended, 2 encrypted with CRC, returns 0 if OK */
+   unsigned int len = *lenp;
+   if (!e->blocklen)
+      return 0;
+   if (mode == 2)
+   {
+      if (len <= from || (len - from) % e->blocklen)
+         return LENGTH;
+      cbc (e, e->cipher, e->blocklen, e->sk0, 0, c + from, len - from);
+      /* Strip padding, find CRC */
+      while (len > from + 4)
+      {
+         unsigned int crc = b4 (len - 4);
+         if (crc == df_crc (len - 4, c))
+            break;
+         len--;
+      }
+      if (len <= from + 4)
+         return INTEGRITY;
+      *lenp = len - 4;
+      return 0;
+   }
+   if (mode == 1)
+   {
+      if (len < 9)
+         return LENGTH;
+      len -= 8;
+      unsigned char mac[8];
+      memcpy (mac, c + len, 8);
+      cmac (e, len, c);
+      if (memcmp (mac, e->iv, 8))
+         return INTEGRITY;
+      *lenp = len;
+      return 0;
+   }
+   cmac (e, len, c);
+   return 0;
+}
+
+static file_t *
+getfile (dfemu_t * e, unsigned char fileno)
+{
+   if (fileno >= FILES || !e->sel->file[fileno].type)
+      return NULL;
+   return &e->sel->file[fileno];
+}
+
+static int
+filemode (file_t * f, int a)
+{                               /* Comms mode for file, 0 plain, 1 CMAC, 2 encrypted */
+   if (!a)
+      return 0;
+   if (f->comms & DF_MODE_ENC)
+      return 2;
+   if (f->comms & DF_MODE_CMAC)
+      return 1;
+   return 0;
+}
+
+static int
+authenticate (dfemu_t * e, unsigned char *c, unsigned int len)
+{                               /* Start authentication */
+   unsigned char keyno = c[1];
+   deauth (e);
+   if (len != 2)
+      fail (LENGTH);
+   if (keyno >= (e->sel->keys & 15))
+      fail (NO_SUCH_KEY);
+   int aes = (e->sel->keys & 0x80) ? 1 : 0;
+   if ((*c == 0xAA) != aes)
+      fail (AUTH_ERROR);
+   e->blocklen = aes ? 16 : 8;
+   e->cipher = aes ? EVP_aes_128_cbc () : EVP_des_ede_cbc ();
+   e->authing = keyno;
+   fill_random (e->rnd, e->blocklen);
+   unsigned char buf[16];
+   memcpy (buf, e->rnd, e->blocklen);
+   memset (e->iv, 0, sizeof (e->iv));
+   cbc (e, e->cipher, e->blocklen, e->sel->key[keyno], 1, buf, e->blocklen);
+   unsigned char b = e->blocklen;
+   e->blocklen = 0;             /* Not authenticated yet */
+   respond (e, MORE, b, buf, 0);
+   e->blocklen = b;
+   e->keyno = -1;
+   return 0;
+}
+
+static int
+handshake (dfemu_t * e, unsigned char *c, unsigned int len)
+{                               /* Second part of authentication */
+   int keyno = e->authing;
+   unsigned char b = e->blocklen;
+   e->authing = -1;
+   e->blocklen = 0;
+   if (len != 1 + b * 2)
+      fail (LENGTH);
+   const unsigned char *key = e->sel->key[keyno];
+   cbc (e, e->cipher, b, key, 0, c + 1, b * 2);
+   unsigned char *a = c + 1,
+      *bb = c + 1 + b;
+   if (memcmp (bb, e->rnd + 1, b - 1) || bb[b - 1] != e->rnd[0])
+      fail (AUTH_ERROR);
+   unsigned char r[16];
+   memcpy (r, a + 1, b - 1);
+   r[b - 1] = a[0];
+   cbc (e, e->cipher, b, key, 1, r, b);
+   /* Session key */
+   memcpy (e->sk0, a, 4);
+   memcpy (e->sk0 + 4, e->rnd, 4);
+   if (b == 8)
+      memcpy (e->sk0 + 8, e->sk0, 8);
+   else
+   {
+      memcpy (e->sk0 + 8, a + 12, 4);
+      memcpy (e->sk0 + 12, e->rnd + 12, 4);
+   }
+   memset (e->iv, 0, sizeof (e->iv));
+   memset (e->sk1, 0, sizeof (e->sk1));
+   cbc (e, e->cipher, b, e->sk0, 1, e->sk1, b);
+   subkey (e->sk1, b);
+   memcpy (e->sk2, e->sk1, b);
+   subkey (e->sk2, b);
+   memset (e->iv, 0, sizeof (e->iv));
+   respond (e, OK, b, r, 0);
+   e->blocklen = b;
+   e->keyno = keyno;
+   return 0;
+}
+
+static int
+change_key (dfemu_t * e, unsigned char *c, unsigned int len)
+{
+   if (!e->blocklen)
+      fail (PERMISSION);
+   unsigned char keyno = c[1] & 15;
+   app_t *a = e->sel;
+   if (keyno >= (a->keys & 15))
+      fail (NO_SUCH_KEY);
+   if (len < 2 || (len - 2) % e->blocklen)
+      fail (LENGTH);
+   cbc (e, e->cipher, e->blocklen, e->sk0, 0, c + 2, len - 2);
+   unsigned char ca = a->settings >> 4;
+   if (a == &e->picc || !keyno)
+   {
+      if (e->keyno || !(a->settings & DF_SET_MASTER_CHANGE))
+         fail (PERMISSION);
+   } else if (ca == 0xF || (ca == 0xE ? e->keyno != keyno : e->keyno != ca))
+      fail (PERMISSION);
+   unsigned char key[16];
+   memcpy (key, c + 2, 16);
+   unsigned char ver = c[18];
+   if (keyno != e->keyno)
+   {                            /* XOR with old key, and second CRC */
+      unsigned char x[16];
+      for (int q = 0; q < 16; q++)
+         x[q] = key[q] ^ a->key[keyno][q];
+      if (b4 (23) != df_crc (16, x))
+         fail (INTEGRITY);
+      unsigned char t[19];
+      memcpy (t, c, 19);
+      if (b4 (19) != df_crc (19, t))
+      {
+         memcpy (t + 2, x, 16);
+         if (b4 (19) != df_crc (19, t))
+            fail (INTEGRITY);
+      }
+      memcpy (key, x, 16);
+   } else if (b4 (19) != df_crc (19, c))
+      fail (INTEGRITY);
+   memcpy (a->key[keyno], key, 16);
+   a->ver[keyno] = ver;
+   if (a == &e->picc && (c[1] & 0x80))
+      a->keys = 0x81;           /* Now AES */
+   if (keyno == e->keyno)
+   {                            /* Changed own key, not authenticated any more */
+      deauth (e);
+      ok (0, NULL);
+   }
+   ok (0, NULL);
+}
+
+static int
+command (dfemu_t * e, unsigned char *c, unsigned int len)
+{                               /* Process a command */
+   app_t *a = e->sel;
+   int picc = (a == &e->picc);
+   int master = authkey (e, 0);
+   switch (*c)
+   {
+   case 0xAA:                  /* Authenticate AES */
+   case 0x1A:                  /* Authenticate ISO */
+   case 0x0A:                  /* Authenticate native */
+      return authenticate (e, c, len);
+   case 0x5A:                  /* Select application */
+      {
+         abort_txn (e);
+         deauth (e);
+         if (len != 4)
+            fail (LENGTH);
+         if (!c[1] && !c[2] && !c[3])
+         {
+            e->sel = &e->picc;
+            ok (0, NULL);
+         }
+         for (int i = 0; i < APPS; i++)
+            if (e->app[i] && !memcmp (e->app[i]->aid, c + 1, 3))
+            {
+               e->sel = e->app[i];
+               ok (0, NULL);
+            }
+         e->sel = &e->picc;
+         fail (APP_NOT_FOUND);
+      }
+   }
+   /* Commands that may be CMAC'd or encrypted, so check after unwrapping */
+   int s;
+   switch (*c)
+   {
+   case 0xC4:                  /* Change key */
+      return change_key (e, c, len);
+   case 0x54:                  /* Change key settings */
+      if (!master)
+         fail (PERMISSION);
+      if ((s = unwrap (e, c, &len, 2, 1)))
+         fail (s);
+      a->settings = c[1];
+      ok (0, NULL);
+   case 0x5C:                  /* Set configuration */
+      if (!picc || !master)
+         fail (PERMISSION);
+      if ((s = unwrap (e, c, &len, 2, 2)))
+         fail (s);
+      e->config = c[2];
+      ok (0, NULL);
+   case 0x5F:                  /* Change file settings */
+      {
+         file_t *f = getfile (e, c[1]);
+         if (!f)
+            fail (FILE_NOT_FOUND);
+         unsigned char ca = f->access & 15;
+         if (ca != 0xE && !authkey (e, ca))
+            fail (PERMISSION);
+         if ((s = unwrap (e, c, &len, ca == 0xE ? 0 : 2, 2)))
+            fail (s);
+         f->comms = c[2];
+         f->access = b2 (3);
+         ok (0, NULL);
+      }
+   case 0x3D:                  /* Write data */
+   case 0x3B:                  /* Write record */
+      {
+         file_t *f = getfile (e, c[1]);
+         if (!f)
+            fail (FILE_NOT_FOUND);
+         int m = rights (e, f->access, 0, 1);
+         if (m < 0)
+            fail (PERMISSION);
+         if ((s = unwrap (e, c, &len, filemode (f, m), 8)))
+            fail (s);
+         unsigned int o = b3 (2),
+            l = b3 (5);
+         if (len < 8 + l)
+            fail (LENGTH);
+         if (*c == 0x3D)
+         {
+            if (f->type != 'D' && f->type != 'B')
+               fail (PARAMETER);
+            if (o + l > f->size)
+               fail (BOUNDARY);
+            memcpy ((f->type == 'B' ? f->backup : f->data) + o, c + 8, l);
+         } else
+         {
+            if (f->type != 'L' && f->type != 'C')
+               fail (PARAMETER);
+            if (o + l > f->size)
+               fail (BOUNDARY);
+            if (f->type == 'L' && f->count >= f->recs - 1)
+               fail (BOUNDARY);
+            if (!f->pending)
+               memset (f->backup, 0, f->size);
+            memcpy (f->backup + o, c + 8, l);
+            f->pending = 1;
+         }
+         ok (0, NULL);
+      }
+   case 0x0C:                  /* Credit */
+   case 0x1C:                  /* Limited credit */
+   case 0xDC:                  /* Debit */
+      {
+         file_t *f = getfile (e, c[1]);
+         if (!f)
+            fail (FILE_NOT_FOUND);
+         if (f->type != 'V')
+            fail (PARAMETER);
+         int m = rights (e, f->access, *c == 0xDC, *c != 0x0C);
+         if (m < 0)
+            fail (PERMISSION);
+         if ((s = unwrap (e, c, &len, m && (f->comms & DF_MODE_CMAC) ? 1 : 0, 2)))
+            fail (s);
+         if (len != 6)
+            fail (LENGTH);
+         int d = b4 (2);
+         if (d < 0)
+            fail (PARAMETER);
+         if (*c == 0xDC)
+            d = -d;
+         if (*c == 0x1C && (!f->lc || d > f->limited))
+            fail (PERMISSION);
+         long long v = (long long) f->value + f->delta + d;
+         if (v < f->min || v > f->max)
+            fail (BOUNDARY);
+         f->delta += d;
+         ok (0, NULL);
+      }
+   }
+   /* Plain commands */
+   if ((s = unwrap (e, c, &len, 0, 0)))
+      fail (s);
+   switch (*c)
+   {
+   case 0x60:                  /* Get version */
+      {
+         unsigned char v[28] = { 0x04, 0x01, 0x01, 0x01, 0x00, 0x18, 0x05,
+            0x04, 0x01, 0x01, 0x01, 0x04, 0x18, 0x05
+         };
+         memcpy (v + 14, e->uid, 7);
+         v[26] = 0x22;
+         v[27] = 0x19;
+         ok (28, v);
+      }
+   case 0x45:                  /* Get key settings */
+      if (!master && !(a->settings & DF_SET_LIST))
+         fail (PERMISSION);
+      {
+         unsigned char r[2] = { a->settings, a->keys };
+         ok (2, r);
+      }
+   case 0x64:                  /* Get key version */
+      if (len != 2)
+         fail (LENGTH);
+      if ((c[1] & 15) >= (a->keys & 15))
+         fail (NO_SUCH_KEY);
+      ok (1, &a->ver[c[1] & 15]);
+   case 0x6A:                  /* Get application IDs */
+      if (!picc)
+         fail (PERMISSION);
+      if (!master && !(a->settings & DF_SET_LIST))
+         fail (PERMISSION);
+      {
+         unsigned char r[APPS * 3];
+         int n = 0;
+         for (int i = 0; i < APPS; i++)
+            if (e->app[i])
+            {
+               memcpy (r + n, e->app[i]->aid, 3);
+               n += 3;
+            }
+         ok (n, r);
+      }
+   case 0xCA:                  /* Create application */
+      if (!picc)
+         fail (PERMISSION);
+      if (!master && !(a->settings & DF_SET_CREATE))
+         fail (PERMISSION);
+      if (len != 6)
+         fail (LENGTH);
+      if ((c[5] & 15) > 14 || !(c[5] & 15))
+         fail (PARAMETER);
+      {
+         int i;
+         for (i = 0; i < APPS; i++)
+            if (e->app[i] && !memcmp (e->app[i]->aid, c + 1, 3))
+               fail (DUPLICATE);
+         for (i = 0; i < APPS && e->app[i]; i++);
+         if (i == APPS || memory (e) < 64)
+            fail (OUT_OF_EEPROM);
+         app_t *n = calloc (1, sizeof (*n));
+         memcpy (n->aid, c + 1, 3);
+         n->settings = c[4];
+         n->keys = c[5];
+         e->app[i] = n;
+         ok (0, NULL);
+      }
+   case 0xDA:                  /* Delete application */
+      if (!picc || !master)
+         fail (PERMISSION);
+      if (len != 4)
+         fail (LENGTH);
+      for (int i = 0; i < APPS; i++)
+         if (e->app[i] && !memcmp (e->app[i]->aid, c + 1, 3))
+         {
+            free_app (e->app[i]);
+            e->app[i] = NULL;
+            ok (0, NULL);
+         }
+      fail (APP_NOT_FOUND);
+   case 0xFC:                  /* Format */
+      if (!picc || !master)
+         fail (PERMISSION);
+      if (e->config & 1)
+         fail (PERMISSION);
+      for (int i = 0; i < APPS; i++)
+         if (e->app[i])
+         {
+            free_app (e->app[i]);
+            e->app[i] = NULL;
+         }
+      ok (0, NULL);
+   case 0x6E:                  /* Free memory */
+      {
+         unsigned int m = memory (e);
+         unsigned char r[3] = { m, m >> 8, m >> 16 };
+         ok (3, r);
+      }
+   case 0x51:                  /* Get UID */
+      if (!e->blocklen)
+         fail (PERMISSION);
+      return respond (e, OK, 7, e->uid, 1);
+   case 0x6F:                  /* Get file IDs */
+      if (picc)
+         fail (PERMISSION);
+      if (!master && !(a->settings & DF_SET_LIST))
+         fail (PERMISSION);
+      {
+         unsigned char r[FILES];
+         int n = 0;
+         for (int i = 0; i < FILES; i++)
+            if (a->file[i].type)
+               r[n++] = i;
+         ok (n, r);
+      }
+   case 0xF5:                  /* Get file settings */
+      if (!master && !(a->settings & DF_SET_LIST))
+         fail (PERMISSION);
+      {
+         file_t *f = getfile (e, c[1]);
+         if (!f)
+            fail (FILE_NOT_FOUND);
+         unsigned char r[17];
+         int n = 0;
+         r[n++] = strchr ("DBVLC", f->type) - "DBVLC";
+         r[n++] = f->comms;
+         r[n++] = f->access;
+         r[n++] = f->access >> 8;
+         if (f->type == 'V')
+         {
+            for (int i = 0; i < 4; i++)
+               r[n++] = f->min >> (i * 8);
+            for (int i = 0; i < 4; i++)
+               r[n++] = f->max >> (i * 8);
+            for (int i = 0; i < 4; i++)
+               r[n++] = f->limited >> (i * 8);
+            r[n++] = f->lc;
+         } else
+         {
+            for (int i = 0; i < 3; i++)
+               r[n++] = f->size >> (i * 8);
+            if (f->type == 'L' || f->type == 'C')
+            {
+               for (int i = 0; i < 3; i++)
+                  r[n++] = f->recs >> (i * 8);
+               for (int i = 0; i < 3; i++)
+                  r[n++] = f->count >> (i * 8);
+            }
+         }
+         ok (n, r);
+      }
+   case 0xCD:                  /* Create data file */
+   case 0xCB:                  /* Create backup file */
+   case 0xCC:                  /* Create value file */
+   case 0xC0:                  /* Create cyclic file */
+   case 0xC1:                  /* Create linear file */
+      if (picc)
+         fail (PERMISSION);
+      if (!master && !(a->settings & DF_SET_CREATE))
+         fail (PERMISSION);
+      if (len < 5 || c[1] >= FILES)
+         fail (PARAMETER);
+      if (a->file[c[1]].type)
+         fail (DUPLICATE);
+      {
+         file_t *f = &a->file[c[1]];
+         f->comms = c[2];
+         f->access = b2 (3);
+         if (*c == 0xCC)
+         {
+            if (len != 18)
+               fail (LENGTH);
+            f->min = b4 (5);
+            f->max = b4 (9);
+            f->value = b4 (13);
+            f->lc = c[17];
+            f->type = 'V';
+            ok (0, NULL);
+         }
+         f->size = b3 (5);
+         if (*c == 0xC0 || *c == 0xC1)
+         {
+            if (len != 11)
+               fail (LENGTH);
+            f->recs = b3 (8);
+            if (!f->size || f->recs < 2)
+               fail (PARAMETER);
+            if (memory (e) < f->size * f->recs + 32)
+               fail (OUT_OF_EEPROM);
+            f->data = calloc (f->recs, f->size);
+            f->backup = calloc (1, f->size);
+            f->type = (*c == 0xC0 ? 'C' : 'L');
+            ok (0, NULL);
+         }
+         if (len != 8)
+            fail (LENGTH);
+         if (memory (e) < f->size + 32)
+            fail (OUT_OF_EEPROM);
+         f->data = calloc (1, f->size ? : 1);
+         f->backup = calloc (1, f->size ? : 1);
+         f->type = (*c == 0xCD ? 'D' : 'B');
+         ok (0, NULL);
+      }
+   case 0xDF:                  /* Delete file */
+      if (!master && !(a->settings & DF_SET_CREATE))
+         fail (PERMISSION);
+      {
+         file_t *f = getfile (e, c[1]);
+         if (!f)
+            fail (FILE_NOT_FOUND);
+         free (f->data);
+         free (f->backup);
+         memset (f, 0, sizeof (*f));
+         ok (0, NULL);
+      }
+   case 0xBD:                  /* Read data */
+   case 0xBB:                  /* Read records */
+      {
+         file_t *f = getfile (e, c[1]);
+         if (!f)
+            fail (FILE_NOT_FOUND);
+         int m = rights (e, f->access, 1, 0);
+         if (m < 0)
+            fail (PERMISSION);
+         if (len != 8)
+            fail (LENGTH);
+         unsigned int o = b3 (2),
+            l = b3 (5);
+         unsigned char r[900];
+         if (*c == 0xBD)
+         {
+            if (f->type != 'D' && f->type != 'B')
+               fail (PARAMETER);
+            if (!l)
+               l = f->size - o;
+            if (o + l > f->size || l > sizeof (r))
+               fail (BOUNDARY);
+            memcpy (r, f->data + o, l);
+         } else
+         {
+            if (f->type != 'L' && f->type != 'C')
+               fail (PARAMETER);
+            if (!l)
+               l = f->count - o;
+            if (o + l > f->count || l * f->size > sizeof (r))
+               fail (BOUNDARY);
+            for (unsigned int i = 0; i < l; i++)
+               memcpy (r + i * f->size, f->data + (f->count - 1 - o - i) * f->size, f->size);
+            l *= f->size;
+         }
+         return respond (e, OK, l, r, filemode (f, m) == 2);
+      }
+   case 0x6C:                  /* Get value */
+      {
+         file_t *f = getfile (e, c[1]);
+         if (!f)
+            fail (FILE_NOT_FOUND);
+         if (f->type != 'V')
+            fail (PARAMETER);
+         int m = rights (e, f->access, 1, 1);
+         if (m < 0)
+            fail (PERMISSION);
+         unsigned char r[4] = { f->value, f->value >> 8, f->value >> 16, f->value >> 24 };
+         return respond (e, OK, 4, r, filemode (f, m) == 2);
+      }
+   case 0xC7:                  /* Commit */
+      for (int i = 0; i < FILES; i++)
+      {
+         file_t *f = &a->file[i];
+         if (f->type == 'B')
+            memcpy (f->data, f->backup, f->size);
+         if (f->type == 'V')
+         {
+            f->value += f->delta;
+            if (f->delta < 0)
+               f->limited = 0;
+            else if (f->delta > 0)
+               f->limited = f->delta;
+            f->delta = 0;
+         }
+         if ((f->type == 'L' || f->type == 'C') && f->pending)
+         {
+            if (f->count == f->recs - 1)
+            {                   /* Cyclic, drop oldest */
+               memmove (f->data, f->data + f->size, (f->count - 1) * f->size);
+               f->count--;
+            }
+            memcpy (f->data + f->count * f->size, f->backup, f->size);
+            f->count++;
+            f->pending = 0;
+         }
+      }
+      ok (0, NULL);
+   case 0xA7:                  /* Abort */
+      abort_txn (e);
+      ok (0, NULL);
+   }
+   fail (ILLEGAL);
+}
+
+static unsigned int
+want (dfemu_t * e, const unsigned char *c, unsigned int len)
+{                               /* Expected command length, for commands that may be sent with AF chaining */
+   if ((*c != 0x3D && *c != 0x3B) || len < 8)
+      return len;
+   file_t *f = getfile (e, c[1]);
+   if (!f)
+      return len;
+   unsigned int l = 8 + b3 (5);
+   int m = rights (e, f->access, 0, 1);
+   if (m > 0)
+      switch (filemode (f, m))
+      {
+      case 1:
+         l += 8;
+         break;
+      case 2:
+         l = 8 + ((b3 (5) + 4 + e->blocklen - 1) / e->blocklen) * e->blocklen;
+         break;
+      }
+   return l;
+}
+
+int
+dfemu_dx (void *obj, unsigned int len, unsigned char *data, unsigned int max, const char **errstr)
+{                               /* Card data exchange function, see df_dx_func_t, errstr unused as card errors are status bytes */
+   (void) errstr;
+   dfemu_t *e = obj;
+   if (!e->present)
+      return 0;
+   if (e->drop && !--e->drop)
+   {
+      dfemu_present (e, 0, 0);
+      return 0;
+   }
+   e->frames++;
+   if (!len)
+      return -1;
+   if (*data == MORE && e->txpos && e->txpos < e->txlen)
+   {                            /* Next part of response */
+   } else if (*data == MORE && e->rxwant > e->rxlen)
+   {                            /* Next part of command */
+      if (e->rxlen + len - 1 > sizeof (e->rx))
+         return -1;
+      memcpy (e->rx + e->rxlen, data + 1, len - 1);
+      e->rxlen += len - 1;
+      if (e->rxlen < e->rxwant)
+      {
+         *data = MORE;
+         return 1;
+      }
+      e->rxwant = 0;
+      command (e, e->rx, e->rxlen);
+   } else if (*data == MORE && e->authing >= 0)
+   {                            /* Authentication response */
+      e->txpos = 0;
+      e->txlen = 0;
+      handshake (e, data, len);
+   } else
+   {                            /* New command */
+      e->txpos = 0;
+      e->txlen = 0;
+      e->rxwant = 0;
+      if (e->authing >= 0)
+         deauth (e);
+      if (len > sizeof (e->rx))
+         return -1;
+      memcpy (e->rx, data, len);
+      e->rxlen = len;
+      unsigned int w = want (e, data, len);
+      if (w > len)
+      {
+         e->rxwant = w;
+         *data = MORE;
+         return 1;
+      }
+      command (e, e->rx, e->rxlen);
+   }
+   /* Send (next part of) response */
+   if (!e->txpos)
+      e->txpos = 1;
+   unsigned int l = e->txlen - e->txpos;
+   if (l > e->frame - 1)
+      l = e->frame - 1;
+   if (l + 1 > max)
+      return -1;
+   memcpy (data + 1, e->tx + e->txpos, l);
+   e->txpos += l;
+   *data = (e->txpos < e->txlen ? MORE : e->tx[0]);
+   if (e->txpos >= e->txlen)
+      e->txpos = e->txlen = 0;
+   return l + 1;
+}
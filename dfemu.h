@@ -0,0 +1,10 @@
+/* Emulated DESFire card, for testing without hardware */
+/* Each card is separate, so cards can be used from separate threads */
+
+typedef struct dfemu_s dfemu_t;
+dfemu_t *dfemu_new(void);
+void dfemu_free(dfemu_t *);
+void dfemu_present(dfemu_t *, int present, unsigned int drop);	/* Card in or out of field, drop is frames until it leaves (0 for never) */
+unsigned int dfemu_frames(dfemu_t *);
+const unsigned char *dfemu_uid(dfemu_t *);
+int dfemu_dx(void *obj, unsigned int len, unsigned char *data, unsigned int max, const char **errstr);	/* df_dx_func_t, obj is dfemu_t */
@@ -18,6 +18,12 @@
 #ifndef	DESFIREAES_H
 #define DESFIREAES_H
 
+#include <stdio.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
 // Types
 
 // The data exchange function talks to the card
@@ -30,10 +36,63 @@
 // Note errstr will be pre-set on calling to a constant string that is the command being execute, for debug
 typedef int df_dx_func_t(void *obj, unsigned int len, unsigned char *data, unsigned int max, const char **errstr);
 
+typedef struct df_dx_s df_dx_t;
+struct df_dx_s {                // State of a data exchange (see df_dx_start)
+   unsigned char *buf;          // Buffer for command and response
+   unsigned char *p;            // Current frame
+   unsigned int max;            // Buffer size
+   unsigned int len;            // Command length, or current frame length
+   unsigned int *rlen;          // Where to store response length
+   const char *name;            // Name for current frame
+   const char *err;             // Error from frame exchange
+   unsigned char dxfail;        // err is from the df_dx_func_t (transport) rather than the response
+   unsigned char cmd;           // Command
+   unsigned int rxenc;          // Expected encrypted response length
+   unsigned char state;         // Exchange state
+   unsigned int txmax;          // Command frame size for this exchange (from df_t)
+   unsigned char tmp[17];       // Buffer if none supplied
+   const char *cmdname;         // Name passed to df_dx_start (name changes for AF frames)
+   unsigned long long t0;       // When started (only if stats)
+   unsigned long long t1;       // When current frame sent (only if stats)
+   unsigned long long dxns;     // Time in frame exchanges (only if stats)
+   unsigned long long cryptons; // Time in df_dx_start / df_dx_end, i.e. CMAC, encryption and checks (only if stats)
+   unsigned int frames;         // Frames (only if stats)
+   unsigned int txbytes;        // Bytes sent (only if stats)
+   unsigned int rxbytes;        // Bytes received (only if stats)
+};
+
+// Per command statistics, see df_stats_t
+#define	DF_STATS_BUCKETS	256     // Histogram buckets, 8 per power of 2 ns, see df_stats_bucket
+#define	DF_STATS_MAX		32      // Command names recorded
+typedef struct df_stat_s df_stat_t;
+struct df_stat_s {
+   const char *name;            // Command name as passed to df_dx
+   unsigned int calls;          // df_dx calls
+   unsigned int errors;         // Calls that returned an error
+   unsigned int frames;         // Frame exchanges, more than calls if AF chaining
+   unsigned long long txbytes;  // Bytes sent
+   unsigned long long rxbytes;  // Bytes received
+   unsigned long long ns;       // Total time
+   unsigned long long dxns;     // Time in frame exchanges (the dx function, or between df_dx_frame and df_dx_response)
+   unsigned long long cryptons; // Time in CMAC, encryption and checks
+   unsigned long long maxns;    // Slowest call
+   unsigned int hist[DF_STATS_BUCKETS]; // Call time histogram
+};
+typedef struct df_stats_s df_stats_t;
+struct df_stats_s {
+   unsigned int count;          // Entries in stat
+   unsigned int overflow;       // Calls not recorded as stat full
+   df_stat_t stat[DF_STATS_MAX];
+};
+
+// Debug output function, called with obj from df_t, a label, and data
+typedef void df_debug_func_t(void *obj, const char *prefix, unsigned int len, const unsigned char *data);
+
 typedef struct df_s df_t;
 struct df_s {
    void *obj;                   // Opaque, passed to df_card_func
    df_dx_func_t *dx;            // Card data exchange function
+   df_debug_func_t *debug;      // Debug output (NULL for none), can be set after df_init
 #ifndef	ESP_PLATFORM
    EVP_CIPHER_CTX *ctx;
    const EVP_CIPHER *cipher;    // Current cipher DES or AES (DES used for formatting to AES)
@@ -45,9 +104,14 @@ struct df_s {
    unsigned char sk2[16];       // CMAC Sub key 2
    unsigned char cmac[16];      // Current CMAC IV
    unsigned char aid[3];        // Current selected AID
+   unsigned int dxcount;        // Count of frame exchanges with card
+   unsigned int txmax;          // Largest command frame, longer commands are sent in AF parts, can be set after df_init
+   df_dx_t dxs;                 // Data exchange in progress
+   df_stats_t *stats;           // Per command statistics (NULL for none), can be set after df_init
 };
 
 // Some useful definitions
+#define	DF_TXMAX		55      // Default command frame for 64 byte card frame (FSC) less ISO 14443-4 overhead
 #define	DF_MODE_CMAC		0x01    // Check CMAC, not used as checked if authenticated but allows <<2 on comms mode
 #define	DF_MODE_ENC		0x02    // Encrypted Rx, and check CRC if expected len set
 
@@ -57,6 +121,15 @@ struct df_s {
 #define DF_SET_CHANGE		0x08
 #define	DF_SET_DEFAULT		0x0F	// Default key settings for application
 
+// File access rights, nibbles of access as used by df_get_file_settings and df_create_file
+#define	DF_ACCESS_READ(a)	(((a)>>12)&15)  // Read key
+#define	DF_ACCESS_WRITE(a)	(((a)>>8)&15)   // Write key
+#define	DF_ACCESS_RW(a)		(((a)>>4)&15)   // Read and write key
+#define	DF_ACCESS_CHANGE(a)	((a)&15)        // Change access rights key
+#define	DF_ACCESS_FREE		0x0E    // Free access, no authentication needed
+#define	DF_ACCESS_NEVER		0x0F    // No access
+#define	DF_ACCESS_UNKNOWN	0xFFFF  // Access not known, used to ask for it to be loaded
+
 // Functions
 // All of these functions that return a const char * return NULL for "OK" or an error message
 // An empty string error message is returned for "card gone"
@@ -68,6 +141,17 @@ unsigned int df_hex(unsigned int max, unsigned char *dst, const char *src);
 
 // Initialise
 const char *df_init(df_t *, void *obj, df_dx_func_t * dx);
+// Free anything allocated by df_init, and clear session keys
+void df_free(df_t *);
+
+// Session hand off
+// The session (selected AID, authentication, session keys and CMAC IV) can be exported and then imported in to another df_t, in another thread or process, to carry on without authenticating again
+// The snapshot does not include obj, dx, debug or the cipher context, the importing df_t keeps its own (from df_init)
+// Exporting deauthenticates the exporting df_t and zeroes its session keys, as only one side can carry on the CMAC chain
+// The snapshot includes the session keys, so handle as securely as a key
+#define	DF_SESSION_LEN	74
+const char *df_export(df_t *, unsigned char snapshot[DF_SESSION_LEN]);
+const char *df_import(df_t *, const unsigned char snapshot[DF_SESSION_LEN]);
 
 // Low level data exchange
 // Data exchange, sends a command and receives a response
@@ -109,8 +193,45 @@ const char *df_init(df_t *, void *obj, df_dx_func_t * dx);
 // Examples
 //  Cmd 54 with txenc 1, rxenc 0, and len 2, adds CRC and encrypts from byte 1, returns rlen 1 (status byte)
 //  Cmd 51 with txenc 0, rxenc 8, and len 1, sends 51, receives 17 bytes, decrypts and checks CRC at byte 8, returns rlen 8 (status + 7 byte UID)
-const char *df_dx(df_t * d, unsigned char cmd, unsigned int max, unsigned char *data, unsigned int txlen, unsigned char txenc, unsigned char rxenc, unsigned int *rlen, const char *name);
+const char *df_dx(df_t * d, unsigned char cmd, unsigned int max, unsigned char *data, unsigned int txlen, unsigned char txenc, unsigned int rxenc, unsigned int *rlen, const char *name);
 const char *df_err(unsigned char c);	// Error code name
+// Errors are strings, but these, and df_err() for card status, are always the same address so can be compared as pointers
+extern const char df_err_dx[];	// Frame exchange failed (df_dx_func_t returned -ve)
+extern const char df_err_auth[];	// Card's authentication response did not match
+extern const char df_err_crc[];	// Encrypted response CRC did not match
+extern const char df_err_cmac[];	// Response CMAC did not match
+extern const char df_err_nokey[];	// No key in key ring for the card's key version
+extern const char df_err_stack[];	// Read/write buffer would not fit on the df_async stack
+
+// Non blocking data exchange
+// df_dx does the following, allowing the frame exchanges to be done by the caller (e.g. from an event loop) instead of by d->dx
+//  e=df_dx_start(...); // Same args as df_dx, returns error if cannot start
+//  while((len=df_dx_frame(d,&data,&max,&name))) // Frame to send, len bytes from data, response in to data, max bytes
+//     df_dx_response(d,b,errstr); // Response length (0 for card gone, -ve for error), as returned from a df_dx_func_t
+//  e=df_dx_end(d); // Result as df_dx
+const char *df_dx_start(df_t * d, unsigned char cmd, unsigned int max, unsigned char *data, unsigned int txlen, unsigned char txenc, unsigned int rxenc, unsigned int *rlen, const char *name);
+unsigned int df_dx_frame(df_t * d, unsigned char **data, unsigned int *max, const char **name);
+void df_dx_response(df_t * d, int b, const char *errstr);
+const char *df_dx_end(df_t * d);
+
+#if	!defined(ESP_PLATFORM) && defined(__linux__)
+#define	DF_ASYNC                // df_async is available (uses ucontext, which is Linux only here)
+// Resumable (non blocking) form of any df_* functions
+// The function is run on its own stack, and returns to the caller each time a frame needs exchanging with the card
+//  a=df_async_new(d,0); // Sets up for d, stack size (0 for default), d->dx is not used until df_async_free
+//  len=df_async_start(a,func,arg,&data,&max); // Start func(d,arg), len is frame to send, or 0 if func is done
+//  len=df_async_response(a,b,errstr,&data,&max); // Response to frame (as from a df_dx_func_t), len is next frame, or 0 if done
+//  e=df_async_result(a); // Result from func
+//  df_async_free(a); // Puts d->dx back
+// Reads and writes have a buffer the size of the data on the stack, those that would not fit return df_err_stack
+typedef const char *df_async_func_t(df_t * d, void *arg);
+typedef struct df_async_s df_async_t;
+df_async_t *df_async_new(df_t * d, unsigned int stack);
+unsigned int df_async_start(df_async_t *, df_async_func_t *, void *arg, unsigned char **data, unsigned int *max);
+unsigned int df_async_response(df_async_t *, int b, const char *errstr, unsigned char **data, unsigned int *max);
+const char *df_async_result(df_async_t *);
+void df_async_free(df_async_t *);
+#endif
 
 // Main application functions
 
@@ -122,6 +243,9 @@ const char *df_get_version(df_t * d, unsigned char ver[28]);
 const char *df_select_application(df_t *, const unsigned char aid[3]);
 // Format card, and set var/key specified
 const char *df_format(df_t *, unsigned char keyver, const unsigned char key[16]);
+// Report how df_format would authenticate (key type and order of keys tried), without changing anything
+// Uses key settings, key version and hardware version queries, which are cheaper than failed authentications
+const char *df_format_plan(df_t *, unsigned char keyver, const unsigned char key[16], const char **plan);
 // Authenticate with a key
 const char *df_authenticate(df_t *, unsigned char keyno, const unsigned char key[16]);
 #ifndef ESP_PLATFORM
@@ -138,6 +262,13 @@ const char *df_get_key_version(df_t * d, unsigned char keyno, unsigned char *ver
 const char *df_get_key_settings(df_t * d, unsigned char *setting, unsigned char *keynos);
 // Change to new (AES) key
 const char *df_change_key(df_t * d, unsigned char keyno, unsigned char version, const unsigned char old[16], const unsigned char key[16]);
+// Change keys 0 to keys-1 on the current application, from old to key and version (NULL arrays or NULL entries for zero keys)
+// Uses the ChangeKey access (top nibble of key settings) to pick the fewest authentications:
+//  0-D: one session as that key changes all others (XOR with old key form), then that key, then key 0 if different
+//  E: each key must authenticate as itself to change
+// Fails before changing anything if the master key change setting (DF_SET_MASTER_CHANGE) is clear, as key 0 is always changed
+// Leaves the session not authenticated
+const char *df_provision_keys(df_t * d, unsigned char keys, const unsigned char *old[], const unsigned char version[], const unsigned char *key[]);
 // Change settings on current key
 const char *df_change_key_settings(df_t * d, unsigned char settings);
 // Change card settings config
@@ -170,6 +301,13 @@ const char *df_read_data(df_t * d, unsigned char fileno, unsigned char comms, un
 const char *df_read_records(df_t * d, unsigned char fileno, unsigned char comms, unsigned int record, unsigned int recs, unsigned int rsize, unsigned char *data);
 const char *df_get_value(df_t * d, unsigned char fileno, unsigned char comms, unsigned int *value);
 
+// Read data / value, only authenticating if the file access rights need it
+// comms and access are as from df_get_file_settings, if *access is DF_ACCESS_UNKNOWN they are loaded (one query) and stored
+// If read (or read/write) access is free, and not already authenticated, no authentication is done and plain comms are used
+// Otherwise, authenticates with key (NULL for zero key) as the key number from the access rights, unless already authenticated with it
+const char *df_read_data_auto(df_t * d, unsigned char fileno, unsigned char *comms, unsigned short *access, const unsigned char key[16], unsigned int offset, unsigned int len, unsigned char *data);
+const char *df_get_value_auto(df_t * d, unsigned char fileno, unsigned char *comms, unsigned short *access, const unsigned char key[16], unsigned int *value);
+
 // Commit
 const char *df_commit(df_t *);
 // Abort
@@ -180,6 +318,125 @@ const char *df_credit(df_t * d, unsigned char fileno, unsigned char comms, unsig
 const char *df_limited_credit(df_t * d, unsigned char fileno, unsigned char comms, unsigned int delta);
 const char *df_debit(df_t * d, unsigned char fileno, unsigned char comms, unsigned int delta);
 
+// Statistics
+// Set stats in the df_t to record every df_dx (including via df_dx_start and df_async) by command name
+// A df_stats_t can be shared by several df_t in the same thread (it is not locked), zero it (or df_stats_reset) to start
+void df_stats_reset(df_stats_t *);
+const df_stat_t *df_stats_find(const df_stats_t *, const char *name);     // NULL if not seen
+unsigned int df_stats_bucket(unsigned long long ns);    // Histogram bucket for a time
+unsigned long long df_stats_bucket_ns(unsigned int bucket);     // Lowest time in a bucket
+unsigned long long df_stats_percentile(const df_stat_t *, double percent);      // Time (upper end of bucket) for percentile
+void df_stats_dump(const df_stats_t *, FILE *); // Table of all commands
+
+// Transaction runner, resumes if the card briefly leaves the field
+// A transaction is a list of steps, each a function making one or more df_* calls, with flags saying what it does
+// If a step fails because the card went or the exchange failed, the card is reactivated, the last select and authenticate
+// steps are run again, and the transaction carries on from the failed step, so completed steps are not repeated
+// Changes to backup, value and record files not yet committed are lost when the card goes, so the runner goes back to
+// the first such step since the last commit. If the card goes during a commit it is not known if the commit happened,
+// so "Commit status unknown" is returned and the caller has to check the card
+typedef const char *df_txn_func_t(df_t *, void *arg);
+typedef const char *df_txn_reactivate_t(void *obj);     // Get the card back, NULL if ready, "" if it did not come back, else error
+typedef struct df_txn_step_s df_txn_step_t;
+struct df_txn_step_s {
+   df_txn_func_t *func;         // Step
+   void *arg;                   // Passed to func
+   unsigned char flags;         // DF_TXN_ flags
+};
+#define	DF_TXN_SELECT	0x01    // Step selects application, run again on resume
+#define	DF_TXN_AUTH	0x02    // Step authenticates, run again on resume
+#define	DF_TXN_PENDING	0x04    // Step changes a backup, value or record file, needs commit
+#define	DF_TXN_COMMIT	0x08    // Step commits
+typedef struct df_txn_s df_txn_t;
+struct df_txn_s {
+   df_txn_reactivate_t *reactivate;     // Reactivate card (NULL means no resume)
+   void *obj;                   // Passed to reactivate
+   unsigned char retries;       // Resumes allowed
+   unsigned char resumes;       // Resumes done (set by df_txn)
+   unsigned char uidset;        // Set if uid is the card UID, checked after resume if authenticated
+   unsigned char uid[7];        // Card UID
+   unsigned int step;           // Step that failed (set by df_txn)
+};
+const char *df_txn(df_t *, df_txn_t *, unsigned int steps, const df_txn_step_t * step);
+
 unsigned int df_crc(unsigned int len, const unsigned char *data);
 
+// Key ring
+// Holds candidate AES keys per AID and key number, indexed by key version, so the right key can be picked before authenticating
+// (a failed authentication costs a full exchange and ends the session)
+typedef struct df_keyring_key_s df_keyring_key_t;
+struct df_keyring_key_s {
+   unsigned char aid[3];        // AID (000000 for card master key)
+   unsigned char keyno;         // Key number
+   unsigned char version;       // Key version
+   unsigned char key[16];       // AES key
+};
+typedef struct df_keyring_s df_keyring_t;
+struct df_keyring_s {
+   unsigned int num;            // Keys in use
+   unsigned int max;            // Keys allocated
+   df_keyring_key_t *keys;
+};
+
+// Initialise (or just zero the struct)
+void df_keyring_init(df_keyring_t *);
+// Free keys
+void df_keyring_free(df_keyring_t *);
+// Add a key (aid NULL for card master key, key NULL for zero key)
+const char *df_keyring_add(df_keyring_t *, const unsigned char aid[3], unsigned char keyno, unsigned char version, const unsigned char key[16]);
+// Find key for version (aid NULL for card master key), returns NULL if none, after is NULL or previous key returned to find next
+const unsigned char *df_keyring_find(df_keyring_t *, const unsigned char aid[3], unsigned char keyno, unsigned char version, const unsigned char *after);
+// Authenticate on current AID, getting key version (one query) and trying only keys with that version, sets *key to key used
+const char *df_keyring_authenticate(df_t *, df_keyring_t *, unsigned char keyno, const unsigned char **key);
+
+// Card inventory
+typedef struct df_scan_file_s df_scan_file_t;
+struct df_scan_file_s {
+   unsigned char fileno;        // File number
+   char type;                   // File type D/B/V/L/C
+   unsigned char comms;         // As df_get_file_settings
+   unsigned short access;
+   unsigned int size;
+   unsigned int min;
+   unsigned int max;
+   unsigned int recs;
+   unsigned int limited;
+   unsigned char lc;
+   unsigned char got_value;     // Set if value read
+   unsigned int value;          // Value of value file
+};
+typedef struct df_scan_app_s df_scan_app_t;
+struct df_scan_app_s {
+   unsigned char aid[3];        // AID
+   const char *error;           // Set if application could not be fully scanned
+   unsigned char settings;      // Key settings
+   unsigned char keynos;        // Number of keys, and 0x80 for AES
+   unsigned char keyver[14];    // Key versions
+   unsigned int files;          // Number of files
+   df_scan_file_t file[32];
+};
+typedef struct df_scan_s df_scan_t;
+struct df_scan_s {
+   unsigned char ver[28];       // As df_get_version
+   const char *error;           // Set if card level could not be fully scanned
+   unsigned char settings;      // Master key settings
+   unsigned char keynos;        // Master key type (0x80 for AES)
+   unsigned char keyver;        // Master key version
+   unsigned int mem;            // Free memory
+   unsigned int apps;           // Number of applications
+   df_scan_app_t *app;          // Applications (malloc'd)
+   unsigned int dx;             // Frame exchanges used by scan
+};
+
+// Scan whole card in to scan, ring is optional keys for where key settings need authentication to list or read values
+// Queries are ordered to select each application once, read free values before authenticating, and authenticate once per key needed
+// Errors for parts that cannot be read are stored in scan, the return is only for fatal errors (e.g. card gone)
+const char *df_scan(df_t * d, df_keyring_t * ring, df_scan_t * scan);
+// Free scan
+void df_scan_free(df_scan_t * scan);
+
+#ifdef	__cplusplus
+}
+#endif
+
 #endif
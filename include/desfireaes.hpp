@@ -0,0 +1,381 @@
+// DESFire AES access library - C++17 session wrapper
+// (c) Copyright 2019 Andrews & Arnold Adrian Kennard
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// desfire::DesfireSession owns a df_t (df_init in the constructor, df_free in the destructor) and is movable, not copyable.
+// Buffers are passed as desfire::span (std::span for C++20), and fixed size ones (version, UID, AID, key) are checked at compile time.
+// Errors are returned as with the C library, NULL for OK, "" for card gone, else an error string.
+//
+// The simple commands are built from a constexpr table of command descriptors, which give the command byte, how the
+// comms mode applies to tx and rx, and the expected response length, so df_dx is called directly with txenc/rxenc
+// worked out from the descriptor. Commands that change session state (select, authenticate, etc) use the df_* function.
+// Do not move a session while an exchange is in progress (e.g. from a dx function or with df_async).
+
+#ifndef	DESFIREAES_HPP
+#define	DESFIREAES_HPP
+
+#include <array>
+#include <vector>
+#include <cstddef>
+#include <utility>
+#include <stdexcept>
+#include <type_traits>
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+#ifndef	ESP_PLATFORM
+#include <openssl/evp.h>
+#endif
+#include "desfireaes.h"
+
+namespace desfire
+{
+#if __cplusplus >= 202002L
+   using std::dynamic_extent;
+   template < class T, std::size_t E = dynamic_extent > using span = std::span < T, E >;
+#else
+   inline constexpr std::size_t dynamic_extent = static_cast < std::size_t > (-1);
+
+   // Minimal std::span for C++17, just what is needed here
+   template < class T, std::size_t E = dynamic_extent > class span
+   {
+    public:
+      static constexpr std::size_t extent = E;
+      template < std::size_t N, class = std::enable_if_t < E == dynamic_extent || N == E >>
+         constexpr span (T (&a)[N]) noexcept:p (a), n (N)
+      {
+      }
+      template < class U, std::size_t N, class = std::enable_if_t < (E == dynamic_extent || N == E)
+         && std::is_convertible_v < U (*)[], T (*)[] > >> constexpr span (std::array < U, N > &a) noexcept:p (a.data ()), n (N)
+      {
+      }
+      template < class U, std::size_t N, class = std::enable_if_t < (E == dynamic_extent || N == E)
+         && std::is_convertible_v < const U (*)[], T (*)[] > >> constexpr span (const std::array < U, N > &a) noexcept:p (a.data ()),
+         n (N)
+      {
+      }
+      template < class U, std::size_t N, class = std::enable_if_t < (E == dynamic_extent || N == E)
+         && std::is_convertible_v < U (*)[], T (*)[] > >> constexpr span (const span < U, N > &s) noexcept:p (s.data ()), n (s.size ())
+      {
+      }
+      template < std::size_t X = E, class = std::enable_if_t < X == dynamic_extent >>
+         constexpr span (T * p, std::size_t n) noexcept:p (p), n (n)
+      {
+      }
+      constexpr T *data () const noexcept
+      {
+         return p;
+      }
+      constexpr std::size_t size () const noexcept
+      {
+         return n;
+      }
+    private:
+      T * p;
+      std::size_t n;
+   };
+#endif
+
+   // Command descriptors
+   enum class tx : unsigned char
+   {
+      plain,                    // No CMAC or encryption
+      cmac,                     // CMAC if DF_MODE_CMAC
+      comms,                    // Encrypted (after header) if DF_MODE_ENC, else CMAC if DF_MODE_CMAC
+   };
+   enum class rx : unsigned char
+   {
+      plain,                    // Not encrypted (checked by CMAC if authenticated)
+      comms,                    // Encrypted if DF_MODE_ENC
+      enc,                      // Always encrypted
+   };
+   struct command
+   {
+      unsigned char cmd;        // Command byte
+      unsigned char header;     // Bytes (inc command) to send before data, and not encrypted
+      enum tx tx;
+      enum rx rx;
+      unsigned short rlen;      // Expected response length (inc status), 0 if depends on data
+      const char *name;
+   };
+
+   enum class cmd : unsigned char
+   {
+      get_version,
+      get_key_version,
+      free_memory,
+      get_uid,
+      read_data,
+      read_records,
+      get_value,
+      write_data,
+      write_record,
+      credit,
+      limited_credit,
+      debit,
+      commit,
+      abort,
+   };
+
+   inline constexpr command commands[] = {
+      {0x60, 1, tx::plain, rx::plain, 29, "Get version"},
+      {0x64, 2, tx::plain, rx::plain, 2, "Get Key Version"},
+      {0x6E, 1, tx::plain, rx::plain, 4, "Free memory"},
+      {0x51, 1, tx::plain, rx::enc, 8, "Get UID"},
+      {0xBD, 8, tx::plain, rx::comms, 0, "Read Data"},
+      {0xBB, 8, tx::plain, rx::comms, 0, "Read Records"},
+      {0x6C, 2, tx::plain, rx::comms, 5, "Get Value"},
+      {0x3D, 8, tx::comms, rx::plain, 1, "Write Data"},
+      {0x3B, 8, tx::comms, rx::plain, 1, "Write Record"},
+      {0x0C, 6, tx::cmac, rx::plain, 1, "Credit"},
+      {0x1C, 6, tx::cmac, rx::plain, 1, "Limited Credit"},
+      {0xDC, 6, tx::cmac, rx::plain, 1, "Debit"},
+      {0xC7, 1, tx::plain, rx::plain, 1, "Commit"},
+      {0xA7, 1, tx::plain, rx::plain, 1, "Abort"},
+   };
+
+   constexpr const command & describe (cmd c)
+   {
+      return commands[static_cast < unsigned char >(c)];
+   }
+
+   constexpr unsigned char txenc (const command & c, unsigned char comms)
+   {                            // txenc for df_dx
+      if (c.tx == tx::comms && (comms & DF_MODE_ENC))
+         return c.header;
+      if (c.tx != tx::plain && (comms & DF_MODE_CMAC))
+         return 0xFF;
+      return 0;
+   }
+
+   constexpr unsigned int rxenc (const command & c, unsigned char comms, unsigned int rlen)
+   {                            // rxenc for df_dx, rlen is expected response length
+      if (c.rx == rx::enc || (c.rx == rx::comms && (comms & DF_MODE_ENC)))
+         return rlen;
+      return 0;
+   }
+
+   static_assert (describe (cmd::abort).cmd == 0xA7, "Command table out of step");
+   static_assert (txenc (describe (cmd::write_data), DF_MODE_ENC | DF_MODE_CMAC) == 8);
+   static_assert (txenc (describe (cmd::credit), DF_MODE_ENC | DF_MODE_CMAC) == 0xFF);
+   static_assert (rxenc (describe (cmd::get_uid), 0, 8) == 8);
+   static_assert (rxenc (describe (cmd::read_data), DF_MODE_ENC, 301) == 301);
+
+   class DesfireSession
+   {
+    public:
+      DesfireSession (void *obj, df_dx_func_t * dx)
+      {
+         if (const char *e = df_init (&d, obj, dx))
+            throw std::runtime_error (e);
+      }
+      DesfireSession (DesfireSession && o) noexcept:d (o.d), buf (std::move (o.buf))
+      {
+         o.d = df_t { };        // ctx now ours
+      }
+      DesfireSession & operator= (DesfireSession && o) noexcept
+      {
+         if (this != &o)
+         {
+            df_free (&d);
+            d = o.d;
+            o.d = df_t { };
+            buf = std::move (o.buf);
+         }
+         return *this;
+      }
+      DesfireSession (const DesfireSession &) = delete;
+      DesfireSession & operator= (const DesfireSession &) = delete;
+      ~DesfireSession ()
+      {
+         df_free (&d);
+      }
+
+      df_t *df () noexcept
+      {                         // For any df_* call not wrapped here
+         return &d;
+      }
+      bool isauth () const noexcept
+      {
+         return d.blocklen;
+      }
+      void deauth () noexcept
+      {
+         df_deauth (&d);
+      }
+
+      // Session state
+      const char *select_application (span < const unsigned char, 3 > aid)
+      {
+         return df_select_application (&d, aid.data ());
+      }
+      const char *select_master ()
+      {
+         return df_select_application (&d, nullptr);
+      }
+      const char *authenticate (unsigned char keyno, span < const unsigned char, 16 > key)
+      {
+         return df_authenticate (&d, keyno, key.data ());
+      }
+      const char *keyring_authenticate (df_keyring_t * ring, unsigned char keyno)
+      {
+         return df_keyring_authenticate (&d, ring, keyno, nullptr);
+      }
+
+      // Card information
+      const char *get_version (span < unsigned char, 28 > ver)
+      {
+         return exchange (cmd::get_version, 0, 0, 1, ver.data (), ver.size ());
+      }
+      const char *get_key_version (unsigned char keyno, unsigned char &version)
+      {
+         unsigned char *b = buffer (0);
+         b[1] = keyno;
+         return exchange (cmd::get_key_version, 0, 0, 2, &version, 1);
+      }
+      const char *free_memory (unsigned int &mem)
+      {
+         unsigned char m[3];
+         const char *e = exchange (cmd::free_memory, 0, 0, 1, m, sizeof (m));
+         if (!e)
+            mem = m[0] | (m[1] << 8) | (m[2] << 16);
+         return e;
+      }
+      const char *get_uid (span < unsigned char, 7 > uid)
+      {
+         if (!isauth ())
+            return "Not authenticated";
+         return exchange (cmd::get_uid, 0, 0, 1, uid.data (), uid.size ());
+      }
+
+      // File access
+      const char *read_data (unsigned char fileno, unsigned char comms, unsigned int offset, span < unsigned char > data)
+      {
+         header (buffer (data.size ()), fileno, offset, data.size ());
+         return exchange (cmd::read_data, comms, data.size (), 8, data.data (), data.size ());
+      }
+      const char *read_records (unsigned char fileno, unsigned char comms, unsigned int record, unsigned int recs,
+                                span < unsigned char > data)
+      {                         // data size must be recs times the record size
+         header (buffer (data.size ()), fileno, record, recs);
+         return exchange (cmd::read_records, comms, data.size (), 8, data.data (), data.size ());
+      }
+      const char *write_data (unsigned char fileno, unsigned char comms, unsigned int offset, span < const unsigned char > data)
+      {
+         return write (cmd::write_data, fileno, comms, offset, data);
+      }
+      const char *write_record (unsigned char fileno, unsigned char comms, unsigned int offset, span < const unsigned char > data)
+      {
+         return write (cmd::write_record, fileno, comms, offset, data);
+      }
+
+      // Value files
+      const char *get_value (unsigned char fileno, unsigned char comms, unsigned int &value)
+      {
+         unsigned char v[4];
+         buffer (0)[1] = fileno;
+         const char *e = exchange (cmd::get_value, comms, 0, 2, v, sizeof (v));
+         if (!e)
+            value = v[0] | (v[1] << 8) | (v[2] << 16) | ((unsigned int) v[3] << 24);
+         return e;
+      }
+      const char *credit (unsigned char fileno, unsigned char comms, unsigned int delta)
+      {
+         return value (cmd::credit, fileno, comms, delta);
+      }
+      const char *limited_credit (unsigned char fileno, unsigned char comms, unsigned int delta)
+      {
+         return value (cmd::limited_credit, fileno, comms, delta);
+      }
+      const char *debit (unsigned char fileno, unsigned char comms, unsigned int delta)
+      {
+         return value (cmd::debit, fileno, comms, delta);
+      }
+
+      // Transactions
+      const char *commit ()
+      {
+         return exchange (cmd::commit, 0, 0, 1, nullptr, 0);
+      }
+      const char *abort ()
+      {
+         return exchange (cmd::abort, 0, 0, 1, nullptr, 0);
+      }
+
+    private:
+      df_t d { };
+      std::vector < unsigned char > buf = std::vector < unsigned char >(64);    // Kept between calls, grows as needed
+
+      unsigned char *buffer (std::size_t len)
+      {                         // Command buffer for len data bytes, plus header, padding, CRC and CMAC
+         if (buf.size () < len + 32)
+            buf.resize (len + 32);
+         return buf.data ();
+      }
+
+      static void header (unsigned char *b, unsigned char fileno, unsigned int a, unsigned int l)
+      {                         // File number and two 3 byte values
+         b[1] = fileno;
+         b[2] = a;
+         b[3] = a >> 8;
+         b[4] = a >> 16;
+         b[5] = l;
+         b[6] = l >> 8;
+         b[7] = l >> 16;
+      }
+
+      const char *exchange (cmd c, unsigned char comms, std::size_t len, unsigned int txlen, unsigned char *rx, std::size_t rxlen)
+      {                         // Exchange using command descriptor, command parameters in buf already, response data copied to rx
+         const command & k = describe (c);
+         unsigned int expect = k.rlen ? k.rlen : len + 1;
+         if (len > 0xFFFFFF || expect - 1 != rxlen)
+            return "Bad length";
+         unsigned char *b = buffer (len);
+         unsigned int rlen = 0;
+         const char *e = df_dx (&d, k.cmd, buf.size (), b, txlen, txenc (k, comms), rxenc (k, comms, expect), &rlen, k.name);
+         if (e)
+            return e;
+         if (rlen != expect)
+            return "Bad response length";
+         if (rxlen)
+            std::copy (b + 1, b + 1 + rxlen, rx);
+         return nullptr;
+      }
+
+      const char *write (cmd c, unsigned char fileno, unsigned char comms, unsigned int offset, span < const unsigned char > data)
+      {
+         if (data.size () > 0xFFFFFF)
+            return "Bad length";
+         unsigned char *b = buffer (data.size ());
+         header (b, fileno, offset, data.size ());
+         std::copy (data.data (), data.data () + data.size (), b + 8);
+         return exchange (c, comms, 0, 8 + data.size (), nullptr, 0);
+      }
+
+      const char *value (cmd c, unsigned char fileno, unsigned char comms, unsigned int delta)
+      {
+         unsigned char *b = buffer (0);
+         b[1] = fileno;
+         b[2] = delta;
+         b[3] = delta >> 8;
+         b[4] = delta >> 16;
+         b[5] = delta >> 24;
+         return exchange (c, comms, 0, 6, nullptr, 0);
+      }
+   };
+}
+
+#endif
@@ -0,0 +1,392 @@
+// DESFire AES access library - C++20 coroutine layer
+// (c) Copyright 2019 Andrews & Arnold Adrian Kennard
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Each DESFire operation is a coroutine (desfire::task) that suspends on every frame exchange with the card.
+// The frame exchange is done by a transport supplied by the caller's executor, which must have
+//   awaitable exchange(unsigned char *data, unsigned int len, unsigned int max)
+// where the awaitable resumes with an int as a df_dx_func_t returns: response length (in data), 0 for card gone, -ve for error.
+//
+// The df_* functions run under df_async on a small stack owned by the session (under 4KB is used with 300 byte reads and
+// writes, as these have the data on the stack, default is 8KB, with a guard below it so an overflow faults), so any df_* call,
+// or sequence of calls, can be run with session::run, and the common ones have their own methods. Reads or writes too big for
+// the stack (over about 1.5KB with the default) fail with errc::length, pass a bigger stack for those.
+// Functions passed to run are called on that stack and must not throw.
+//
+// Errors are std::error_code in desfire::error_category, session::message() has the library's error text.
+
+#ifndef	DESFIREAES_CO_HPP
+#define	DESFIREAES_CO_HPP
+
+#include <coroutine>
+#include <system_error>
+#include <exception>
+#include <utility>
+#include <array>
+#include <new>
+#ifndef	ESP_PLATFORM
+#include <openssl/evp.h>
+#endif
+#include "desfireaes.h"
+#ifndef	DF_ASYNC
+#error "desfireaes_co.hpp needs df_async, which is Linux only"
+#endif
+
+namespace desfire
+{
+   enum class errc
+   {
+      card_gone = 1,            // Card left the field ("" from the library)
+      comms,                    // Transport failed
+      authentication,
+      permission,
+      not_found,                // Application or file not found
+      no_such_key,
+      length,
+      boundary,
+      integrity,                // CRC, CMAC or card integrity error
+      duplicate,
+      no_memory,                // Card out of EEPROM
+      parameter,
+      protocol,                 // Anything else
+   };
+}
+
+template <> struct std::is_error_code_enum < desfire::errc >:std::true_type
+{
+};
+
+namespace desfire
+{
+   class error_category_t:public std::error_category
+   {
+    public:
+      const char *name () const noexcept override
+      {
+         return "desfire";
+      }
+      std::string message (int e) const override
+      {
+         switch (static_cast < errc > (e))
+         {
+         case errc::card_gone:
+            return "Card gone";
+         case errc::comms:
+            return "Communications failed";
+         case errc::authentication:
+            return "Authentication failed";
+         case errc::permission:
+            return "Permission denied";
+         case errc::not_found:
+            return "Not found";
+         case errc::no_such_key:
+            return "No such key";
+         case errc::length:
+            return "Length error";
+         case errc::boundary:
+            return "Boundary error";
+         case errc::integrity:
+            return "Integrity error";
+         case errc::duplicate:
+            return "Duplicate";
+         case errc::no_memory:
+            return "Out of EEPROM";
+         case errc::parameter:
+            return "Parameter error";
+         case errc::protocol:
+            return "Protocol error";
+         }
+         return "Unknown error";
+      }
+   };
+
+   inline const std::error_category & error_category ()
+   {
+      static error_category_t c;
+      return c;
+   }
+
+   inline std::error_code make_error_code (errc e)
+   {
+      return std::error_code (static_cast < int >(e), error_category ());
+   }
+
+   inline std::error_code to_error_code (const char *e)
+   {                            // Map library error, by address (df_err() for card status, and the exported df_err_* strings)
+      if (!e)
+         return {};
+      if (!*e)
+         return errc::card_gone;
+      static const struct
+      {
+         unsigned char status;
+         errc c;
+      } status[] = {
+         {0x0E, errc::no_memory},
+         {0x1E, errc::integrity},
+         {0x40, errc::no_such_key},
+         {0x7E, errc::length},
+         {0x9D, errc::permission},
+         {0x9E, errc::parameter},
+         {0xA0, errc::not_found},
+         {0xAE, errc::authentication},
+         {0xBE, errc::boundary},
+         {0xC1, errc::integrity},
+         {0xDE, errc::duplicate},
+         {0xF0, errc::not_found},
+         {0xF1, errc::integrity},
+      };
+      for (auto & m:status)
+         if (e == df_err (m.status))
+            return m.c;
+      if (e == df_err_dx)
+         return errc::comms;
+      if (e == df_err_auth)
+         return errc::authentication;
+      if (e == df_err_crc || e == df_err_cmac)
+         return errc::integrity;
+      if (e == df_err_nokey)
+         return errc::no_such_key;
+      if (e == df_err_stack)
+         return errc::length;
+      return errc::protocol;
+   }
+
+   // Lazily started coroutine, co_await it from another coroutine, or start() it and check done() / result()
+   template < class T > class task
+   {
+    public:
+      struct promise_type
+      {
+         T value { };
+         std::exception_ptr ex;
+         std::coroutine_handle <> cont;
+         task get_return_object ()
+         {
+            return task (std::coroutine_handle < promise_type >::from_promise (*this));
+         }
+         std::suspend_always initial_suspend () noexcept
+         {
+            return { };
+         }
+         struct final_awaiter
+         {
+            bool await_ready () noexcept
+            {
+               return false;
+            }
+            std::coroutine_handle <> await_suspend (std::coroutine_handle < promise_type > h) noexcept
+            {                   // Carry on with whoever awaited us
+               if (h.promise ().cont)
+                  return h.promise ().cont;
+               return std::noop_coroutine ();
+            }
+            void await_resume () noexcept
+            {
+            }
+         };
+         final_awaiter final_suspend () noexcept
+         {
+            return { };
+         }
+         void return_value (T v)
+         {
+            value = std::move (v);
+         }
+         void unhandled_exception ()
+         {
+            ex = std::current_exception ();
+         }
+      };
+
+      explicit task (std::coroutine_handle < promise_type > h):h (h)
+      {
+      }
+      task (task && o) noexcept:h (std::exchange (o.h, { }))
+      {
+      }
+      task (const task &) = delete;
+      task & operator= (const task &) = delete;
+      ~task ()
+      {
+         if (h)
+            h.destroy ();
+      }
+
+      bool await_ready () const noexcept
+      {
+         return false;
+      }
+      std::coroutine_handle <> await_suspend (std::coroutine_handle <> c) noexcept
+      {
+         h.promise ().cont = c;
+         return h;
+      }
+      T await_resume ()
+      {
+         return result ();
+      }
+
+      void start ()
+      {                         // Run until first suspend, for top level tasks
+         h.resume ();
+      }
+      bool done () const noexcept
+      {
+         return h.done ();
+      }
+      T result ()
+      {
+         if (h.promise ().ex)
+            std::rethrow_exception (h.promise ().ex);
+         return std::move (h.promise ().value);
+      }
+
+    private:
+      std::coroutine_handle < promise_type > h;
+   };
+
+   // A DESFire session on a transport
+   template < class Transport > class session
+   {
+    public:
+      explicit session (Transport & t, unsigned int stack = 8192):t (t)
+      {
+         if (const char *e = df_init (&d, nullptr, nullptr))
+            throw std::system_error (to_error_code (e), e);
+         if (!(a = df_async_new (&d, stack)))
+         {
+            df_free (&d);
+            throw std::bad_alloc ();
+         }
+      }
+      session (const session &) = delete;
+      session & operator= (const session &) = delete;
+      ~session ()
+      {
+         df_async_free (a);
+         df_free (&d);
+      }
+
+      df_t *df () noexcept
+      {                         // The session, e.g. for df_isauth
+         return &d;
+      }
+      const char *message () const noexcept
+      {                         // Library error text for last operation (NULL if OK)
+         return msg;
+      }
+
+      // Run any df_* calls, f is called with the df_t * and returns the library error (NULL for OK), one at a time per session
+      template < class F > task < std::error_code > run (F f)
+      {
+         unsigned char *data;
+         unsigned int max;
+         unsigned int len = df_async_start (a, &call < F >, &f, &data, &max);
+         while (len)
+         {
+            int b = co_await t.exchange (data, len, max);
+            len = df_async_response (a, b, nullptr, &data, &max);
+         }
+         msg = df_async_result (a);
+         co_return to_error_code (msg);
+      }
+
+      // Session set up
+      task < std::error_code > get_version (unsigned char ver[28])
+      {
+         return run ([ver] (df_t * d) { return df_get_version (d, ver); });
+      }
+      task < std::error_code > select_application (const std::array < unsigned char, 3 > &aid)
+      {
+         return run ([aid] (df_t * d) { return df_select_application (d, aid.data ()); });
+      }
+      task < std::error_code > select_master ()
+      {
+         return run ([] (df_t * d) { return df_select_application (d, nullptr); });
+      }
+      task < std::error_code > authenticate (unsigned char keyno, const std::array < unsigned char, 16 > &key)
+      {
+         return run ([keyno, key] (df_t * d) { return df_authenticate (d, keyno, key.data ()); });
+      }
+      task < std::error_code > keyring_authenticate (df_keyring_t * ring, unsigned char keyno)
+      {
+         return run ([ring, keyno] (df_t * d) { return df_keyring_authenticate (d, ring, keyno, nullptr); });
+      }
+      task < std::error_code > get_uid (unsigned char uid[7])
+      {
+         return run ([uid] (df_t * d) { return df_get_uid (d, uid); });
+      }
+
+      // File I/O, data must stay valid until the task is done
+      task < std::error_code > read_data (unsigned char fileno, unsigned char comms, unsigned int offset, unsigned int len,
+                                          unsigned char *data)
+      {
+         return run ([ =](df_t * d) { return df_read_data (d, fileno, comms, offset, len, data); });
+      }
+      task < std::error_code > write_data (unsigned char fileno, char type, unsigned char comms, unsigned int offset,
+                                           unsigned int len, const void *data)
+      {
+         return run ([ =](df_t * d) { return df_write_data (d, fileno, type, comms, offset, len, data); });
+      }
+      task < std::error_code > read_records (unsigned char fileno, unsigned char comms, unsigned int record, unsigned int recs,
+                                             unsigned int rsize, unsigned char *data)
+      {
+         return run ([ =](df_t * d) { return df_read_records (d, fileno, comms, record, recs, rsize, data); });
+      }
+
+      // Value operations
+      task < std::error_code > get_value (unsigned char fileno, unsigned char comms, unsigned int &value)
+      {
+         return run ([fileno, comms, v = &value] (df_t * d) { return df_get_value (d, fileno, comms, v); });
+      }
+      task < std::error_code > credit (unsigned char fileno, unsigned char comms, unsigned int delta)
+      {
+         return run ([ =](df_t * d) { return df_credit (d, fileno, comms, delta); });
+      }
+      task < std::error_code > limited_credit (unsigned char fileno, unsigned char comms, unsigned int delta)
+      {
+         return run ([ =](df_t * d) { return df_limited_credit (d, fileno, comms, delta); });
+      }
+      task < std::error_code > debit (unsigned char fileno, unsigned char comms, unsigned int delta)
+      {
+         return run ([ =](df_t * d) { return df_debit (d, fileno, comms, delta); });
+      }
+
+      // Transactions
+      task < std::error_code > commit ()
+      {
+         return run ([] (df_t * d) { return df_commit (d); });
+      }
+      task < std::error_code > abort ()
+      {
+         return run ([] (df_t * d) { return df_abort (d); });
+      }
+
+    private:
+      template < class F > static const char *call (df_t * d, void *arg) noexcept
+      {
+         return (*static_cast < F * >(arg)) (d);
+      }
+
+      Transport & t;
+      df_t d;
+      df_async_t *a = nullptr;
+      const char *msg = nullptr;
+   };
+}
+
+#endif
@@ -29,10 +29,25 @@
 #include <ajl.h>
 
 int debug = 0;                  /* debug */
+df_stats_t stats;               /* --stats */
 int red = 33,
    amber = 32,
    green = 31;
 
+static long long
+usnow (void)
+{
+   struct timespec t;
+   clock_gettime (CLOCK_MONOTONIC, &t);
+   return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
+static void
+stats_dump (void)
+{                               /* At exit, so failed runs are included */
+   df_stats_dump (&stats, stderr);
+}
+
 unsigned char
 gpio (int port)
 {
@@ -46,7 +61,7 @@ gpio (int port)
 }
 
 void
-setled (int s, const char *led)
+setled (pn532_t * pn, const char *led)
 {                               /* Set LED */
    unsigned char pattern = 0;
    if (led)
@@ -69,10 +84,11 @@ setled (int s, const char *led)
       pattern ^= gpio (amber);
    if (green < 0)
       pattern ^= gpio (green);
-   pn532_write_GPIO (s, pattern);
+   pn532_write_GPIO (pn, pattern);
 }
 
-int s = -1;
+pn532_t pn = {.s = -1 };       /* reader */
+FILE *capfile = NULL;           /* --capture */
 j_t j = NULL;
 const char *ledfail = "R";
 void
@@ -84,13 +100,22 @@ bye (void)
       j_delete (&j);
    }
    fflush (stdout);
-   if (s >= 0)
+   if (pn.s >= 0)
    {
-      setled (s, ledfail);
-      close (s);
+      setled (&pn, ledfail);
+      close (pn.s);
    }
 }
 
+static void
+capture_dump (void)
+{                               /* At exit, after bye so the final LED setting is included */
+   if (pn532_cap_flush (pn.cap, capfile) < 0 || fclose (capfile))
+      warn ("Capture write failed");
+   if (pn532_cap_dropped (pn.cap))
+      warnx ("Capture dropped %u frames", pn532_cap_dropped (pn.cap));
+}
+
 unsigned char *
 expecthex (const char *hex, int len, const char *name, const char *explain)
 {
@@ -129,8 +154,10 @@ main (int argc, const char *argv[])
    const char *aidkey[14] = { };
    int remove = 0;
    int format = 0;
+   int formatplan = 0;
    int aidlist = 0;
    int filelist = 0;
+   int scan = 0;
    int aidcreate = 0;
    int mastercreate = 0;
    int aidkeys = 2;
@@ -153,6 +180,14 @@ main (int argc, const char *argv[])
    const char *filedata = NULL;
    const char *filehex = NULL;
    const char *fileaccess = "0000";
+   int dostats = 0;
+   int bench = 0;
+   int baud = 0;
+   int autopoll = 0;
+   int adaptive = 0;
+   int kbps = 0;
+   const char *polltype = NULL;
+   const char *capture = NULL;
    poptContext optCon;
    {
       const struct poptOption optionsTable[] = {
@@ -179,6 +214,7 @@ main (int argc, const char *argv[])
          {"aidkeyC", 0, POPT_ARG_STRING | POPT_ARGFLAG_DOC_HIDDEN, &aidkey[12], 0, "Application key C", "Key ver and AES"},
          {"aidkeyD", 0, POPT_ARG_STRING | POPT_ARGFLAG_DOC_HIDDEN, &aidkey[13], 0, "Application key D", "Key ver and AES"},
          {"format", 0, POPT_ARG_NONE, &format, 0, "Format card"},
+         {"format-plan", 0, POPT_ARG_NONE, &formatplan, 0, "Report how card would be formatted"},
          {"disable-format", 0, POPT_ARG_NONE, &disableformat, 0, "Disable formatting"},
          {"random-uid", 0, POPT_ARG_NONE, &randomuid, 0, "Use random UID"},
          {"aid-keys", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &aidkeys, 0, "AID keys", "N"},
@@ -193,6 +229,7 @@ main (int argc, const char *argv[])
          {"led-done", 0, POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &leddone, 0, "LED for done OK", "R/A/G"},
          {"led-fail", 0, POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &ledwait, 0, "LED for failed", "R/A/G"},
          {"file-list", 0, POPT_ARG_NONE, &filelist, 0, "List files"},
+         {"scan", 0, POPT_ARG_NONE, &scan, 0, "Scan whole card (using --master and --aid/--aidkeyN keys as needed)"},
          {"file-id", 0, POPT_ARG_INT, &fileid, 0, "File number", "N"},
          {"file-type", 0, POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &filetype, 0, "File type", "D/B/V/L/C"},
          {"file-comms", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &filecomms, 0, "File comms", "N"},
@@ -207,6 +244,14 @@ main (int argc, const char *argv[])
          {"file-max", 0, POPT_ARG_INT, &filemax, 0, "File max", "N"},
          {"file-vale", 0, POPT_ARG_INT, &filevalue, 0, "File initial vale", "N"},
          {"file-lc", 0, POPT_ARG_NONE, &filelc, 0, "File limited credit"},
+         {"stats", 0, POPT_ARG_NONE, &dostats, 0, "Per command timing to stderr"},
+         {"baud", 0, POPT_ARG_INT, &baud, 0, "Serial baud rate to switch to (230400/460800/921600/1288000)", "N"},
+         {"auto-poll", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &autopoll, 0, "Reader polls for card every N*150ms, 0 to poll from host", "N"},
+         {"poll-type", 0, POPT_ARG_STRING, &polltype, 0, "InAutoPoll target types (default 00, generic 106kbps type A)", "Hex"},
+         {"kbps", 0, POPT_ARG_INT, &kbps, 0, "Fastest RF bit rate to use if card allows, lower on RF errors (212/424/848)", "N"},
+         {"adaptive", 0, POPT_ARG_NONE, &adaptive, 0, "Learn reader and card response times, and use for timeouts"},
+         {"capture", 0, POPT_ARG_STRING, &capture, 0, "Capture serial traffic to pcap file (see pn532cap)", "filename"},
+         {"bench", 0, POPT_ARG_INT, &bench, 0, "Time N PN532 round trips, and N Get Version if card present", "N"},
          {"debug", 'v', POPT_ARG_NONE, &debug, 0, "Debug"},
          POPT_AUTOHELP {}
       };
@@ -236,44 +281,69 @@ main (int argc, const char *argv[])
       binaidkey[i] = expecthex (aidkey[i], 17, "aidkeyN", "Key version and 16 byte AES key data");
    unsigned char *binfilehex = NULL;
    int binfilelen = 0;
+   unsigned char *binpolltype = NULL;
+   int binpolltypes = 0;
+   if (polltype)
+      binpolltypes = j_base16d (polltype, &binpolltype);
+   if (autopoll < 0 || autopoll > 15 || binpolltypes > 15)
+      errx (1, "--auto-poll is 0 to 15, and up to 15 --poll-type");
    if (filehex)
       binfilelen = j_base16d (filehex, &binfilehex);
-   s = open (port, O_RDWR);
+   int s = open (port, O_RDWR);
    if (s < 0)
       err (1, "Cannot open %s", port);
-   {                            /* Terminal set up */
-      struct termios t;
-      if (tcgetattr (s, &t))
-         err (1, "Failed to get serial setting");
-      cfmakeraw (&t);
-      cfsetspeed (&t, 115200);
-      if (tcsetattr (s, TCSANOW, &t))
-         err (1, "Failed to set serial");
-   }
-
    const char *e;               /* error */
+   if ((e = pn532_tty (s)))
+      err (1, "%s: %s", port, e);
 
    unsigned char outputs = (gpio (red) | gpio (amber) | gpio (green));
-   if ((e = pn532_init (s, outputs)))
+   pn.debug = (debug ? stderr : NULL);
+   pn.baud = baud;
+   pn.adaptive = adaptive;
+   pn.maxkbps = kbps;
+   if (capture)
+   {                            /* Big enough for a whole run, written at exit */
+      if (!(capfile = fopen (capture, "w")) || pn532_cap_header (capfile))
+         err (1, "Cannot write %s", capture);
+      if (!(pn.cap = pn532_cap_new (1 << 20, 0)))
+         errx (1, "malloc");
+      atexit (capture_dump);
+   }
+   if ((e = pn532_init (&pn, s, outputs)))
       errx (1, "Cannot init PN532 on %s: %s", port, e);
+   if (baud && pn.baud != baud)
+      warnx ("Could not switch to %d baud, using %u", baud, pn.baud);
+
+   setled (&pn, led);
 
-   setled (s, led);
+   if (bench > 0)
+   {                            /* Round trip time for a trivial PN532 command */
+      long long t = usnow ();
+      for (int n = 0; n < bench; n++)
+         if (pn532_read_GPIO (&pn) < 0)
+            errx (1, "ReadGPIO failed");
+      fprintf (stderr, "ReadGPIO %lldus at %u baud\n", (usnow () - t) / bench, pn.baud);
+      waiting = 1;              /* Only a quick look for a card */
+   }
 
    /* Wait for card */
    unsigned char nfcid[MAXNFCID] = { };
    unsigned char ats[MAXATS] = { };
    int cards = 0;
-   setled (s, ledwait);
+   setled (&pn, ledwait);
    time_t giveup = time (0) + waiting;
-   while (!cards && time (0) < giveup)
-   {
-      cards = pn532_Cards (s, nfcid, ats);
-      if (cards < 0)
-         errx (1, "Failed to get cards");
-   }
+   if (autopoll)
+      cards = pn532_AutoPoll (&pn, autopoll, binpolltypes, binpolltype, nfcid, ats, waiting * 1000);
+   else
+      while (!cards && time (0) < giveup)
+         cards = pn532_Cards (&pn, nfcid, ats);
+   if (cards < 0)
+      errx (1, "Failed to get cards");
+   if (!cards && bench > 0)
+      return 0;
    if (!cards)
       errx (1, "Given up");
-   setled (s, ledfound);
+   setled (&pn, ledfound);
 
    j = j_create ();
    atexit (&bye);
@@ -282,14 +352,37 @@ main (int argc, const char *argv[])
       j_store_string (j, "id", j_base16a (*nfcid, nfcid + 1));
    if (*ats)
       j_store_string (j, "ats", j_base16a (*ats, ats + 1));
+   if (pn.kbps > 106)
+      j_store_int (j, "kbps", pn.kbps);
 
    df_t d;
-   if ((e = df_init (&d, &s, &pn532_dx)))
+   if ((e = df_init (&d, &pn, &pn532_dx)))
       errx (1, "Failed DF init: %s", e);
+   if (pn532_txmax (ats))
+      d.txmax = pn532_txmax (ats);
+   if (dostats)
+   {
+      d.stats = &stats;
+      atexit (stats_dump);
+   }
+   if (bench > 0)
+   {                            /* Round trip time for a short card command */
+      unsigned char ver[28];
+      long long t = usnow ();
+      for (int n = 0; n < bench; n++)
+         if ((e = df_get_version (&d, ver)))
+            errx (1, "Get Version failed: %s", e);
+      fprintf (stderr, "GetVersion %lldus\n", (usnow () - t) / bench);
+      return 0;
+   }
 #define df(x,...) do{if((e=df_##x(&d,__VA_ARGS__)))errx(1,"Failed "#x": %s",e);}while(0)
 
    unsigned char binzero[17] = { };
    unsigned char *currentkey = binmaster ? : binzero;
+   df_keyring_t ring = { };     /* keys by version, so we only try the right one */
+   if (binmaster)
+      df_keyring_add (&ring, NULL, 0, *binmaster, binmaster + 1);
+   df_keyring_add (&ring, NULL, 0, 0, NULL);    /* default */
 
    unsigned char ver[28];
    if (!df_get_version (&d, ver))
@@ -297,7 +390,16 @@ main (int argc, const char *argv[])
 
    df (select_application, NULL);
 
+   if (formatplan)
+   {
+      const char *plan = NULL;
+      df (format_plan, *currentkey, currentkey + 1, &plan);
+      j_store_string (j, "format-plan", plan);
+   }
+
    j_t a = NULL;                /* AID */
+   unsigned char keynos = 0;    /* AID keys */
+   unsigned char keyver[14] = { };
    j_t m = j_store_object (j, "master");        /* master */
 
    unsigned char v;
@@ -305,11 +407,11 @@ main (int argc, const char *argv[])
    j_store_stringf (m, "key-ver", "%02X", v);
    if (!format)
    {
-      if (!binmaster || *binmaster != v || df_authenticate (&d, 0, binmaster + 1))
-      {
+      const unsigned char *k = NULL;
+      if ((e = df_keyring_authenticate (&d, &ring, 0, &k)) && !*e)
+         errx (1, "Card gone");
+      if (!k || !binmaster || *binmaster != v || memcmp (k, binmaster + 1, 16))
          currentkey = binzero;
-         df_authenticate (&d, 0, NULL); /* try default */
-      }
       if (!df_isauth (&d))
          errx (1, "Authentication failed, no further actions can be performed");
 
@@ -354,14 +456,17 @@ main (int argc, const char *argv[])
       df (create_application, binaid, *binaidsetting, aidkeys);
       df (select_application, binaid);
       j_t k = j_store_array (j, "aid-keys");
-      for (int i = 0; i < aidkeys; i++)
+      const unsigned char *newkey[14] = { };
+      unsigned char newver[14] = { };
+      for (int i = 0; i < aidkeys && i < 14; i++)
       {
          if (!binaidkey[i])
             fill_random (binaidkey[i] = malloc (17), 17);       /* new key */
          j_append_string (k, j_base16a (17, binaidkey[i]));
-         df (authenticate, i, NULL);    /* own key to change it */
-         df (change_key, i, *binaidkey[i], NULL, binaidkey[i] + 1);
+         newver[i] = *binaidkey[i];
+         newkey[i] = binaidkey[i] + 1;
       }
+      df (provision_keys, aidkeys, NULL, newver, newkey);       /* from zero keys */
       df (authenticate, 0, binaidkey[0] + 1);
    }
    if (aidlist)
@@ -378,8 +483,7 @@ main (int argc, const char *argv[])
       a = j_store_object (j, "aid");
       j_store_string (a, "id", j_base16a (3, binaid));
       df (select_application, binaid);
-      unsigned char setting = 0,
-         keynos = 0;
+      unsigned char setting = 0;
       df (get_key_settings, &setting, &keynos);
       if (keynos & 0x80)
          j_store_boolean (a, "aes", 1);
@@ -389,17 +493,24 @@ main (int argc, const char *argv[])
       j_t k = j_store_array (a, "key-ver");
       for (int i = 0; i < keynos; i++)
       {
-         df (get_key_version, i, &v);
-         j_append_stringf (k, "%02X", v);
+         df (get_key_version, i, &keyver[i]);
+         j_append_stringf (k, "%02X", keyver[i]);
       }
    }
    if (filelist)
    {
       if (!binaid)
          errx (1, "Set --aid");
-      for (int i = 0; i < 13; i++)
-         if (binaidkey[i] && !df_authenticate (&d, i, binaidkey[i] + 1))
+      for (int i = 0; i < 14; i++)
+         if (binaidkey[i])
+            df_keyring_add (&ring, binaid, i, *binaidkey[i], binaidkey[i] + 1);
+      for (int i = 0; i < keynos && i < 14; i++)
+      {                         /* Only try keys whose version matches the card */
+         if (!(e = df_keyring_authenticate (&d, &ring, i, NULL)))
             break;
+         if (!*e)
+            errx (1, "Card gone");
+      }
       unsigned long long ids;
       df (get_file_ids, &ids);
       j_t files = j_store_array (a, "files");
@@ -445,6 +556,52 @@ main (int argc, const char *argv[])
             }
          }
    }
+   if (scan)
+   {
+      for (int i = 0; i < 14; i++)
+         if (binaid && binaidkey[i])
+            df_keyring_add (&ring, binaid, i, *binaidkey[i], binaidkey[i] + 1);
+      df_scan_t inv;
+      df (scan, &ring, &inv);
+      j_t c = j_store_object (j, "scan");
+      if (inv.error)
+         j_store_string (c, "error", inv.error);
+      j_store_stringf (c, "settings", "%02X", inv.settings);
+      j_store_stringf (c, "key-ver", "%02X", inv.keyver);
+      j_store_int (c, "free-mem", inv.mem);
+      j_t aids = j_store_array (c, "aids");
+      for (int n = 0; n < inv.apps; n++)
+      {
+         df_scan_app_t *app = &inv.app[n];
+         j_t a = j_append_object (aids);
+         j_store_string (a, "id", j_base16a (3, app->aid));
+         if (app->error)
+            j_store_string (a, "error", app->error);
+         if (app->keynos & 0x80)
+            j_store_boolean (a, "aes", 1);
+         j_store_stringf (a, "settings", "%02X", app->settings);
+         j_store_int (a, "keys", app->keynos & 0x7F);
+         j_t k = j_store_array (a, "key-ver");
+         for (int i = 0; i < (app->keynos & 15) && i < 14; i++)
+            j_append_stringf (k, "%02X", app->keyver[i]);
+         j_t files = j_store_array (a, "files");
+         for (int i = 0; i < app->files; i++)
+         {
+            df_scan_file_t *file = &app->file[i];
+            j_t f = j_append_object (files);
+            j_store_int (f, "id", file->fileno);
+            j_store_stringf (f, "type", "%c", file->type);
+            j_store_int (f, "comms", file->comms);
+            j_store_stringf (f, "access", "%04X", file->access);
+            if (file->size)
+               j_store_int (f, "size", file->size);
+            if (file->got_value)
+               j_store_int (f, "value", file->value);
+         }
+      }
+      j_store_int (c, "exchanges", inv.dx);
+      df_scan_free (&inv);
+   }
    if (binfilehex && filedata)
       errx (1, "Specify either --file-data or --file-hex, not both");
    if (filedelete)
@@ -491,11 +648,12 @@ main (int argc, const char *argv[])
       df (free_memory, &mem);
       j_store_int (j, "free-mem", mem);
    }
-   setled (s, leddone);
+   setled (&pn, leddone);
    if (remove)
-      while (pn532_Present (s) > 0);
-   close (s);
-   s = -1;
+      while (pn532_Present (&pn) > 0);
+   close (pn.s);
+   pn.s = -1;
+   df_keyring_free (&ring);
    poptFreeContext (optCon);
    return 0;
 }
@@ -0,0 +1,431 @@
+/* Daemon for working with many NFC readers from one process */
+/* (c) Copyright 2022 Andrews & Arnold Ltd, Adrian Kennard */
+/*
+ * This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each reader is a state machine driven from one epoll loop, nothing blocks other than opening a reader (at start up, and
+ * when a failed reader is reopened after --retry seconds).
+ * PN532 frames are made and parsed with pn532_frame/pn532_parse, and the DESFire operations for each card run under df_async,
+ * so every reader has its own card session in progress at the same time.
+ * Each card found is reported as one line of JSON on stdout.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <popt.h>
+#include <time.h>
+#include <stdlib.h>
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <openssl/evp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include "desfireaes.h"
+#include "pn532.h"
+#include <ajl.h>
+
+int debug = 0;                  /* debug */
+int polltime = 100;             /* ms between polls for a card */
+int retry = 5;                  /* s before reopening a failed reader */
+df_keyring_t ring = { };        /* master keys */
+
+/* Reader states */
+#define	R_IDLE		0       /* Waiting to poll for card */
+#define	R_LIST		1       /* InListPassiveTarget sent */
+#define	R_CARD		2       /* InDataExchange sent */
+#define	R_WAIT		3       /* Card done, waiting to check if still present */
+#define	R_PRESENT	4       /* Diagnose sent */
+
+typedef struct reader_s reader_t;
+struct reader_s
+{
+   const char *port;            /* Serial port */
+   int s;                       /* Serial fd, -1 if not working (deadline is then when to reopen) */
+   pn532_t pn;                  /* Used for pn532_init only, then frames are handled here */
+   unsigned char state;         /* R_ state */
+   unsigned char cmd;           /* Command awaiting response */
+   long long deadline;          /* When to give up or do next thing (us) */
+   long long start;             /* When card found (us) */
+   int rxlen;                   /* Bytes in rx */
+   unsigned char rx[300];       /* Received bytes */
+   df_t d;                      /* DESFire session */
+   df_async_t *a;               /* Running DESFire operations for card */
+   unsigned char *data;         /* Current card frame */
+   unsigned int max;            /* Space for response */
+   unsigned char nfcid[MAXNFCID];
+   unsigned char ats[MAXATS];
+   j_t j;                       /* Report for card */
+};
+
+static long long
+now (void)
+{                               /* Monotonic time (us) */
+   struct timespec t;
+   clock_gettime (CLOCK_MONOTONIC, &t);
+   return (long long) t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
+static volatile int done = 0;
+static void
+stop (int sig)
+{
+   done = 1;
+}
+
+static const char *
+card_job (df_t * d, void *arg)
+{                               /* DESFire operations for a card - runs under df_async so one frame at a time */
+   reader_t *r = arg;
+   const char *e;
+   unsigned char ver[28];
+   if (!df_get_version (d, ver))
+      j_store_string (r->j, "ver", j_base16a (sizeof (ver), ver));
+   if ((e = df_select_application (d, NULL)))
+      return e;
+   unsigned char v;
+   if ((e = df_get_key_version (d, 0, &v)))
+      return e;
+   j_store_stringf (r->j, "key-ver", "%02X", v);
+   if ((e = df_keyring_authenticate (d, &ring, 0, NULL)))
+      return e;
+   unsigned char uid[7];
+   if ((e = df_get_uid (d, uid)))
+      return e;
+   j_store_string (r->j, "uid", j_base16a (sizeof (uid), uid));
+   return NULL;
+}
+
+static void
+reader_close (reader_t * r, const char *e)
+{                               /* Reader has failed, close it and reopen after retry time */
+   warnx ("%s: %s", r->port, e);
+   if (r->s >= 0)
+      close (r->s);
+   r->s = -1;
+   if (r->state == R_CARD)
+      while (df_async_response (r->a, 0, NULL, &r->data, &r->max));    /* Card gone, so the job ends */
+   if (r->j)
+      j_delete (&r->j);
+   r->state = R_IDLE;
+   r->cmd = 0;
+   r->deadline = now () + retry * 1000000LL;
+}
+
+static void
+reader_open (reader_t * r, int ep)
+{                               /* Open reader, this blocks for pn532_init, which is only at start up and on reopen */
+   const char *e;
+   if ((r->s = open (r->port, O_RDWR | O_NOCTTY)) < 0)
+   {
+      reader_close (r, strerror (errno));
+      return;
+   }
+   if ((e = pn532_tty (r->s)) || (e = pn532_init (&r->pn, r->s, 0)))
+   {
+      reader_close (r, e);
+      return;
+   }
+   fcntl (r->s, F_SETFL, fcntl (r->s, F_GETFL) | O_NONBLOCK);
+   struct epoll_event ev = {.events = EPOLLIN,.data.ptr = r };
+   if (epoll_ctl (ep, EPOLL_CTL_ADD, r->s, &ev))
+   {
+      reader_close (r, strerror (errno));
+      return;
+   }
+   if (debug)
+      warnx ("%s: Open", r->port);
+   r->state = R_IDLE;
+   r->rxlen = 0;
+   r->deadline = now ();
+}
+
+static int
+reader_tx (reader_t * r, unsigned char cmd, int len1, const unsigned char *data1, int len2, const unsigned char *data2, int ms)
+{                               /* Send a command, response is handled when it arrives */
+   if (r->s < 0)
+      return -1;
+   unsigned char buf[300];
+   int l = pn532_frame (buf, sizeof (buf), cmd, len1, data1, len2, data2);
+   if (l < 0 || write (r->s, buf, l) != l)
+   {
+      reader_close (r, "Write failed");
+      return -1;
+   }
+   r->cmd = cmd;
+   r->deadline = now () + ms * 1000LL;
+   return 0;
+}
+
+static void
+reader_abort (reader_t * r)
+{                               /* Send ACK to abort command in progress */
+   static const unsigned char ack[] = { 0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00 };
+   if (r->s >= 0 && write (r->s, ack, sizeof (ack)) != sizeof (ack))
+      reader_close (r, "Write failed");
+   r->rxlen = 0;
+}
+
+static void
+reader_wait (reader_t * r, unsigned char state)
+{                               /* Wait for poll time */
+   r->state = state;
+   r->cmd = 0;
+   r->deadline = now () + polltime * 1000LL;
+}
+
+static void
+card_frame (reader_t * r, unsigned int len)
+{                               /* Send next frame for card, or report card if done */
+   if (len)
+   {
+      unsigned char tg = 1;
+      r->state = R_CARD;
+      reader_tx (r, 0x40, 1, &tg, len, r->data, 500);
+      return;
+   }
+   const char *e = df_async_result (r->a);
+   if (e)
+      j_store_string (r->j, "error", *e ? e : "Card gone");
+   j_store_int (r->j, "exchanges", r->d.dxcount);
+   j_store_int (r->j, "ms", (now () - r->start) / 1000);
+   j_err (j_write (r->j, stdout));
+   fputc ('\n', stdout);
+   fflush (stdout);
+   j_delete (&r->j);
+   reader_wait (r, R_WAIT);
+}
+
+static void
+reader_response (reader_t * r, unsigned char cmd, const unsigned char *data, int len)
+{                               /* Response from PN532 */
+   if (!r->cmd || cmd != r->cmd + 1)
+      return;                   /* Not what we were waiting for */
+   r->cmd = 0;
+   switch (r->state)
+   {
+   case R_LIST:
+      if (pn532_cards_parse (data, len, r->nfcid, r->ats) <= 0)
+      {
+         reader_wait (r, R_IDLE);
+         break;
+      }
+      r->start = now ();
+      r->j = j_create ();
+      j_store_string (r->j, "port", r->port);
+      if (*r->nfcid)
+         j_store_string (r->j, "id", j_base16a (*r->nfcid, r->nfcid + 1));
+      if (*r->ats)
+         j_store_string (r->j, "ats", j_base16a (*r->ats, r->ats + 1));
+      df_deauth (&r->d);        /* New card, so new session */
+      r->d.txmax = (pn532_txmax (r->ats) ? : DF_TXMAX);
+      r->d.dxcount = 0;
+      card_frame (r, df_async_start (r->a, card_job, r, &r->data, &r->max));
+      break;
+   case R_CARD:
+      {
+         int b = -1;
+         if (len >= 1 && !(data[0] & 0x3F) && len - 1 <= r->max)
+         {
+            b = len - 1;
+            memcpy (r->data, data + 1, b);
+         }
+         card_frame (r, df_async_response (r->a, b, b < 0 ? "Failed" : NULL, &r->data, &r->max));
+      }
+      break;
+   case R_PRESENT:
+      if (len >= 1 && !*data)
+         reader_wait (r, R_WAIT);       /* Still there */
+      else
+      {                         /* Gone, look for next card */
+         r->state = R_IDLE;
+         r->deadline = now ();
+      }
+      break;
+   }
+}
+
+static void
+reader_timeout (reader_t * r)
+{                               /* Deadline reached */
+   static const unsigned char list[] = { 1, 0 };        /* 1 tag, 106 kbps type A */
+   static const unsigned char diag[] = { 6 };   /* Attention Request Test */
+   switch (r->state)
+   {
+   case R_IDLE:
+      r->state = R_LIST;
+      reader_tx (r, 0x4A, sizeof (list), list, 0, NULL, 200);
+      break;
+   case R_WAIT:
+      r->state = R_PRESENT;
+      reader_tx (r, 0x00, sizeof (diag), diag, 0, NULL, 110);
+      break;
+   case R_LIST:
+   case R_PRESENT:
+      if (debug)
+         warnx ("%s: Timeout", r->port);
+      reader_abort (r);
+      if (r->s >= 0)
+         reader_wait (r, R_IDLE);
+      break;
+   case R_CARD:
+      reader_abort (r);
+      if (r->s >= 0)
+         card_frame (r, df_async_response (r->a, -1, "Timeout", &r->data, &r->max));
+      break;
+   }
+}
+
+static void
+reader_rx (reader_t * r)
+{                               /* Data from reader */
+   int n = read (r->s, r->rx + r->rxlen, sizeof (r->rx) - r->rxlen);
+   if (n < 0 && (errno == EAGAIN || errno == EINTR))
+      return;
+   if (n <= 0)
+   {
+      reader_close (r, "Read failed");
+      return;
+   }
+   r->rxlen += n;
+   while (r->rxlen && r->s >= 0)
+   {
+      unsigned char cmd;
+      const unsigned char *data;
+      int len;
+      int l = pn532_parse (r->rx, r->rxlen, &cmd, &data, &len);
+      if (!l)
+      {
+         if (r->rxlen == sizeof (r->rx))
+            r->rxlen = 0;       /* Full of junk */
+         break;
+      }
+      if (l < 0)
+      {
+         if (debug)
+            warnx ("%s: Bad frame", r->port);
+         l = -l;
+      } else if (cmd)
+         reader_response (r, cmd, data, len);
+      memmove (r->rx, r->rx + l, r->rxlen - l);
+      r->rxlen -= l;
+   }
+}
+
+int
+main (int argc, const char *argv[])
+{
+   const char *master = NULL;
+   poptContext optCon;
+   {
+      const struct poptOption optionsTable[] = {
+         {"master", 0, POPT_ARG_STRING, &master, 0, "Master key", "Key ver and AES"},
+         {"poll", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &polltime, 0, "Time between polls", "ms"},
+         {"retry", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &retry, 0, "Time before reopening a failed reader", "s"},
+         {"debug", 'v', POPT_ARG_NONE, &debug, 0, "Debug"},
+         POPT_AUTOHELP {}
+      };
+
+      optCon = poptGetContext (NULL, argc, argv, optionsTable, 0);
+      poptSetOtherOptionHelp (optCon, "ports...");
+
+      int c;
+      if ((c = poptGetNextOpt (optCon)) < -1)
+         errx (1, "%s: %s\n", poptBadOption (optCon, POPT_BADOPTION_NOALIAS), poptStrerror (c));
+
+      if (!poptPeekArg (optCon))
+      {
+         poptPrintUsage (optCon, stderr, 0);
+         return -1;
+      }
+   }
+   if (master)
+   {
+      unsigned char *bin = NULL;
+      if (j_base16d (master, &bin) != 17)
+         errx (1, "--master expects 17 hexadecimal bytes Key version and 16 byte AES key data");
+      df_keyring_add (&ring, NULL, 0, *bin, bin + 1);
+      free (bin);
+   }
+   df_keyring_add (&ring, NULL, 0, 0, NULL);    /* default */
+
+   int readers = 0;
+   const char **ports = poptGetArgs (optCon);
+   while (ports[readers])
+      readers++;
+   reader_t *reader = calloc (readers, sizeof (*reader));
+   if (!reader)
+      errx (1, "malloc");
+   int ep = epoll_create1 (0);
+   if (ep < 0)
+      err (1, "epoll");
+   for (int n = 0; n < readers; n++)
+   {                            /* Set up readers, a reader that fails to open is retried later */
+      reader_t *r = &reader[n];
+      r->port = ports[n];
+      r->pn.debug = (debug ? stderr : NULL);
+      const char *e;
+      if ((e = df_init (&r->d, NULL, NULL)) || !(r->a = df_async_new (&r->d, 0)))
+         errx (1, "Failed DF init: %s", e ? : "malloc");
+      reader_open (r, ep);
+   }
+   signal (SIGINT, stop);
+   signal (SIGTERM, stop);
+   int next = 0;                /* Rotate start of deadline checks so no reader always goes first */
+   while (!done)
+   {
+      long long t = now (),
+         wake = t + 1000000LL;
+      for (int q = 0; q < readers; q++)
+      {
+         reader_t *r = &reader[(next + q) % readers];
+         if (r->deadline <= t)
+         {
+            if (r->s < 0)
+               reader_open (r, ep);
+            else
+               reader_timeout (r);
+         }
+         if (r->deadline < wake)
+            wake = r->deadline;
+      }
+      if (readers)
+         next = (next + 1) % readers;
+      struct epoll_event ev[64];
+      int n = epoll_wait (ep, ev, sizeof (ev) / sizeof (*ev), wake > t ? (wake - t + 999) / 1000 : 0);
+      if (n < 0 && errno != EINTR)
+         err (1, "epoll");
+      for (int i = 0; i < n; i++)
+      {                         /* One read per reader per pass */
+         reader_t *r = ev[i].data.ptr;
+         if (r->s >= 0)
+            reader_rx (r);
+      }
+   }
+   for (int n = 0; n < readers; n++)
+   {
+      reader_t *r = &reader[n];
+      if (r->a)
+         df_async_free (r->a);
+      if (r->s >= 0)
+         close (r->s);
+      if (r->j)
+         j_delete (&r->j);
+   }
+   free (reader);
+   close (ep);
+   df_keyring_free (&ring);
+   poptFreeContext (optCon);
+   return 0;
+}
@@ -0,0 +1,615 @@
+/* Card issuance across many NFC readers */
+/* (c) Copyright 2022 Andrews & Arnold Ltd, Adrian Kennard */
+/*
+ * This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Job file is lines of text, # for comments, hex for keys and data, the layout lines apply to the cards that follow them
+ *   master KKKK...                     Master key (key ver and AES), default is zero AES key
+ *   master-setting NN                  Master key settings
+ *   aid AAAAAA NN N [KKKK...]...       New AID with settings, number of keys, and keys (key ver and AES, default zero)
+ *   file N T C AAAA SIZE [HEX]         New file in last AID, number, type (D/B), comms, access, size, and data to write
+ *   value N C AAAA MIN MAX VALUE [LC]  New value file in last AID
+ *   record N T C AAAA SIZE RECS        New record file (type L/C) in last AID
+ *   card [LABEL]                       One card
+ *   cards N                            N cards
+ *
+ * Each reader is a worker thread with its own df_t and serial port, and its own queue of card jobs.
+ * Jobs are dealt out to the queues at the start, a reader with an empty queue takes from the end of the longest queue,
+ * and a failed card is put on the next reader's queue to retry there. A reader with nothing left to take waits (not polling
+ * for cards) until a failed card is queued again or all jobs are done.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <popt.h>
+#include <time.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <err.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include "desfireaes.h"
+#include "pn532.h"
+#include <ajl.h>
+
+int debug = 0;                  /* debug */
+int retries = 2;                /* Retries for a failed card */
+int kbps = 0;                   /* Max RF bit rate */
+
+#define	MAXAID	8
+#define	MAXFILE	32
+
+typedef struct layout_s layout_t;
+struct layout_s
+{                               /* What to put on a card */
+   unsigned char master[17];    /* Master key version and key */
+   int mastersetting;           /* -1 for leave as is */
+   int aids;
+   struct
+   {
+      unsigned char aid[3];
+      unsigned char setting;
+      unsigned char keys;
+      unsigned char key[14][17];
+      int files;
+      struct
+      {
+         unsigned char id;
+         char type;
+         unsigned char comms;
+         unsigned char lc;
+         unsigned short access;
+         unsigned int size;
+         unsigned int min;
+         unsigned int max;
+         unsigned int recs;
+         unsigned int value;
+         unsigned int len;      /* Data to write */
+         unsigned char *data;
+      } file[MAXFILE];
+   } aid[MAXAID];
+};
+
+typedef struct job_s job_t;
+struct job_s
+{                               /* A card to issue */
+   const layout_t *layout;
+   char *label;
+   int tries;
+};
+
+typedef struct queue_s queue_t;
+struct queue_s
+{                               /* Jobs for a reader */
+   pthread_mutex_t mutex;
+   job_t **job;                 /* Ring, big enough for all jobs */
+   int head;
+   int count;
+};
+
+typedef struct worker_s worker_t;
+struct worker_s
+{                               /* A reader */
+   const char *port;
+   int id;
+   pn532_t pn;                  /* Reader */
+   df_t d;
+   pthread_t thread;
+   queue_t queue;
+   int cards;                   /* Cards done */
+   int failed;                  /* Attempts that failed */
+   long long busy;              /* Time spent on cards (us) */
+};
+
+int jobs = 0;                   /* Number of jobs */
+job_t *job = NULL;
+int workers = 0;
+worker_t *worker = NULL;
+df_keyring_t ring = { };        /* Master keys we may find on cards */
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;       /* For below, and output */
+pthread_cond_t work = PTHREAD_COND_INITIALIZER; /* Signalled when queued goes up or remaining reaches 0 */
+int remaining = 0;              /* Jobs not yet done (or given up) */
+int queued = 0;                 /* Jobs in queues */
+int giveup = 0;                 /* Jobs given up */
+int capdone = 0;                /* Workers finished, last capture flush */
+
+FILE *capfile = NULL;           /* --capture */
+
+static long long
+now (void)
+{                               /* Monotonic time (us) */
+   struct timespec t;
+   clock_gettime (CLOCK_MONOTONIC, &t);
+   return (long long) t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
+static void
+queue_put (queue_t * q, job_t * j)
+{                               /* Add job to end of queue */
+   pthread_mutex_lock (&q->mutex);
+   q->job[(q->head + q->count++) % jobs] = j;
+   pthread_mutex_unlock (&q->mutex);
+}
+
+static job_t *
+queue_get (queue_t * q, int tail)
+{                               /* Take job from start (or end) of queue */
+   job_t *j = NULL;
+   pthread_mutex_lock (&q->mutex);
+   if (q->count)
+   {
+      q->count--;
+      if (tail)
+         j = q->job[(q->head + q->count) % jobs];
+      else
+      {
+         j = q->job[q->head];
+         q->head = (q->head + 1) % jobs;
+      }
+   }
+   pthread_mutex_unlock (&q->mutex);
+   return j;
+}
+
+static int
+queue_count (queue_t * q)
+{                               /* Jobs in queue, may have changed by the time it is used, queue_get checks properly */
+   pthread_mutex_lock (&q->mutex);
+   int c = q->count;
+   pthread_mutex_unlock (&q->mutex);
+   return c;
+}
+
+static job_t *
+job_get (worker_t * w)
+{                               /* Next job for this reader, taking from the busiest reader if none of our own */
+   job_t *j = queue_get (&w->queue, 0);
+   while (!j)
+   {
+      worker_t *busy = NULL;
+      int most = 0;
+      for (int n = 0; n < workers; n++)
+      {
+         int c = queue_count (&worker[n].queue);
+         if (c > most)
+         {
+            most = c;
+            busy = &worker[n];
+         }
+      }
+      if (!busy)
+         break;
+      j = queue_get (&busy->queue, 1);
+   }
+   if (j)
+   {
+      pthread_mutex_lock (&lock);
+      queued--;
+      pthread_mutex_unlock (&lock);
+   }
+   return j;
+}
+
+static int
+jobs_wait (void)
+{                               /* Wait until there is a queued job, or none remaining, returns remaining */
+   pthread_mutex_lock (&lock);
+   while (remaining && !queued)
+      pthread_cond_wait (&work, &lock);
+   int r = remaining;
+   pthread_mutex_unlock (&lock);
+   return r;
+}
+
+static const char *
+issue (worker_t * w, const job_t * j, j_t c)
+{                               /* Issue a card */
+   df_t *d = &w->d;
+   const layout_t *l = j->layout;
+   const char *e;
+   if ((e = df_select_application (d, NULL)))
+      return e;
+   const unsigned char *k = NULL;
+   if ((e = df_format (d, *l->master, l->master + 1)))
+   {                            /* Format tries zero keys and this layout's key, try any other layout's key for this version */
+      const char *ke = df_keyring_authenticate (d, &ring, 0, &k);
+      if (ke)
+         return *ke ? e : ke;
+      if ((e = df_change_key (d, 0x80, *l->master, k, l->master + 1)) || (e = df_format (d, *l->master, l->master + 1)))
+         return e;
+   }
+   if (l->mastersetting >= 0 && (e = df_change_key_settings (d, l->mastersetting)))
+      return e;
+   for (int a = 0; a < l->aids; a++)
+   {
+      const unsigned char *key[14] = { };
+      unsigned char ver[14] = { };
+      for (int n = 0; n < l->aid[a].keys; n++)
+      {
+         ver[n] = *l->aid[a].key[n];
+         key[n] = l->aid[a].key[n] + 1;
+      }
+      if ((e = df_create_application (d, l->aid[a].aid, l->aid[a].setting, l->aid[a].keys)) ||
+          (e = df_select_application (d, l->aid[a].aid)) ||
+          (e = df_provision_keys (d, l->aid[a].keys, NULL, ver, key)) || (e = df_authenticate (d, 0, key[0])))
+         return e;
+      for (int n = 0; n < l->aid[a].files; n++)
+      {
+         typeof (l->aid[a].file[n]) * f = &l->aid[a].file[n];
+         if ((e = df_create_file (d, f->id, f->type, f->comms, f->access, f->size, f->min, f->max, f->recs, f->value, f->lc)))
+            return e;
+         if (f->len && (e = df_write_data (d, f->id, f->type, f->comms, 0, f->len, f->data)))
+            return e;
+      }
+   }
+   if ((e = df_select_application (d, NULL)) || (e = df_authenticate (d, 0, l->master + 1)))
+      return e;
+   unsigned char uid[7];
+   if ((e = df_get_uid (d, uid)))
+      return e;
+   j_store_string (c, "uid", j_base16a (sizeof (uid), uid));
+   return NULL;
+}
+
+static void *
+worker_thread (void *arg)
+{                               /* Reader */
+   worker_t *w = arg;
+   while (jobs_wait ())
+   {
+      /* Wait for a card */
+      unsigned char nfcid[MAXNFCID] = { };
+      unsigned char ats[MAXATS] = { };
+      int cards = pn532_Cards (&w->pn, nfcid, ats);
+      if (cards < 0)
+      {
+         warnx ("%s: Failed to get cards", w->port);
+         break;
+      }
+      if (!cards)
+         continue;
+      w->d.txmax = (pn532_txmax (ats) ? : DF_TXMAX);
+      job_t *j = job_get (w);
+      if (!j)
+         continue;              /* Another reader took it first */
+      long long start = now ();
+      j_t c = j_create ();
+      j_store_string (c, "port", w->port);
+      if (j->label)
+         j_store_string (c, "label", j->label);
+      if (*nfcid)
+         j_store_string (c, "id", j_base16a (*nfcid, nfcid + 1));
+      if (w->pn.kbps > 106)
+         j_store_int (c, "kbps", w->pn.kbps);
+      const char *e = issue (w, j, c);
+      long long t = now () - start;
+      j_store_int (c, "ms", t / 1000);
+      pthread_mutex_lock (&lock);
+      w->busy += t;
+      if (e)
+      {
+         j_store_string (c, "error", *e ? e : "Card gone");
+         w->failed++;
+         if (++j->tries > retries)
+         {
+            giveup++;
+            remaining--;
+         } else
+         {
+            queue_put (&worker[(w->id + 1) % workers].queue, j);        /* Retry on another reader */
+            queued++;
+         }
+      } else
+      {
+         w->cards++;
+         remaining--;
+      }
+      if (queued || !remaining)
+         pthread_cond_broadcast (&work);
+      j_err (j_write (c, stdout));
+      fputc ('\n', stdout);
+      fflush (stdout);
+      pthread_mutex_unlock (&lock);
+      j_delete (&c);
+      while (pn532_Present (&w->pn) > 0); /* Wait for card to be removed */
+   }
+   return NULL;
+}
+
+static layout_t *
+layout_new (layout_t * l, int *used)
+{                               /* Layout to change, new copy if cards are using the current one */
+   if (!l || (used && *used))
+   {
+      layout_t *n = malloc (sizeof (*n));
+      if (!n)
+         errx (1, "malloc");
+      if (l)
+         memcpy (n, l, sizeof (*n));
+      else
+      {
+         memset (n, 0, sizeof (*n));
+         n->mastersetting = -1;
+      }
+      l = n;
+   }
+   if (used)
+      *used = 0;
+   return l;
+}
+
+static void
+job_add (layout_t * l, const char *label)
+{
+   job = realloc (job, sizeof (*job) * (jobs + 1));
+   if (!job)
+      errx (1, "malloc");
+   job[jobs].layout = l;
+   job[jobs].label = label ? strdup (label) : NULL;
+   job[jobs].tries = 0;
+   jobs++;
+}
+
+static void
+job_file (const char *filename)
+{                               /* Load job file */
+   FILE *f = fopen (filename, "r");
+   if (!f)
+      err (1, "Cannot open %s", filename);
+   layout_t *l = layout_new (NULL, NULL);
+   int used = 0;
+   int line = 0;
+   char *buf = NULL;
+   size_t len = 0;
+   while (getline (&buf, &len, f) >= 0)
+   {
+      line++;
+#define	fail(...) errx(1,"%s:%d: %s",filename,line,__VA_ARGS__)
+      char *arg[20];
+      int args = 0;
+      for (char *p = strtok (buf, " \t\r\n"); p && *p != '#' && args < sizeof (arg) / sizeof (*arg); p = strtok (NULL, " \t\r\n"))
+         arg[args++] = p;
+      if (!args)
+         continue;
+      unsigned char *bin = NULL;
+#define	hex(n,want,what) do{free(bin);bin=NULL;if(j_base16d(arg[n],&bin)!=want)fail(what);}while(0)
+      if (!strcmp (arg[0], "master") && args == 2)
+      {
+         l = layout_new (l, &used);
+         hex (1, 17, "Expecting key version and 16 byte AES key");
+         memcpy (l->master, bin, 17);
+         df_keyring_add (&ring, NULL, 0, *bin, bin + 1);
+      } else if (!strcmp (arg[0], "master-setting") && args == 2)
+      {
+         l = layout_new (l, &used);
+         hex (1, 1, "Expecting 2 hex digits");
+         l->mastersetting = *bin;
+      } else if (!strcmp (arg[0], "aid") && args >= 4)
+      {
+         l = layout_new (l, &used);
+         if (l->aids == MAXAID)
+            fail ("Too many AIDs");
+         typeof (l->aid[0]) * a = &l->aid[l->aids++];
+         memset (a, 0, sizeof (*a));
+         hex (1, 3, "Expecting 3 byte AID");
+         memcpy (a->aid, bin, 3);
+         hex (2, 1, "Expecting 2 hex digit setting");
+         a->setting = *bin;
+         a->keys = atoi (arg[3]);
+         if (!a->keys || a->keys > 14 || args > 4 + a->keys)
+            fail ("Bad number of keys");
+         for (int n = 0; n + 4 < args; n++)
+         {
+            hex (n + 4, 17, "Expecting key version and 16 byte AES key");
+            memcpy (a->key[n], bin, 17);
+         }
+      } else if ((!strcmp (arg[0], "file") && (args == 6 || args == 7)) || (!strcmp (arg[0], "value") && (args == 7 || args == 8))
+                 || (!strcmp (arg[0], "record") && args == 7))
+      {
+         l = layout_new (l, &used);
+         if (!l->aids)
+            fail ("No aid for file");
+         typeof (l->aid[0]) * a = &l->aid[l->aids - 1];
+         if (a->files == MAXFILE)
+            fail ("Too many files");
+         typeof (a->file[0]) * f = &a->file[a->files++];
+         memset (f, 0, sizeof (*f));
+         f->id = atoi (arg[1]);
+         f->comms = atoi (arg[*arg[0] == 'v' ? 2 : 3]);
+         hex (*arg[0] == 'v' ? 3 : 4, 2, "Expecting 4 hex digit access");
+         f->access = (bin[0] << 8) + bin[1];
+         if (*arg[0] == 'v')
+         {
+            f->type = 'V';
+            f->min = strtoul (arg[4], NULL, 0);
+            f->max = strtoul (arg[5], NULL, 0);
+            f->value = strtoul (arg[6], NULL, 0);
+            f->lc = (args == 8 && atoi (arg[7]));
+         } else
+         {
+            f->type = toupper (*arg[2]);
+            if (!strchr (*arg[0] == 'r' ? "LC" : "DB", f->type))
+               fail ("Bad file type");
+            f->size = strtoul (arg[5], NULL, 0);
+            if (*arg[0] == 'r')
+               f->recs = strtoul (arg[6], NULL, 0);
+            else if (args == 7)
+            {
+               f->len = j_base16d (arg[6], &f->data);
+               if (f->len > f->size)
+                  fail ("Data bigger than file");
+            }
+         }
+      } else if (!strcmp (arg[0], "card") && args <= 2)
+      {
+         job_add (l, args > 1 ? arg[1] : NULL);
+         used = 1;
+      } else if (!strcmp (arg[0], "cards") && args == 2)
+      {
+         for (int n = atoi (arg[1]); n > 0; n--)
+            job_add (l, NULL);
+         used = 1;
+      } else
+         fail ("Not understood");
+      free (bin);
+#undef hex
+#undef fail
+   }
+   free (buf);
+   fclose (f);
+}
+
+static void *
+capture_thread (void *arg)
+{                               /* Write the workers' capture rings to file, so file I/O is never on a worker's path */
+   int done = 0;
+   while (!done)
+   {
+      usleep (100000);
+      pthread_mutex_lock (&lock);
+      done = capdone;
+      pthread_mutex_unlock (&lock);
+      for (int n = 0; n < workers; n++)
+         if (pn532_cap_flush (worker[n].pn.cap, capfile) < 0)
+            err (1, "Capture write failed");
+      fflush (capfile);
+   }
+   return NULL;
+}
+
+int
+main (int argc, const char *argv[])
+{
+   const char *jobfile = NULL;
+   const char *capture = NULL;
+   poptContext optCon;
+   {
+      const struct poptOption optionsTable[] = {
+         {"jobs", 'j', POPT_ARG_STRING, &jobfile, 0, "Job file", "filename"},
+         {"retries", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &retries, 0, "Retries for failed card", "N"},
+         {"kbps", 0, POPT_ARG_INT, &kbps, 0, "Fastest RF bit rate to use if card allows, lower on RF errors (212/424/848)", "N"},
+         {"capture", 0, POPT_ARG_STRING, &capture, 0, "Capture serial traffic to pcap file (see pn532cap)", "filename"},
+         {"debug", 'v', POPT_ARG_NONE, &debug, 0, "Debug"},
+         POPT_AUTOHELP {}
+      };
+
+      optCon = poptGetContext (NULL, argc, argv, optionsTable, 0);
+      poptSetOtherOptionHelp (optCon, "ports...");
+
+      int c;
+      if ((c = poptGetNextOpt (optCon)) < -1)
+         errx (1, "%s: %s\n", poptBadOption (optCon, POPT_BADOPTION_NOALIAS), poptStrerror (c));
+
+      if (!poptPeekArg (optCon) || !jobfile)
+      {
+         poptPrintUsage (optCon, stderr, 0);
+         return -1;
+      }
+   }
+   df_keyring_add (&ring, NULL, 0, 0, NULL);    /* default */
+   job_file (jobfile);
+   if (!jobs)
+      errx (1, "No cards in %s", jobfile);
+   remaining = queued = jobs;
+
+   const char **ports = poptGetArgs (optCon);
+   while (ports[workers])
+      workers++;
+   worker = calloc (workers, sizeof (*worker));
+   if (!worker)
+      errx (1, "malloc");
+   if (capture && (!(capfile = fopen (capture, "w")) || pn532_cap_header (capfile)))
+      err (1, "Cannot write %s", capture);
+   for (int n = 0; n < workers; n++)
+   {
+      worker_t *w = &worker[n];
+      w->id = n;
+      w->port = ports[n];
+      int s = open (w->port, O_RDWR);
+      if (s < 0)
+         err (1, "Cannot open %s", w->port);
+      const char *e;
+      if ((e = pn532_tty (s)))
+         err (1, "%s: %s", w->port, e);
+      w->pn.debug = (debug ? stderr : NULL);
+      if (capfile && !(w->pn.cap = pn532_cap_new (1 << 18, n)))
+         errx (1, "malloc");
+      if ((e = pn532_init (&w->pn, s, 0)))
+         errx (1, "Cannot init PN532 on %s: %s", w->port, e);
+      w->pn.maxkbps = kbps;
+      if ((e = df_init (&w->d, &w->pn, &pn532_dx)))
+         errx (1, "Failed DF init: %s", e);
+      pthread_mutex_init (&w->queue.mutex, NULL);
+      if (!(w->queue.job = malloc (sizeof (*w->queue.job) * jobs)))
+         errx (1, "malloc");
+   }
+   for (int n = 0; n < jobs; n++)
+      queue_put (&worker[n % workers].queue, &job[n]); /* Deal out jobs */
+
+   pthread_t capthread;
+   if (capfile && pthread_create (&capthread, NULL, capture_thread, NULL))
+      errx (1, "Cannot start thread");
+   long long start = now ();
+   for (int n = 0; n < workers; n++)
+      if (pthread_create (&worker[n].thread, NULL, worker_thread, &worker[n]))
+         errx (1, "Cannot start thread");
+   for (int n = 0; n < workers; n++)
+      pthread_join (worker[n].thread, NULL);
+   long long t = now () - start;
+   if (capfile)
+   {
+      pthread_mutex_lock (&lock);
+      capdone = 1;
+      pthread_mutex_unlock (&lock);
+      pthread_join (capthread, NULL);
+      if (fclose (capfile))
+         err (1, "Capture write failed");
+   }
+
+   /* Report */
+   j_t j = j_create ();
+   j_t r = j_store_array (j, "readers");
+   int cards = 0;
+   for (int n = 0; n < workers; n++)
+   {
+      worker_t *w = &worker[n];
+      j_t o = j_append_object (r);
+      j_store_string (o, "port", w->port);
+      j_store_int (o, "cards", w->cards);
+      if (w->failed)
+         j_store_int (o, "failed", w->failed);
+      if (w->busy)
+         j_store_stringf (o, "per-minute", "%.1f", w->cards * 60000000.0 / w->busy);
+      if (w->pn.cap && pn532_cap_dropped (w->pn.cap))
+         j_store_int (o, "capture-dropped", pn532_cap_dropped (w->pn.cap));
+      cards += w->cards;
+      close (w->pn.s);
+      pn532_cap_free (w->pn.cap);
+      free (w->queue.job);
+   }
+   j_store_int (j, "cards", cards);
+   if (giveup)
+      j_store_int (j, "given-up", giveup);
+   if (remaining)
+      j_store_int (j, "not-done", remaining);
+   j_store_stringf (j, "per-minute", "%.1f", cards * 60000000.0 / t);
+   j_err (j_write_pretty (j, stdout));
+   j_delete (&j);
+   df_keyring_free (&ring);
+   poptFreeContext (optCon);
+   return 0;
+}
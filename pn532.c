@@ -13,267 +13,522 @@
 
 #include <unistd.h>
 #include <stdio.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#ifdef	__linux__
+#include <linux/serial.h>
+#endif
 #include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <alloca.h>
 #include "pn532.h"
 #include <openssl/evp.h>
 #include "desfireaes.h"
 
+#ifdef	DF_SDT
+#include <sys/sdt.h>            /* USDT probes (provider pn532), see probes/ */
+#define	PROBE(...)	STAP_PROBEV(pn532,__VA_ARGS__)
+#else
+#define	PROBE(...)
+#endif
+/* Stage for timeout and checksum probes */
+#define	STAGE_ACK	1
+#define	STAGE_PREAMBLE	2
+#define	STAGE_HEADER	3
+#define	STAGE_DATA	4
+
 /* #define DEBUGLOW */
-extern int debug;
 
-static int
-pn532_get (int s, unsigned int us)
+static long long
+now (void)
+{                               /* Monotonic time (us) */
+   struct timespec t;
+   clock_gettime (CLOCK_MONOTONIC, &t);
+   return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
+/* Capture ring, one producer (the reader's thread), one consumer (whoever calls pn532_cap_flush) */
+struct pn532_cap_s
 {
-   fd_set r;
-   FD_ZERO (&r);
-   FD_SET (s, &r);
-   struct timeval t = { 0, us };
-   if (select (s + 1, &r, NULL, NULL, &t) < 1)
-      return -1;
-   unsigned char b = 0;
-   if (read (s, &b, 1) != 1)
+   atomic_uint head;            /* Bytes written (free running), only changed by producer */
+   atomic_uint tail;            /* Bytes flushed (free running), only changed by consumer */
+   atomic_uint dropped;         /* Records not captured as ring full */
+   unsigned int size;           /* Ring size, power of 2 */
+   unsigned char id;            /* Reader ID in capture file */
+   unsigned char ring[];
+};
+
+typedef struct cap_rec_s cap_rec_t;
+struct cap_rec_s
+{                               /* Ring record header, followed by data */
+   uint64_t ns;                 /* Real time */
+   uint16_t len;                /* Data length */
+   uint8_t dir;                 /* PN532_CAP_TX/RX */
+   uint8_t id;
+};
+
+static void
+cap_copy (pn532_cap_t * c, unsigned int pos, unsigned char *to, const unsigned char *from, unsigned int len, int put)
+{                               /* Copy to or from ring at pos, wrapping */
+   pos &= c->size - 1;
+   unsigned int n = c->size - pos;
+   if (n > len)
+      n = len;
+   if (put)
+   {
+      memcpy (c->ring + pos, from, n);
+      memcpy (c->ring, from + n, len - n);
+   } else
+   {
+      memcpy (to, c->ring + pos, n);
+      memcpy (to + n, c->ring, len - n);
+   }
+}
+
+static void
+cap_add (pn532_cap_t * c, unsigned char dir, const unsigned char *buf, unsigned int len)
+{                               /* Add a record, just a clock read and memcpy, never blocks */
+   if (len > 0xFFFF)
+      len = 0xFFFF;
+   unsigned int head = atomic_load_explicit (&c->head, memory_order_relaxed);
+   unsigned int tail = atomic_load_explicit (&c->tail, memory_order_acquire);
+   if (sizeof (cap_rec_t) + len > c->size - (head - tail))
+   {
+      atomic_fetch_add_explicit (&c->dropped, 1, memory_order_relaxed);
+      return;
+   }
+   struct timespec t;
+   clock_gettime (CLOCK_REALTIME, &t);
+   cap_rec_t r = {.ns = t.tv_sec * 1000000000ULL + t.tv_nsec,.len = len,.dir = dir,.id = c->id };
+   cap_copy (c, head, NULL, (void *) &r, sizeof (r), 1);
+   cap_copy (c, head + sizeof (r), NULL, buf, len, 1);
+   atomic_store_explicit (&c->head, head + sizeof (r) + len, memory_order_release);
+}
+
+pn532_cap_t *
+pn532_cap_new (unsigned int size, unsigned char id)
+{                               /* New capture ring, size rounded up to power of 2 */
+   unsigned int s = 4096;
+   while (s < size && s < 0x40000000)
+      s <<= 1;
+   pn532_cap_t *c = calloc (1, sizeof (*c) + s);
+   if (!c)
+      return NULL;
+   c->size = s;
+   c->id = id;
+   return c;
+}
+
+void
+pn532_cap_free (pn532_cap_t * c)
+{
+   free (c);
+}
+
+unsigned int
+pn532_cap_dropped (pn532_cap_t * c)
+{
+   return atomic_load_explicit (&c->dropped, memory_order_relaxed);
+}
+
+int
+pn532_cap_header (FILE * f)
+{                               /* pcap file header (nanosecond timestamps), records are dir, id, then raw serial bytes */
+   uint32_t h[6] = { 0xA1B23C4D, 0x00040002, 0, 0, 0xFFFF + 2, PN532_CAP_LINKTYPE };
+   return fwrite (h, sizeof (h), 1, f) == 1 ? 0 : -1;
+}
+
+int
+pn532_cap_flush (pn532_cap_t * c, FILE * f)
+{                               /* Write what has been captured to pcap file, returns records, -ve for error */
+   unsigned int tail = atomic_load_explicit (&c->tail, memory_order_relaxed);
+   unsigned int head = atomic_load_explicit (&c->head, memory_order_acquire);
+   int n = 0;
+   while (head - tail >= sizeof (cap_rec_t))
+   {
+      cap_rec_t r;
+      cap_copy (c, tail, (void *) &r, NULL, sizeof (r), 0);
+      unsigned char buf[2 + 0xFFFF];
+      buf[0] = r.dir;
+      buf[1] = r.id;
+      cap_copy (c, tail + sizeof (r), buf + 2, NULL, r.len, 0);
+      uint32_t h[4] = { r.ns / 1000000000ULL, r.ns % 1000000000ULL, r.len + 2, r.len + 2 };
+      if (fwrite (h, sizeof (h), 1, f) != 1 || fwrite (buf, r.len + 2, 1, f) != 1)
+         return -1;
+      tail += sizeof (r) + r.len;
+      atomic_store_explicit (&c->tail, tail, memory_order_release);
+      n++;
+   }
+   return n;
+}
+
+static int
+uart_fill (pn532_t * p, long long deadline)
+{                               /* Wait until deadline for data, and read all that is waiting in to rx buffer, returns bytes added, 0 timeout, -ve error */
+   if (p->s < 0)
       return -1;
-   return b;
+   unsigned int used = p->rxin - p->rxout;
+   if (used == sizeof (p->rx))
+      return -1;                /* Full, should not happen as only called when we need more */
+   while (1)
+   {
+      long long left = deadline - now ();
+      struct pollfd f = {.fd = p->s,.events = POLLIN };
+      int r = poll (&f, 1, left > 0 ? (left + 999) / 1000 : 0);
+      if (r < 0 && errno == EINTR)
+         continue;
+      if (r <= 0)
+         return r;
+      unsigned int pos = p->rxin % sizeof (p->rx),
+         space = sizeof (p->rx) - used;
+      if (space > sizeof (p->rx) - pos)
+         space = sizeof (p->rx) - pos;  /* Up to end, rest next time */
+      ssize_t l = read (p->s, p->rx + pos, space);
+      if (l < 0 && (errno == EINTR || errno == EAGAIN))
+         continue;
+      if (l <= 0)
+         return -1;
+      if (p->cap)
+         cap_add (p->cap, PN532_CAP_RX, p->rx + pos, l);
+      p->rxin += l;
+      return l;
+   }
 }
 
 static int
-uart_rx (int s, unsigned char *buf, int len, int ms)
-{
-   int l = 0,
-      v;
-   while (l < len && (v = pn532_get (s, ms * 1000)) >= 0)
-      buf[l++] = v;
-   if (s < 0)
+uart_rx (pn532_t * p, unsigned char *buf, int len, int ms)
+{                               /* Get len bytes, within ms, returns bytes got */
+   long long deadline = now () + ms * 1000LL;
+   int l = 0;
+   while (l < len)
+   {
+      unsigned int n = p->rxin - p->rxout;
+      if (!n)
+      {
+         if (uart_fill (p, deadline) <= 0)
+            break;
+         continue;
+      }
+      if (n > len - l)
+         n = len - l;
+      unsigned int pos = p->rxout % sizeof (p->rx);
+      if (n > sizeof (p->rx) - pos)
+         n = sizeof (p->rx) - pos;
+      memcpy (buf + l, p->rx + pos, n);
+      p->rxout += n;
+      l += n;
+   }
+   if (p->s < 0)
       return -1;
 #ifdef	DEBUGLOW
    fprintf (stderr, "<");
-   for (int i = 0; i < len; i++)
+   for (int i = 0; i < l; i++)
       fprintf (stderr, "%02X ", buf[i]);
-   fprintf (stderr, "(%d)\n", len);
+   fprintf (stderr, "(%d)\n", l);
 #endif
    return l;
 }
 
-static void
-pn532_put (int s, unsigned char b)
-{
-   write (s, &b, 1);
-}
-
-static void
-uart_tx (int s, unsigned char *buf, int len)
-{
-   for (int l = 0; l < len; l++)
-      pn532_put (s, buf[l]);
+static int
+uart_tx (pn532_t * p, const unsigned char *buf, int len)
+{                               /* Write all of buf in one go, the kernel drains it, returns len or -1 */
+   int l = 0;
+   while (l < len)
+   {
+      int n = write (p->s, buf + l, len - l);
+      if (n > 0)
+      {
+         l += n;
+         continue;
+      }
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n < 0 && errno == EAGAIN)
+      {                         /* Non blocking and tx buffer full */
+         struct pollfd f = {.fd = p->s,.events = POLLOUT };
+         if (poll (&f, 1, 100) > 0)
+            continue;
+      }
+      return -1;
+   }
+   if (p->cap)
+      cap_add (p->cap, PN532_CAP_TX, buf, len);
 #ifdef	DEBUGLOW
    fprintf (stderr, ">");
    for (int i = 0; i < len; i++)
       fprintf (stderr, "%02X ", buf[i]);
    fprintf (stderr, "(%d)\n", len);
 #endif
-   usleep (len * 1000000 / 115200 / 10);
+   return l;
 }
 
 static int
-uart_preamble (int s, int ms)
-{                               /* Wait for preamble */
-   unsigned char last = 0xFF;
+uart_ms (pn532_t * p, int len)
+{                               /* Time to send len bytes at current baud rate, 8N1 */
+   unsigned int baud = p->baud ? : 115200;
+   return (len * 10000 + baud - 1) / baud;
+}
+
+static const char *
+uart_speed (pn532_t * p, unsigned int baud)
+{                               /* Set host baud rate, once anything queued has gone */
+   struct termios t;
+   if (tcgetattr (p->s, &t))
+      return "Failed to get serial setting";
+   if (cfsetspeed (&t, baud))
+      return "Baud rate not supported by serial port";
+   if (tcsetattr (p->s, TCSADRAIN, &t))
+      return "Failed to set serial";
+   p->baud = baud;
+   p->rxout = p->rxin;          /* Anything received was at the old rate */
+   return NULL;
+}
+
+static int
+uart_preamble (pn532_t * p, int ms)
+{                               /* Wait for preamble, discarding anything before it */
+   long long deadline = now () + ms * 1000LL;
    while (1)
    {
-      unsigned char c;
-      int l = uart_rx (s, &c, 1, ms);
-      if (l < 1)
+      while (p->rxin - p->rxout >= 2)
+      {
+         if (!p->rx[p->rxout % sizeof (p->rx)] && p->rx[(p->rxout + 1) % sizeof (p->rx)] == 0xFF)
+         {
+            p->rxout += 2;
+            return 2;
+         }
+         p->rxout++;
+      }
+      int l = uart_fill (p, deadline);
+      if (l <= 0)
          return l;
-      if (last == 0x00 && c == 0xFF)
-         return 2;
-      last = c;
    }
 }
 
+/* Response time tracking, as TCP RTO (RFC 6298), used for timeouts if p->adaptive */
+#define	PN532_RTT_LEARN		4       /* Samples before we use them */
+#define	PN532_RTT_MARGIN	2000    /* us added to learned timeout */
+static void
+rtt_add (pn532_rtt_t * r, long long us)
+{                               /* New sample */
+   if (us < 0)
+      us = 0;
+   if (!r->count++)
+   {
+      r->srtt = us;
+      r->rttvar = us / 2;
+      return;
+   }
+   unsigned int d = (r->srtt > us ? r->srtt - us : us - r->srtt);
+   r->rttvar = (3 * r->rttvar + d) / 4;
+   r->srtt = (7 * r->srtt + us) / 8;
+}
+
+static int
+rtt_ms (pn532_t * p, pn532_rtt_t * r, int ms)
+{                               /* Timeout to use, ms is the default and most we will use */
+   if (!p->adaptive || !r || r->count < PN532_RTT_LEARN)
+      return ms;
+   unsigned int us = r->srtt + 4 * r->rttvar;   /* Host side only, the PN532 RF timeout stays at the card's FWT */
+   int t = (us + PN532_RTT_MARGIN + 999) / 1000;
+   return t < ms ? t : ms;
+}
+
+static void
+pn532_abort (pn532_t * p)
+{                               /* ACK aborts current command, and drop anything sent as we did so */
+   static const unsigned char ack[] = { 0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00 };
+   uart_tx (p, ack, sizeof (ack));
+   while (uart_fill (p, now () + 5000) > 0)
+      p->rxout = p->rxin;
+}
+
 /* Low level access functions */
 static int
-pn532_tx (int s, unsigned char cmd, int len1, unsigned char *data1, int len2, unsigned char *data2, const char *name)
+pn532_tx (pn532_t * p, unsigned char cmd, int len1, unsigned char *data1, int len2, unsigned char *data2, const char *name)
 {                               /* Send data to PN532 */
-   if (debug)
-      fprintf (stderr, "[32m");
-   unsigned char buf[20],
-    *b = buf;
-   *b++ = 0x55;
-   *b++ = 0x55;
-   *b++ = 0x55;
-   *b++ = 0x00;                 /* Preamble */
-   *b++ = 0x00;                 /* Start 1 */
-   *b++ = 0xFF;                 /* Start 2 */
-   int l = len1 + len2 + 2;
-   if (l >= 0x100)
+   PROBE (tx, p, cmd, len1 + len2, name);
+   p->rtt = NULL;
+   unsigned char buf[len1 + len2 + 15];
+   int l = pn532_frame (buf, sizeof (buf), cmd, len1, data1, len2, data2);
+   if (l < 0)
+      return -1;
+   if (p->debug)
    {
-      *b++ = 0xFF;              /* Extended len */
-      *b++ = 0xFF;
-      *b++ = (l >> 8);          /* len */
-      *b++ = (l & 0xFF);
-      *b++ = -(l >> 8) - (l & 0xFF);    /* Checksum */
-   } else
+      int d = l - len1 - len2 - 2;      /* Start of data */
+      fprintf (p->debug, "[32mTx[3m");
+      for (int i = 6; i < d; i++)
+         fprintf (p->debug, " %02X", buf[i]);
+      fprintf (p->debug, "[0;1;32m");
+      for (int i = d; i < l - 2; i++)
+         fprintf (p->debug, " %02X", buf[i]);
+      fprintf (p->debug, "[0;32;3m");
+      for (int i = l - 2; i < l; i++)
+         fprintf (p->debug, " %02X", buf[i]);
+      fprintf (p->debug, "[0;32m");
+      if (name)
+         fprintf (p->debug, " %s", name);
+   }
+   /* Send whole frame with one write, the ACK is what tells us it has gone */
+   if (uart_tx (p, buf, l) < 0)
    {
-      *b++ = l;                 /* Len */
-      *b++ = -l;                /* Checksum */
+      if (p->debug)
+         fprintf (p->debug, " [31mWrite failed[0m\n");
+      return -1;
    }
-   *b++ = 0xD4;                 /* Direction (host to PN532) */
-   *b++ = cmd;
-   unsigned char sum = 0xD4 + cmd;
-   for (l = 0; l < len1; l++)
-      sum += data1[l];
-   for (l = 0; l < len2; l++)
-      sum += data2[l];
-   if (debug)
-   {
-      fprintf (stderr, "Tx[3m");
-      for (int i = 0; i < b - buf - 6; i++)
-         fprintf (stderr, " %02X", buf[i + 6]);
-      fprintf (stderr, "[0;1;32m");
-   }
-   /* Send data */
-   uart_tx (s, buf, b - buf);
-   if (len1)
-   {
-      if (debug)
-         for (int i = 0; i < len1; i++)
-            fprintf (stderr, " %02X", data1[i]);
-      uart_tx (s, data1, len1);
-   }
-   if (len2)
-   {
-      if (debug)
-         for (int i = 0; i < len2; i++)
-            fprintf (stderr, " %02X", data2[i]);
-      uart_tx (s, data2, len2);
-   }
-   buf[0] = -sum;               /* Checksum */
-   buf[1] = 0x00;               /* Postamble */
-   if (debug)
-   {
-      fprintf (stderr, "[0;32;3m");
-      for (int i = 0; i < 2; i++)
-         fprintf (stderr, " %02X", buf[i]);
-      fprintf (stderr, "[0;32m");
-   }
-   uart_tx (s, buf, 2);
-   if (debug && name)
-      fprintf (stderr, " %s", name);
    /* Get ACK and check it */
-   l = uart_preamble (s, 50);
+   int ms = uart_ms (p, l);
+   p->t0 = now () + ms * 1000LL;        /* When sent */
+   ms += rtt_ms (p, &p->ack, 50);
+   l = uart_preamble (p, ms);
    if (l < 2)
    {
-      if (debug)
-         fprintf (stderr, " [31mPreamble timeout[0m\n");
+      PROBE (timeout, p, cmd, STAGE_ACK, ms);
+      if (p->debug)
+         fprintf (p->debug, " [31mPreamble timeout[0m\n");
+      if (p->adaptive)
+         p->ack.rttvar *= 2;
       return -1;
    }
-   l = uart_rx (s, buf, 3, 5);
+   l = uart_rx (p, buf, 3, 5);
    if (l < 3)
    {
-      if (debug)
-         fprintf (stderr, " [31mACK timeout[0m\n");
+      PROBE (timeout, p, cmd, STAGE_ACK, 5);
+      if (p->debug)
+         fprintf (p->debug, " [31mACK timeout[0m\n");
       return -1;
    }
    if (buf[2])
    {
-      if (debug)
-         fprintf (stderr, " [31mBad ACK[0m\n");
+      PROBE (checksum, p, cmd, STAGE_ACK);
+      if (p->debug)
+         fprintf (p->debug, " [31mBad ACK[0m\n");
       return -1;
    }
    if (buf[0] == 0xFF && !buf[1])
    {
-      if (debug)
-         fprintf (stderr, " [31mNAK[0m\n");
+      PROBE (nak, p, cmd);
+      if (p->debug)
+         fprintf (p->debug, " [31mNAK[0m\n");
       return -1;
    }
    if (buf[0] || buf[1] != 0xFF)
    {
-      if (debug)
-         fprintf (stderr, " [31mBad ACK[0m\n");
+      PROBE (checksum, p, cmd, STAGE_ACK);
+      if (p->debug)
+         fprintf (p->debug, " [31mBad ACK[0m\n");
       return -1;
    }
-   if (debug)
-      fprintf (stderr, "[0m\n");
+   PROBE (ack, p, cmd);
+   if (p->debug)
+      fprintf (p->debug, "[0m\n");
+   rtt_add (&p->ack, now () - p->t0);
+   p->t0 = now ();
+   p->rtt = &p->cmd[cmd & 0x7F];
    return len1 + len2;
 }
 
 int
-pn532_rx (int s, int max1, unsigned char *data1, int max2, unsigned char *data2, int ms)
+pn532_rx (pn532_t * p, int max1, unsigned char *data1, int max2, unsigned char *data2, int ms)
 {                               /* Recv data from PN532 */
-   if (debug)
-      fprintf (stderr, "[33m");
-   int l = uart_preamble (s, ms);
+   if (p->debug)
+      fprintf (p->debug, "[33m");
+   pn532_rtt_t *r = p->rtt;
+   p->rtt = NULL;
+   int def = ms;
+   ms = rtt_ms (p, r, ms);
+   p->timeout = 0;
+   int l = uart_preamble (p, ms);
    if (l < 2)
    {
-      if (debug)
-         fprintf (stderr, "Rx [31mpremable timeout[0m\n");
+      p->timeout = 1;
+      PROBE (timeout, p, 0, STAGE_PREAMBLE, ms);
+      if (p->debug)
+         fprintf (p->debug, "Rx [31mpremable timeout[0m\n");
+      if (ms < def)
+      {                         /* Our learned deadline, so back off, and the PN532 may still be waiting for the card */
+         r->rttvar *= 2;
+         pn532_abort (p);
+      }
       return -1;
    }
+   if (r)
+      rtt_add (r, now () - p->t0);
    unsigned char buf[9];
-   l = uart_rx (s, buf, 4, 20);
-   if (debug)
+   l = uart_rx (p, buf, 4, 20);
+   if (p->debug)
    {
-      fprintf (stderr, "Rx[3m");
+      fprintf (p->debug, "Rx[3m");
       for (int i = 0; i < l; i++)
-         fprintf (stderr, " %02X", buf[i]);
+         fprintf (p->debug, " %02X", buf[i]);
    }
    if (l < 4)
    {
-      if (debug)
-         fprintf (stderr, " [31mheader timeout[0m\n");
+      PROBE (timeout, p, 0, STAGE_HEADER, 20);
+      if (p->debug)
+         fprintf (p->debug, " [31mheader timeout[0m\n");
       return -1;
    }
    unsigned char cmd;
    int len = 0;
    if (buf[0] == 0xFF && buf[1] == 0xFF)
    {                            /* Extended */
-      l = uart_rx (s, buf + 4, 3, 10);
-      if (debug)
+      l = uart_rx (p, buf + 4, 3, 10);
+      if (p->debug)
       {
          for (int i = 0; i < l; i++)
-            fprintf (stderr, " %02X", buf[4 + i]);
+            fprintf (p->debug, " %02X", buf[4 + i]);
       }
       if (l < 3)
       {
-         if (debug)
-            printf (" [31mShort header[0m\n");
+         PROBE (timeout, p, 0, STAGE_HEADER, 10);
+         if (p->debug)
+            fprintf (p->debug, " [31mShort header[0m\n");
          return -1;
       }
       if ((unsigned char) (buf[2] + buf[3] + buf[4]))
       {
-         if (debug)
-            printf (" [31mBad header[0m\n");
+         PROBE (checksum, p, 0, STAGE_HEADER);
+         if (p->debug)
+            fprintf (p->debug, " [31mBad header[0m\n");
          return -1;
       }
       len = (buf[2] << 8) + buf[3];
       if (buf[5] != 0xD5)
       {
-         if (debug)
-            printf (" [31mNot expected response[0m\n");
+         if (p->debug)
+            fprintf (p->debug, " [31mNot expected response[0m\n");
          return -1;
       }
       cmd = buf[6];
    } else
    {                            /* Normal */
       if ((unsigned char) (buf[0] + buf[1]))
+      {
+         PROBE (checksum, p, 0, STAGE_HEADER);
          return -1;
+      }
       len = buf[0];
       if (buf[2] != 0xD5)
       {
-         if (debug)
-            printf (" [31mNot expected response[0m\n");
+         if (p->debug)
+            fprintf (p->debug, " [31mNot expected response[0m\n");
          return -1;
       }
       cmd = buf[3];
    }
-   if (debug)
-      fprintf (stderr, "[0;1;33m");
+   if (p->debug)
+      fprintf (p->debug, "[0;1;33m");
    if (len < 2)
    {
-      if (debug)
-         fprintf (stderr, " [31mBad len %d[0m\n", len);
+      if (p->debug)
+         fprintf (p->debug, " [31mBad len %d[0m\n", len);
       return -1;
    }
    len -= 2;
@@ -281,8 +536,8 @@ pn532_rx (int s, int max1, unsigned char *data1, int max2, unsigned char *data2,
    unsigned char sum = 0xD5 + cmd;
    if (len > max1 + max2)
    {
-      if (debug)
-         fprintf (stderr, " [31mOver len %d>%d[0m\n", len, max1 + max2);
+      if (p->debug)
+         fprintf (p->debug, " [31mOver len %d>%d[0m\n", len, max1 + max2);
       return -1;
    }
    if (data1)
@@ -292,15 +547,16 @@ pn532_rx (int s, int max1, unsigned char *data1, int max2, unsigned char *data2,
          l = len;
       if (l)
       {
-         if (uart_rx (s, data1, l, 50) < l)
+         if (uart_rx (p, data1, l, 50) < l)
          {
-            if (debug)
-               fprintf (stderr, " [31mTimeout[0m\n");
+            PROBE (timeout, p, cmd, STAGE_DATA, 50);
+            if (p->debug)
+               fprintf (p->debug, " [31mTimeout[0m\n");
             return -1;
          }
-         if (debug)
+         if (p->debug)
             for (int i = 0; i < l; i++)
-               fprintf (stderr, " %02X", data1[i]);
+               fprintf (p->debug, " %02X", data1[i]);
          len -= l;
          while (l)
             sum += data1[--l];
@@ -314,88 +570,130 @@ pn532_rx (int s, int max1, unsigned char *data1, int max2, unsigned char *data2,
          l = len;
       if (l)
       {
-         if (uart_rx (s, data2, l, 50) < l)
+         if (uart_rx (p, data2, l, 50) < l)
          {
-            if (debug)
-               fprintf (stderr, " [31mTimeout[0m\n");
+            PROBE (timeout, p, cmd, STAGE_DATA, 50);
+            if (p->debug)
+               fprintf (p->debug, " [31mTimeout[0m\n");
             return -1;
          }
-         if (debug)
+         if (p->debug)
             for (int i = 0; i < l; i++)
-               fprintf (stderr, " %02X", data2[i]);
+               fprintf (p->debug, " %02X", data2[i]);
          len -= l;
          while (l)
             sum += data2[--l];
       }
    } else
       max2 = 0;
-   l = uart_rx (s, buf, 2, 50);
+   l = uart_rx (p, buf, 2, 50);
    if (l < 2)
    {
-      if (debug)
-         fprintf (stderr, " [31mTimeout[0m\n");
+      PROBE (timeout, p, cmd, STAGE_DATA, 50);
+      if (p->debug)
+         fprintf (p->debug, " [31mTimeout[0m\n");
       return -1;
    }
-   if (debug)
+   if (p->debug)
    {
-      fprintf (stderr, "[0;33;3m");
+      fprintf (p->debug, "[0;33;3m");
       for (int i = 0; i < l; i++)
-         fprintf (stderr, " %02X", buf[i]);
-      fprintf (stderr, "[0;33m");
+         fprintf (p->debug, " %02X", buf[i]);
+      fprintf (p->debug, "[0;33m");
    }
    if ((unsigned char) (buf[0] + sum))
    {
-      if (debug)
-         fprintf (stderr, " [31mBad checksum[0m\n");
+      PROBE (checksum, p, cmd, STAGE_DATA);
+      if (p->debug)
+         fprintf (p->debug, " [31mBad checksum[0m\n");
       return -1;
    }
    if (buf[1])
    {
-      if (debug)
-         fprintf (stderr, " [31mBad postamble[0m\n");
+      if (p->debug)
+         fprintf (p->debug, " [31mBad postamble[0m\n");
       return -1;
    }
-   if (debug && cmd == 0x41 && res > 1)
+   if (p->debug && cmd == 0x41 && res > 1)
    {
       if (max1 > 1)
-         fprintf (stderr, " %s", df_err (data1[1]));
+         fprintf (p->debug, " %s", df_err (data1[1]));
       else if (max1 + max2 > 1)
-         fprintf (stderr, " %s", df_err (data2[1 - max1]));
+         fprintf (p->debug, " %s", df_err (data2[1 - max1]));
    }
-   if (debug)
-      fprintf (stderr, "[0m\n");
+   PROBE (rx, p, cmd, res);
+   if (p->debug)
+      fprintf (p->debug, "[0m\n");
    return res;
 }
 
 const char *
-pn532_init (int s, unsigned char outputs)
-{
+pn532_tty (int s)
+{                               /* Set up serial port for PN532, raw 115200, low latency */
+   struct termios t;
+   if (tcgetattr (s, &t))
+      return "Failed to get serial setting";
+   cfmakeraw (&t);
+   cfsetspeed (&t, 115200);
+   t.c_cflag |= CLOCAL | CREAD;
+   t.c_cc[VMIN] = 0;            /* read() returns what is there, we poll() first */
+   t.c_cc[VTIME] = 0;
+   if (tcsetattr (s, TCSANOW, &t))
+      return "Failed to set serial";
+#if	defined(__linux__) && defined(ASYNC_LOW_LATENCY)
+   struct serial_struct ss;
+   if (!ioctl (s, TIOCGSERIAL, &ss) && !(ss.flags & ASYNC_LOW_LATENCY))
+   {                            /* e.g. FTDI latency timer 16ms down to 1ms, not all drivers support it, so not an error */
+      ss.flags |= ASYNC_LOW_LATENCY;
+      ioctl (s, TIOCSSERIAL, &ss);
+   }
+#endif
+   return NULL;
+}
+
+const char *
+pn532_init (pn532_t * p, int s, unsigned char outputs)
+{                               /* p->debug and p->baud can be set before calling */
+   p->s = s;
+   unsigned int baud = p->baud; /* Wanted */
+   p->baud = 115200;            /* As set by pn532_tty, and PN532 power on default */
+   p->rtt = NULL;
+   memset (&p->ack, 0, sizeof (p->ack));
+   memset (p->cmd, 0, sizeof (p->cmd));
+   memset (p->dx, 0, sizeof (p->dx));
+   p->kbps = 106;
    /* init */
    unsigned char buf[30] = { };
    buf[sizeof (buf) - 1] = 0x55;
    buf[sizeof (buf) - 2] = 0x55;
    buf[sizeof (buf) - 3] = 0x55;
-   uart_tx (s, buf, sizeof (buf));
+   uart_tx (p, buf, sizeof (buf));
+   tcdrain (p->s);              /* Wake up needs to be sent before anything else */
    /* Set up PN532 (SAM first as in vLowBat mode) */
-   while (pn532_get (s, 10000) >= 0);   /* clear all rx buffer */
+   p->rxin = p->rxout = 0;
+   while (uart_fill (p, now () + 10000) > 0)
+      p->rxout = p->rxin;       /* clear all rx buffer */
    /* SAMConfiguration */
    int n = 0;
    buf[n++] = 0x01;             /* Normal */
    buf[n++] = 20;               /* *50ms timeout */
    buf[n++] = 0x00;             /* Not use IRQ */
-   if (pn532_tx (s, 0x14, 0, NULL, n, buf, "SAMConfiguration") < 0 || pn532_rx (s, 0, NULL, sizeof (buf), buf, 50) < 0)
+   if (pn532_tx (p, 0x14, 0, NULL, n, buf, "SAMConfiguration") < 0 || pn532_rx (p, 0, NULL, sizeof (buf), buf, 50) < 0)
    {                            /* Again */
-      uart_rx (s, buf, sizeof (buf), 100);      /* Wait long enough for command response timeout before we try again */
+      uart_rx (p, buf, sizeof (buf), 100);      /* Wait long enough for command response timeout before we try again */
       /* SAMConfiguration */
       n = 0;
       buf[n++] = 0x01;          /* Normal */
       buf[n++] = 20;            /* *50ms timeout */
       buf[n++] = 0x00;          /* Not use IRQ */
-      if (pn532_tx (s, 0x14, 0, NULL, n, buf, "SAMConfiguration") < 0 || pn532_rx (s, 0, NULL, sizeof (buf), buf, 50) < 0)
+      if ((pn532_tx (p, 0x14, 0, NULL, n, buf, "SAMConfiguration") < 0 || pn532_rx (p, 0, NULL, sizeof (buf), buf, 50) < 0)
+          && (!baud || baud == p->baud || uart_speed (p, baud)      /* Maybe left at wanted rate from before */
+              || pn532_tx (p, 0x14, 0, NULL, n, buf, "SAMConfiguration") < 0
+              || pn532_rx (p, 0, NULL, sizeof (buf), buf, 50) < 0))
          return "SAMConfiguration fail";
    }
    /* GetFirmwareVersion */
-   if (pn532_tx (s, 0x02, 0, NULL, 0, NULL, "GetFirmwareVersion") < 0 || pn532_rx (s, 0, NULL, sizeof (buf), buf, 50) < 0)
+   if (pn532_tx (p, 0x02, 0, NULL, 0, NULL, "GetFirmwareVersion") < 0 || pn532_rx (p, 0, NULL, sizeof (buf), buf, 50) < 0)
       return "GetFirmwareVersion fail";
    /* RFConfiguration (retries) */
    n = 0;
@@ -403,7 +701,7 @@ pn532_init (int s, unsigned char outputs)
    buf[n++] = 0xFF;             /* MxRtyATR (default = 0xFF) */
    buf[n++] = 0x01;             /* MxRtyPSL (default = 0x01) */
    buf[n++] = 0x01;             /* MxRtyPassiveActivation */
-   if (pn532_tx (s, 0x32, 0, NULL, n, buf, "RFConfiguration") < 0 || pn532_rx (s, 0, NULL, sizeof (buf), buf, 50) < 0)
+   if (pn532_tx (p, 0x32, 0, NULL, n, buf, "RFConfiguration") < 0 || pn532_rx (p, 0, NULL, sizeof (buf), buf, 50) < 0)
       return "RFConfiguration fail";
    /* WriteRegister */
    n = 0;
@@ -426,13 +724,13 @@ pn532_init (int s, unsigned char outputs)
    buf[n++] = 0xFF;             /* P7 */
    buf[n++] = 0xF7;             /* P7 */
    buf[n++] = 0xFF;             /* All high */
-   if (n && (pn532_tx (s, 0x08, 0, NULL, n, buf, "WriteRegister") < 0 || pn532_rx (s, 0, NULL, sizeof (buf), buf, 50) < 0))
+   if (n && (pn532_tx (p, 0x08, 0, NULL, n, buf, "WriteRegister") < 0 || pn532_rx (p, 0, NULL, sizeof (buf), buf, 50) < 0))
       return "WriteRegister fail";
    /* RFConfiguration */
    n = 0;
    buf[n++] = 0x04;             /* MaxRtyCOM */
    buf[n++] = 1;                /* Retries (default 0) */
-   if (pn532_tx (s, 0x32, 0, NULL, n, buf, "RFConfiguration") < 0 || pn532_rx (s, 0, NULL, sizeof (buf), buf, 50) < 0)
+   if (pn532_tx (p, 0x32, 0, NULL, n, buf, "RFConfiguration") < 0 || pn532_rx (p, 0, NULL, sizeof (buf), buf, 50) < 0)
       return "RFConfiguration fail";
    /* RFConfiguration */
    n = 0;
@@ -440,18 +738,89 @@ pn532_init (int s, unsigned char outputs)
    buf[n++] = 0x00;             /* RFU */
    buf[n++] = 0x0B;             /* Default (102.4 ms) */
    buf[n++] = 0x0A;             /* Default is 0x0A (51.2 ms) */
-   if (pn532_tx (s, 0x32, 0, NULL, n, buf, "RFConfiguration") < 0 || pn532_rx (s, 0, NULL, sizeof (buf), buf, 50) < 0)
+   if (pn532_tx (p, 0x32, 0, NULL, n, buf, "RFConfiguration") < 0 || pn532_rx (p, 0, NULL, sizeof (buf), buf, 50) < 0)
       return "RFConfiguration fail";
+   p->rftimeout = 0x0A;
+   if (baud && baud != p->baud)
+   {                            /* Not fatal, we carry on at the rate we have, p->baud says which */
+      const char *e = pn532_baud (p, baud);
+      if (e && p->debug)
+         fprintf (p->debug, "[31m%u baud: %s[0m\n", baud, e);
+   }
    return NULL;
 }
 
+const char *
+pn532_line_test (pn532_t * p, int n)
+{                               /* Diagnose communication line test, n maximum size echoes */
+   unsigned char tx[241],
+     rx[241];
+   tx[0] = 0x00;                /* NumTst 0, communication line test */
+   while (n-- > 0)
+   {
+      for (int i = 1; i < sizeof (tx); i++)
+         tx[i] = n + i * 0x55;  /* Alternating bits, different each time */
+      int l = pn532_tx (p, 0x00, 0, NULL, sizeof (tx), tx, "Line Test");
+      p->rtt = NULL;            /* Not like other Diagnose tests */
+      if (l >= 0)
+         l = pn532_rx (p, 0, NULL, sizeof (rx), rx, 50);
+      if (l < 0)
+         return "Line test failed";
+      if (l != sizeof (rx) || memcmp (tx, rx, sizeof (rx)))
+         return "Line test mismatch";
+   }
+   return NULL;
+}
+
+const char *
+pn532_baud (pn532_t * p, unsigned int baud)
+{                               /* Change baud rate, checks link, returns to old rate if not working */
+   static const unsigned int rates[] = { 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600, 1288000 };
+   unsigned char br = 0;
+   while (br < sizeof (rates) / sizeof (*rates) && rates[br] != baud)
+      br++;
+   if (br == sizeof (rates) / sizeof (*rates))
+      return "Baud rate not supported by PN532";
+   if (baud == p->baud)
+      return NULL;
+   struct termios t;
+   if (tcgetattr (p->s, &t) || cfsetspeed (&t, baud))
+      return "Baud rate not supported by serial port";  /* Check before we switch the PN532 */
+   unsigned int old = p->baud;
+   unsigned char oldbr = 0;
+   while (oldbr < sizeof (rates) / sizeof (*rates) && rates[oldbr] != old)
+      oldbr++;
+   static const unsigned char ack[] = { 0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00 };
+   unsigned char buf[1];
+   /* SetSerialBaudRate, the PN532 changes once it gets our ACK to its response */
+   if (pn532_tx (p, 0x10, 1, &br, 0, NULL, "SetSerialBaudRate") < 0 || pn532_rx (p, 0, NULL, sizeof (buf), buf, 50) < 0)
+      return "SetSerialBaudRate failed";
+   uart_tx (p, ack, sizeof (ack));
+   tcdrain (p->s);
+   usleep (1000);               /* At least 200us before using new rate */
+   const char *e = uart_speed (p, baud);
+   if (!e && !(e = pn532_line_test (p, 3)))
+      return NULL;
+   /* Not working, try to put it back */
+   if (oldbr < sizeof (rates) / sizeof (*rates) && pn532_tx (p, 0x10, 1, &oldbr, 0, NULL, "SetSerialBaudRate") >= 0
+       && pn532_rx (p, 0, NULL, sizeof (buf), buf, 50) >= 0)
+   {
+      uart_tx (p, ack, sizeof (ack));
+      tcdrain (p->s);
+      usleep (1000);
+   }
+   if (uart_speed (p, old) || pn532_line_test (p, 1))
+      return "Baud rate change failed, reader lost";
+   return e;
+}
+
 int
-pn532_read_GPIO (int s)
+pn532_read_GPIO (pn532_t * p)
 {                               /* Read P3/P7 (P72/P71 in top bits, P35-30 in rest) */
    unsigned char buf[3];
-   int l = pn532_tx (s, 0x0C, 0, NULL, 0, NULL, "Read GPIO");
+   int l = pn532_tx (p, 0x0C, 0, NULL, 0, NULL, "Read GPIO");
    if (l >= 0)
-      l = pn532_rx (s, 0, NULL, sizeof (buf), buf, 50);
+      l = pn532_rx (p, 0, NULL, sizeof (buf), buf, 50);
    if (l < 0)
       return l;
    if (l < 3)
@@ -460,48 +829,394 @@ pn532_read_GPIO (int s)
 }
 
 int
-pn532_write_GPIO (int s, unsigned char value)
+pn532_write_GPIO (pn532_t * p, unsigned char value)
 {                               /* Write P3/P7 (P72/P71 in top bits, P35-30 in rest) */
    unsigned char buf[2];
    buf[0] = 0x80 | (value & 0x3F);
    buf[1] = 0x80 | ((value >> 5) & 0x06);
-   int l = pn532_tx (s, 0x0E, 2, buf, 0, NULL, "Write GPIO");
+   int l = pn532_tx (p, 0x0E, 2, buf, 0, NULL, "Write GPIO");
    if (l >= 0)
-      l = pn532_rx (s, 0, NULL, sizeof (buf), buf, 50);
+      l = pn532_rx (p, 0, NULL, sizeof (buf), buf, 50);
    return l;
 }
 
 
-/* Data exchange(for DESFire use) */
+/* Frame building and parsing, for use without blocking (e.g. from an event loop) */
 int
-pn532_dx (void *pv, unsigned int len, unsigned char *data, unsigned int max, const char **strerr)
-{                               /* Card access function - sends to card starting CMD byte, and receives reply in to same buffer,
-                                 * starting status byte, returns len */
-   if (!pv)
+pn532_frame (unsigned char *buf, unsigned int max, unsigned char cmd, int len1, const unsigned char *data1, int len2,
+             const unsigned char *data2)
+{                               /* Make a complete command frame in buf, returns length, or -1 if no space */
+   int l = len1 + len2 + 2;
+   if (l > 0xFFFF || (unsigned int) l + 13 > max)
       return -1;
-   int s = *((int *) pv);
-   unsigned char tg = 1;
-   int l = pn532_tx (s, 0x40, 1, &tg, len, data, *strerr);
-   if (l >= 0)
+   unsigned char *b = buf;
+   *b++ = 0x55;
+   *b++ = 0x55;
+   *b++ = 0x55;
+   *b++ = 0x00;                 /* Preamble */
+   *b++ = 0x00;                 /* Start 1 */
+   *b++ = 0xFF;                 /* Start 2 */
+   if (l >= 0x100)
    {
-      unsigned char status;
-      l = pn532_rx (s, 1, &status, max, data, 500);
-      if (!l)
+      *b++ = 0xFF;              /* Extended len */
+      *b++ = 0xFF;
+      *b++ = (l >> 8);          /* len */
+      *b++ = (l & 0xFF);
+      *b++ = -(l >> 8) - (l & 0xFF);    /* Checksum */
+   } else
+   {
+      *b++ = l;                 /* Len */
+      *b++ = -l;                /* Checksum */
+   }
+   *b++ = 0xD4;                 /* Direction (host to PN532) */
+   *b++ = cmd;
+   unsigned char sum = 0xD4 + cmd;
+   for (l = 0; l < len1; l++)
+      sum += (*b++ = data1[l]);
+   for (l = 0; l < len2; l++)
+      sum += (*b++ = data2[l]);
+   *b++ = -sum;                 /* Checksum */
+   *b++ = 0x00;                 /* Postamble */
+   return b - buf;
+}
+
+int
+pn532_parse (const unsigned char *buf, int len, unsigned char *cmd, const unsigned char **data, int *dlen)
+{                               /* Look for a response frame (or ACK) in received bytes.
+                                 * Returns 0 if more bytes needed, +ve bytes used for complete frame, -ve bytes to discard as bad.
+                                 * Sets cmd to response command (0 for ACK), and data/dlen for the payload after the command */
+   int p = 0;
+   while (p + 1 < len && (buf[p] || buf[p + 1] != 0xFF))
+      p++;                      /* Find start */
+   if (p + 1 >= len)
+      return p ? -p : 0;        /* Junk before start */
+   p += 2;
+   if (p + 2 > len)
+      return 0;
+   if (!buf[p] && buf[p + 1] == 0xFF)
+   {                            /* ACK */
+      if (p + 3 > len)
+         return 0;
+      if (buf[p + 2])
+         return -(p + 3);
+      if (cmd)
+         *cmd = 0;
+      if (dlen)
+         *dlen = 0;
+      return p + 3;
+   }
+   int l;
+   if (buf[p] == 0xFF && buf[p + 1] == 0xFF)
+   {                            /* Extended */
+      if (p + 5 > len)
+         return 0;
+      if ((unsigned char) (buf[p + 2] + buf[p + 3] + buf[p + 4]))
+         return -(p + 5);
+      l = (buf[p + 2] << 8) + buf[p + 3];
+      p += 5;
+   } else
+   {                            /* Normal (includes NAK, which fails checksum) */
+      if ((unsigned char) (buf[p] + buf[p + 1]))
+         return -p;
+      l = buf[p];
+      p += 2;
+   }
+   if (l < 2)
+      return -p;
+   if (p + l + 2 > len)
+      return 0;
+   if (buf[p] != 0xD5)
+      return -(p + l + 2);
+   unsigned char sum = 0;
+   for (int i = 0; i <= l; i++)
+      sum += buf[p + i];
+   if (sum || buf[p + l + 1])
+      return -(p + l + 2);      /* Bad checksum or postamble */
+   if (cmd)
+      *cmd = buf[p + 1];
+   if (data)
+      *data = buf + p + 2;
+   if (dlen)
+      *dlen = l - 2;
+   return p + l + 2;
+}
+
+int
+pn532_targets_parse (const unsigned char *buf, int l, int max, pn532_tg_t * tg)
+{                               /* Parse InListPassiveTarget response in to up to max targets - -ve for error, else number of targets */
+   const unsigned char *b = buf,
+      *e = buf + l;             /* end */
+   if (b >= e)
+      return -1;
+   unsigned char cards = *b++;
+   for (int n = 0; n < cards; n++)
+   {
+      pn532_tg_t *t = (n < max ? tg + n : NULL);
+      if (b + 5 > e)
+         return -1;
+      if (t)
+      {
+         memset (t->nfcid, 0, MAXNFCID);
+         memset (t->ats, 0, MAXATS);
+         t->tg = *b;
+      }
+      b++;
+      b += 2;                   /* SENS_RES */
+      unsigned char sel_res = *b++;
+      if (b + *b + 1 > e)
+         return -1;
+      if (t && *b < MAXNFCID)
+         memcpy (t->nfcid, b, *b + 1);  /* OK (else too big, left zero) */
+      b += *b + 1;
+      if (b < e && (sel_res & 0x20 || cards == 1))
+      {                         /* ATS */
+         if (!*b || b + *b > e)
+            return -1;
+         if (t)
+            memcpy (t->ats, b, *b);     /* TL is one byte, so always fits (MAXATS is 255) */
+         b += *b;
+      }
+   }
+   return cards;
+}
+
+int
+pn532_cards_parse (const unsigned char *buf, int l, unsigned char nfcid[MAXNFCID], unsigned char ats[MAXATS])
+{                               /* Parse InListPassiveTarget response - -ve for error, else number of cards, details of first */
+   pn532_tg_t t = { };
+   int cards = pn532_targets_parse (buf, l, 1, &t);
+   if (nfcid)
+      memcpy (nfcid, t.nfcid, MAXNFCID);
+   if (ats)
+      memcpy (ats, t.ats, MAXATS);
+   return cards;
+}
+
+int
+pn532_autopoll_parse (const unsigned char *buf, int l, unsigned char nfcid[MAXNFCID], unsigned char ats[MAXATS])
+{                               /* Parse InAutoPoll response - -ve for error, else number of type A cards, details of first */
+   if (l < 1)
+      return -1;
+   if (nfcid)
+      memset (nfcid, 0, MAXNFCID);
+   if (ats)
+      memset (ats, 0, MAXATS);
+   int cards = *buf,
+      found = 0;
+   const unsigned char *b = buf + 1,
+      *e = buf + l;
+   for (int n = 0; n < cards; n++)
+   {                            /* Type, length, then target data as InListPassiveTarget for that type */
+      if (b + 2 > e || b + 2 + b[1] > e)
+         return -1;
+      if ((b[0] == 0x00 || b[0] == 0x10 || b[0] == 0x20) && !found++)
+      {                         /* Generic 106kbps type A, MIFARE, or ISO/IEC14443-4A, as a one target InListPassiveTarget response */
+         unsigned char one[256];
+         one[0] = 1;
+         memcpy (one + 1, b + 2, b[1]);
+         if (pn532_cards_parse (one, b[1] + 1, nfcid, ats) < 0)
+            return -1;
+      }
+      b += 2 + b[1];
+   }
+   return found;
+}
+
+/* Data exchange(for DESFire use) */
+static unsigned char
+rf_fwt (const unsigned char ats[MAXATS])
+{                               /* PN532 RF timeout (100us*2^(n-1)) to cover the card's frame waiting time, from ATS TB(1) FWI */
+   unsigned char fwi = 4;       /* Default if no TB(1) */
+   int ta = (ats && *ats >= 2 && (ats[1] & 0x10)) ? 1 : 0;
+   if (ats && *ats >= 3 + ta && (ats[1] & 0x20))
+      fwi = (ats[2 + ta] >> 4);
+   if (fwi > 14)
+      fwi = 4;                  /* RFU */
+   unsigned int fwt = (302U << fwi);    /* 256*16/fc us, 77ms for DESFire EV1 (FWI 8) */
+   unsigned char n = 1;
+   while (n < 0x10 && (100U << (n - 1)) < fwt)
+      n++;
+   return n;
+}
+
+static void
+rf_timeout (pn532_t * p, unsigned char n)
+{                               /* Set PN532 RF timeout (100us*2^(n-1)), learned response times only set the host side deadline */
+   if (n == p->rftimeout)
+      return;
+   unsigned char buf[4];
+   buf[0] = 0x02;               /* Various timings (100*2^(n-1))us */
+   buf[1] = 0x00;               /* RFU */
+   buf[2] = 0x0B;               /* Default (102.4 ms) */
+   buf[3] = n;                  /* Communication with target */
+   if (pn532_tx (p, 0x32, 0, NULL, sizeof (buf), buf, "RFConfiguration") >= 0 && pn532_rx (p, 0, NULL, sizeof (buf), buf, 50) >= 0)
+      p->rftimeout = n;
+}
+
+static int
+rf_error (unsigned char status)
+{                               /* InDataExchange status is a transmission error, more likely at higher bit rates */
+   status &= 0x3F;
+   return status == 0x02 || status == 0x03 || status == 0x05 || status == 0x0B;        /* CRC, parity, framing, RF protocol */
+}
+
+static int
+tg_dx (pn532_t * p, unsigned char target, unsigned int kbps, unsigned int len, unsigned char *data, unsigned int max,
+       const char **strerr)
+{                               /* InDataExchange with target, at kbps (as negotiated by InPSL) */
+   unsigned char tg = (target | 0x40);  /* MI (more to follow) */
+   unsigned char status = 0;
+   unsigned char *tx = data;
+   int l = 0;
+   if (len && *data != 0xAF)
+      p->dxcmd = *data;         /* DESFire command, AF continuation frames are timed with the command they continue */
+   unsigned char cmd = (len ? p->dxcmd : 0);
+   while (len > PN532_DXMAX && l >= 0)
+   {                            /* Too big for one InDataExchange */
+      l = pn532_tx (p, 0x40, 1, &tg, PN532_DXMAX, tx, *strerr);
+      if (l >= 0)
+         l = pn532_rx (p, 1, &status, 0, NULL, 500);
+      if (l >= 0 && (status & 0x3F))
          l = -1;
-      else if (l >= 1 && status)
+      tx += PN532_DXMAX;
+      len -= PN532_DXMAX;
+   }
+   tg = target;
+   int res = 0;
+   if (l >= 0)
+      l = pn532_tx (p, 0x40, 1, &tg, len, tx, *strerr);
+   pn532_rtt_t *r = NULL,
+      was = { };
+   if (l >= 0 && len)
+   {                            /* Card response time depends on the DESFire command */
+      p->rtt = r = &p->dx[cmd];
+      was = *r;
+   }
+   while (l >= 0)
+   {
+      l = pn532_rx (p, 1, &status, max - res, data + res, 500);
+      if (!l || (status & 0x3F))
+      {
+         if (r && !p->timeout)
+            *r = was;           /* PN532 timed out the card, not a response time (keep the back off if we timed out) */
          l = -1;
+         if (kbps > 106 && p->maxkbps >= kbps && rf_error (status))
+         {                      /* Link not good at this rate, lower for next activation (PPS is only allowed after ATS) */
+            p->maxkbps = kbps / 2;
+            if (p->debug)
+               fprintf (p->debug, "RF error %02X at %ukbps, max now %ukbps\n", status & 0x3F, kbps, p->maxkbps);
+         }
+      }
+      r = NULL;
+      if (l < 0)
+         break;
+      res += l - 1;
+      if (!(status & 0x40))
+         break;
+      if (res >= max)
+         l = -1;                /* MI set, target has more, but no space */
+      else
+         l = pn532_tx (p, 0x40, 1, &tg, 0, NULL, "More");
    }
    if (l < 0)
    {
       if (strerr)
          *strerr = "Failed";
-   } else
-      l--;                      /* Allow for status */
-   return l;
+      return -1;
+   }
+   return res;
+}
+
+int
+pn532_dx (void *pv, unsigned int len, unsigned char *data, unsigned int max, const char **strerr)
+{                               /* Card access function - sends to card starting CMD byte, and receives reply in to same buffer,
+                                 * starting status byte, returns len */
+   if (!pv)
+      return -1;
+   return tg_dx (pv, 1, ((pn532_t *) pv)->kbps, len, data, max, strerr);
+}
+
+int
+pn532_tg_dx (void *pv, unsigned int len, unsigned char *data, unsigned int max, const char **strerr)
+{                               /* As pn532_dx for a specific target */
+   pn532_tg_t *t = pv;
+   if (!t || !t->p)
+      return -1;
+   return tg_dx (t->p, t->tg, t->kbps, len, data, max, strerr);
+}
+
+unsigned int
+pn532_txmax (const unsigned char ats[MAXATS])
+{                               /* Command frame size for df_t txmax, from the card's FSC in the ATS */
+   static const unsigned short fsc[] = { 16, 24, 32, 40, 48, 64, 96, 128, 256 };
+   if (!ats || *ats < 2)
+      return 0;                 /* No T0, so default */
+   unsigned char fsci = (ats[1] & 0x0F);
+   unsigned int max = fsc[fsci < 8 ? fsci : 8] - 9;      /* As DF_TXMAX is for 64 */
+   return max < PN532_DXMAX ? max : PN532_DXMAX;
 }
 
 int
-pn532_Cards (int s, unsigned char nfcid[MAXNFCID], unsigned char ats[MAXATS])
+pn532_PSL (pn532_t * p, unsigned char tg, const unsigned char ats[MAXATS], unsigned int max)
+{                               /* Set the fastest bit rates the card allows in its ATS TA(1), up to max kbps, trying lower rates if refused.
+                                 * Only valid straight after activation. Returns the slower of the two directions in kbps, -ve for error */
+   static const unsigned short kbps[] = { 106, 212, 424, 848 };
+   if (!ats || *ats < 3 || !(ats[1] & 0x10))
+      return 106;               /* No TA(1), 106kbps only */
+   unsigned char ta = ats[2];
+   int dr = 3,                  /* PCD to PICC (BRit) */
+      ds = 3;                   /* PICC to PCD (BRti) */
+   while (1)
+   {
+      while (dr && (kbps[dr] > max || !(ta & (0x01 << (dr - 1)))))
+         dr--;
+      while (ds && (kbps[ds] > max || !(ta & (0x10 << (ds - 1)))))
+         ds--;
+      if ((ta & 0x80) && dr != ds)
+      {                         /* Same rate both ways */
+         if (dr > ds)
+            dr--;
+         else
+            ds--;
+         continue;
+      }
+      if (!dr && !ds)
+         return 106;
+      unsigned char buf[3];
+      buf[0] = tg;
+      buf[1] = dr;
+      buf[2] = ds;
+      int l = pn532_tx (p, 0x4E, 3, buf, 0, NULL, "InPSL");
+      if (l >= 0)
+         l = pn532_rx (p, 0, NULL, sizeof (buf), buf, 110);
+      if (l < 0)
+         return l;
+      if (l >= 1 && !(buf[0] & 0x3F))
+         return kbps[dr < ds ? dr : ds];
+      if (dr)                   /* Refused, try slower */
+         dr--;
+      if (ds)
+         ds--;
+   }
+}
+
+static int
+psl (pn532_t * p, int cards, const unsigned char ats[MAXATS])
+{                               /* After target 1 activated, set bit rate if wanted, returns cards or -ve for error */
+   p->kbps = 106;
+   if (cards > 0 && ats && p->adaptive)
+      rf_timeout (p, rf_fwt (ats));
+   if (cards <= 0 || !ats || p->maxkbps <= 106)
+      return cards;             /* No ATS wanted is just a presence check */
+   int k = pn532_PSL (p, 1, ats, p->maxkbps);
+   if (k < 0)
+      return k;
+   p->kbps = k;
+   return cards;
+}
+
+int
+pn532_Cards (pn532_t * p, unsigned char nfcid[MAXNFCID], unsigned char ats[MAXATS])
 {                               /* -ve for error, else number of cards */
    unsigned char buf[100];
    /* InListPassiveTarget to get card count and baseID */
@@ -509,63 +1224,90 @@ pn532_Cards (int s, unsigned char nfcid[MAXNFCID], unsigned char ats[MAXATS])
    //2 tags(we only report 1)
    buf[1] = 0;
    //106 kbps type A(ISO / IEC14443 Type A)
-   int l = pn532_tx (s, 0x4A, 2, buf, 0, NULL, "InListPassiveTarget");
+   int l = pn532_tx (p, 0x4A, 2, buf, 0, NULL, "InListPassiveTarget");
    if (l < 0)
       return l;
-   l = pn532_rx (s, 0, NULL, sizeof (buf), buf, 110);
+   l = pn532_rx (p, 0, NULL, sizeof (buf), buf, 110);
    if (l < 0)
       return l;
-   if (!ats)
-      ats = alloca (MAXATS);
-   if (!nfcid)
-      nfcid = alloca (MAXNFCID);
-   memset (nfcid, 0, MAXNFCID);
-   memset (ats, 0, MAXATS);
-   /* Extract first card ID */
-   unsigned char *b = buf,
-      *e = buf + l;             /* end */
-   if (b >= e)
-      return -1;
-   unsigned char cards = *b++;
-   if (cards)
-   {                            /* Get details of first card */
-      if (b + 5 > e)
-         return -1;
-      unsigned char tg = *b++;
-      unsigned char sens_res = (b[0] << 8) + b[1];
-      b += 2;
-      unsigned char sel_res = *b++;
-      if (b + *b + 1 > e)
-         return -1;
-      if (*b < MAXNFCID)
-         memcpy (nfcid, b, *b + 1);     /* OK */
-      else
-         memset (nfcid, 0, MAXNFCID);   /* Too big */
-      b += *b + 1;
-      if (b < e)
-      {                         /* ATS */
-         if (!*b || b + *b > e)
-            return -1;
-         if (*b <= MAXATS)
-         {
-            memcpy (ats, b, *b);        /* OK */
-            (ats)--;            /* Make len of what follows for consistency */
-         }
-         b += *b;               /* ready for second target (which we are not looking at) */
+   return psl (p, pn532_cards_parse (buf, l, nfcid, ats), ats);
+}
+
+int
+pn532_targets (pn532_t * p, int max, pn532_tg_t * tg)
+{                               /* -ve for error, else number of targets, all activated, up to max set in tg, for use with pn532_tg_dx */
+   unsigned char buf[300];
+   buf[0] = 2;                  /* 2 tags, the most the PN532 can handle */
+   buf[1] = 0;                  /* 106 kbps type A(ISO / IEC14443 Type A) */
+   int l = pn532_tx (p, 0x4A, 2, buf, 0, NULL, "InListPassiveTarget");
+   if (l < 0)
+      return l;
+   l = pn532_rx (p, 0, NULL, sizeof (buf), buf, 110);
+   if (l < 0)
+      return l;
+   l = pn532_targets_parse (buf, l, max, tg);
+   for (int n = 0; n < l && n < max; n++)
+   {
+      tg[n].p = p;
+      tg[n].kbps = 106;
+      if (p->maxkbps > 106)
+      {
+         int k = pn532_PSL (p, tg[n].tg, tg[n].ats, p->maxkbps);
+         if (k < 0)
+            return k;
+         tg[n].kbps = k;
       }
    }
-   return cards;
+   if (l > 0 && p->adaptive)
+   {                            /* RF timeout is for the reader, so to suit the slowest target */
+      unsigned char t = 0;
+      for (int n = 0; n < l && n < max; n++)
+         if (rf_fwt (tg[n].ats) > t)
+            t = rf_fwt (tg[n].ats);
+      if (t)
+         rf_timeout (p, t);
+   }
+   return l;
+}
+
+int
+pn532_AutoPoll (pn532_t * p, unsigned char period, int types, const unsigned char *type, unsigned char nfcid[MAXNFCID],
+                unsigned char ats[MAXATS], int ms)
+{                               /* -ve for error, 0 if nothing by ms, else number of cards, first is activated as for pn532_Cards.
+                                 * The PN532 polls every period*150ms for the types (default generic 106kbps type A), while we wait in poll() */
+   static const unsigned char generic = 0x00;
+   if (!types || !type)
+   {
+      types = 1;
+      type = &generic;
+   }
+   if (types > 15)
+      return -1;
+   unsigned char buf[300];
+   buf[0] = 0xFF;               /* Poll until something found */
+   buf[1] = (period ? : 1);     /* Period in 150ms units */
+   int l = pn532_tx (p, 0x60, 2, buf, types, (unsigned char *) type, "InAutoPoll");
+   if (l < 0)
+      return l;
+   p->rtt = NULL;               /* Waiting for a card, not the reader */
+   l = pn532_rx (p, 0, NULL, sizeof (buf), buf, ms);
+   if (l < 0)
+   {
+      pn532_abort (p);
+      return p->timeout ? 0 : l;        /* Nothing found, or a bad response */
+   }
+   return psl (p, pn532_autopoll_parse (buf, l, nfcid, ats), ats);
 }
 
 int
-pn532_Present (int s)
+pn532_Present (pn532_t * p)
 {
    uint8_t buf[1];
    {                            /* We have cards, check in field still */
       buf[0] = 6;               /* Test 6 Attention Request Test or ISO/IEC14443-4 card presence detection */
-      int l = pn532_tx (s, 0x00, 1, buf, 0, NULL, "Attention Request Test");
+      int l = pn532_tx (p, 0x00, 1, buf, 0, NULL, "Attention Request Test");
       if (l >= 0)
-         l = pn532_rx (s, 0, NULL, sizeof (buf), buf, 110);
+         l = pn532_rx (p, 0, NULL, sizeof (buf), buf, 110);
       if (l < 0)
          return l;
       if (l < 1)
@@ -573,5 +1315,5 @@ pn532_Present (int s)
       if (!*buf)
          return 1;
    }
-   return pn532_Cards (s, NULL, NULL);  /* Look for card - older MIFARE need re-doing to see if present still */
+   return pn532_Cards (p, NULL, NULL);  /* Look for card - older MIFARE need re-doing to see if present still */
 }
@@ -1,10 +1,81 @@
 /* PN532 tools */
 
-const char *pn532_init(int s,unsigned char outputs);
-int pn532_read_GPIO(int s);
-int pn532_write_GPIO(int s, unsigned char value);
-int pn532_dx(void *pv, unsigned int len, unsigned char *data, unsigned int max, const char **strerr);
+#include <stdio.h>
+
+/* Response time for a command, for adaptive timeouts */
+typedef struct pn532_rtt_s pn532_rtt_t;
+struct pn532_rtt_s {
+   unsigned int srtt;           /* Smoothed response time (us) */
+   unsigned int rttvar;         /* Smoothed variation (us) */
+   unsigned int count;          /* Samples */
+};
+
+/* Binary capture of serial traffic in a lock free ring, written by the reader's thread, flushed as pcap by another */
+typedef struct pn532_cap_s pn532_cap_t;
+#define	PN532_CAP_LINKTYPE	147	/* LINKTYPE_USER0, record is direction, reader ID, then raw bytes */
+#define	PN532_CAP_TX		0	/* Host to PN532 */
+#define	PN532_CAP_RX		1	/* PN532 to host */
+
+/* Per reader context, all state for a reader is here so readers can be used from separate threads */
+typedef struct pn532_s pn532_t;
+struct pn532_s {
+   int s;                       /* Serial port */
+   FILE *debug;                 /* Debug output, NULL for none */
+   unsigned int rxin;           /* Receive ring, bytes read in (free running) */
+   unsigned int rxout;          /* Receive ring, bytes taken out (free running) */
+   unsigned char rx[512];       /* Receive ring, size must be power of 2 */
+   unsigned int baud;           /* Serial baud rate, set before pn532_init to ask for a higher rate, actual rate after */
+   unsigned char adaptive;      /* Use learned response times for host timeouts, and set PN532 RF timeout to the card FWT */
+   unsigned char rftimeout;     /* Current PN532 RF timeout for target (100us*2^(n-1)), from the card's FWT if p->adaptive */
+   unsigned char dxcmd;         /* DESFire command in progress, for timing its AF continuation frames */
+   long long t0;                /* When command sent, or ACK received (us) */
+   unsigned char timeout;       /* Last pn532_rx failed as nothing came (preamble timeout), not a bad frame */
+   pn532_rtt_t *rtt;            /* Where to record response time for command in progress */
+   pn532_rtt_t ack;             /* ACK time, after frame sent */
+   pn532_rtt_t cmd[128];        /* Response times by PN532 command */
+   pn532_rtt_t dx[256];         /* InDataExchange response times by DESFire command */
+   pn532_cap_t *cap;            /* Capture, NULL for none */
+   unsigned int maxkbps;        /* Fastest RF bit rate to set (InPSL) after activation, 0 for 106kbps only, lowered on RF errors */
+   unsigned int kbps;           /* RF bit rate for target 1 (slower direction) */
+};
+
+/* A target (card) on a reader, the PN532 can have two active at once, use as df_t obj with pn532_tg_dx */
+typedef struct pn532_tg_s pn532_tg_t;
 #define	MAXNFCID	11
 #define	MAXATS		255
-int pn532_Cards(int s, unsigned char nfcid[MAXNFCID], unsigned char ats[MAXATS]);
-int pn532_Present(int s);
+struct pn532_tg_s {
+   pn532_t *p;                  /* Reader */
+   unsigned char tg;            /* Target number (1 or 2) */
+   unsigned char nfcid[MAXNFCID];       /* Len then NFCID */
+   unsigned char ats[MAXATS];   /* ATS (starting TL) */
+   unsigned int kbps;           /* RF bit rate (slower direction) */
+};
+
+const char *pn532_tty(int s);	/* Set up serial port (raw, 115200, low latency), errno set on error */
+const char *pn532_init(pn532_t * p, int s, unsigned char outputs);
+const char *pn532_baud(pn532_t * p, unsigned int baud);	/* SetSerialBaudRate and line test, falls back to old rate if not working */
+const char *pn532_line_test(pn532_t * p, int n);	/* n full size echoes to check the serial link */
+int pn532_read_GPIO(pn532_t * p);
+int pn532_write_GPIO(pn532_t * p, unsigned char value);
+#define	PN532_DXMAX	262	/* Max InDataExchange data, longer is sent with MI (more information) chaining */
+int pn532_dx(void *pv, unsigned int len, unsigned char *data, unsigned int max, const char **strerr);	/* pv is pn532_t */
+int pn532_tg_dx(void *pv, unsigned int len, unsigned char *data, unsigned int max, const char **strerr);	/* pv is pn532_tg_t */
+int pn532_Cards(pn532_t * p, unsigned char nfcid[MAXNFCID], unsigned char ats[MAXATS]);	/* Sets bit rate (p->maxkbps) if ats wanted */
+int pn532_Present(pn532_t * p);
+int pn532_targets(pn532_t * p, int max, pn532_tg_t * tg);	/* All targets found (up to 2), first max stored */
+int pn532_AutoPoll(pn532_t * p, unsigned char period, int types, const unsigned char *type, unsigned char nfcid[MAXNFCID], unsigned char ats[MAXATS], int ms);	/* InAutoPoll, waits up to ms for a card, 0 if none */
+unsigned int pn532_txmax(const unsigned char ats[MAXATS]);	/* df_t txmax for card, 0 if ATS does not say */
+int pn532_PSL(pn532_t * p, unsigned char tg, const unsigned char ats[MAXATS], unsigned int max);	/* Fastest bit rate card allows up to max kbps, just after activation, returns kbps */
+
+pn532_cap_t *pn532_cap_new(unsigned int size, unsigned char id);	/* Ring of at least size bytes, id to tell readers apart */
+void pn532_cap_free(pn532_cap_t *);
+int pn532_cap_header(FILE *);	/* Write pcap file header */
+int pn532_cap_flush(pn532_cap_t *, FILE *);	/* Write captured records to pcap file, returns records, -ve for error */
+unsigned int pn532_cap_dropped(pn532_cap_t *);	/* Records lost as ring full */
+
+/* Frame building and parsing without doing any I/O (see pn532.c) */
+int pn532_frame(unsigned char *buf, unsigned int max, unsigned char cmd, int len1, const unsigned char *data1, int len2, const unsigned char *data2);
+int pn532_parse(const unsigned char *buf, int len, unsigned char *cmd, const unsigned char **data, int *dlen);
+int pn532_targets_parse(const unsigned char *buf, int len, int max, pn532_tg_t * tg);
+int pn532_cards_parse(const unsigned char *buf, int len, unsigned char nfcid[MAXNFCID], unsigned char ats[MAXATS]);
+int pn532_autopoll_parse(const unsigned char *buf, int len, unsigned char nfcid[MAXNFCID], unsigned char ats[MAXATS]);	/* InAutoPoll response, type A targets only */
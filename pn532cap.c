@@ -0,0 +1,261 @@
+/* Decode PN532 serial capture files (nfc/nfcissue --capture) */
+/* (c) Copyright 2022 Andrews & Arnold Ltd, Adrian Kennard */
+/*
+ * This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The capture is pcap (nanosecond timestamps, LINKTYPE_USER0), each record is direction (0 host to PN532, 1 PN532 to host),
+ * reader ID, then the bytes as written to or read from the serial port, so frames can span records.
+ * Each line is time, reader, direction, and the frame, with PN532 command names, and for InDataExchange the DESFire
+ * command or status (via df_err).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <popt.h>
+#include <time.h>
+#include <err.h>
+#include <openssl/evp.h>
+#include "desfireaes.h"
+#include "pn532.h"
+
+static const struct
+{
+   unsigned char cmd;
+   const char *name;
+} cmds[] = {
+   {0x00, "Diagnose"},
+   {0x02, "GetFirmwareVersion"},
+   {0x04, "GetGeneralStatus"},
+   {0x06, "ReadRegister"},
+   {0x08, "WriteRegister"},
+   {0x0C, "ReadGPIO"},
+   {0x0E, "WriteGPIO"},
+   {0x10, "SetSerialBaudRate"},
+   {0x12, "SetParameters"},
+   {0x14, "SAMConfiguration"},
+   {0x16, "PowerDown"},
+   {0x32, "RFConfiguration"},
+   {0x58, "RFRegulationTest"},
+   {0x56, "InJumpForDEP"},
+   {0x46, "InJumpForPSL"},
+   {0x4A, "InListPassiveTarget"},
+   {0x50, "InATR"},
+   {0x4E, "InPSL"},
+   {0x40, "InDataExchange"},
+   {0x42, "InCommunicateThru"},
+   {0x44, "InDeselect"},
+   {0x52, "InRelease"},
+   {0x54, "InSelect"},
+   {0x60, "InAutoPoll"},
+   {0x8C, "TgInitAsTarget"},
+};
+
+static const char *
+cmd_name (unsigned char cmd)
+{
+   for (unsigned int n = 0; n < sizeof (cmds) / sizeof (*cmds); n++)
+      if (cmds[n].cmd == cmd)
+         return cmds[n].name;
+   return NULL;
+}
+
+static int
+frame (const unsigned char *buf, int len, int *tfi, const unsigned char **data, int *dlen)
+{                               /* As pn532_parse, but for either direction, tfi -1 for ACK, -2 for NAK */
+   int p = 0;
+   while (p + 1 < len && (buf[p] || buf[p + 1] != 0xFF))
+      p++;                      /* Find start (skips preamble and wake up bytes) */
+   if (p + 1 >= len)
+      return p ? -p : 0;
+   p += 2;
+   if (p + 2 > len)
+      return 0;
+   if ((!buf[p] && buf[p + 1] == 0xFF) || (buf[p] == 0xFF && !buf[p + 1]))
+   {                            /* ACK or NAK */
+      if (p + 3 > len)
+         return 0;
+      *tfi = (buf[p] ? -2 : -1);
+      return p + 3;
+   }
+   int l;
+   if (buf[p] == 0xFF && buf[p + 1] == 0xFF)
+   {                            /* Extended */
+      if (p + 5 > len)
+         return 0;
+      if ((unsigned char) (buf[p + 2] + buf[p + 3] + buf[p + 4]))
+         return -(p + 5);
+      l = (buf[p + 2] << 8) + buf[p + 3];
+      p += 5;
+   } else
+   {
+      if ((unsigned char) (buf[p] + buf[p + 1]))
+         return -p;
+      l = buf[p];
+      p += 2;
+   }
+   if (l < 2)
+      return -p;
+   if (p + l + 2 > len)
+      return 0;
+   unsigned char sum = 0;
+   for (int i = 0; i <= l; i++)
+      sum += buf[p + i];
+   if (sum || (buf[p] != 0xD4 && buf[p] != 0xD5))
+      return -(p + l + 2);
+   *tfi = buf[p];
+   *data = buf + p + 1;
+   *dlen = l - 1;
+   return p + l + 2;
+}
+
+typedef struct stream_s stream_t;
+struct stream_s
+{                               /* Bytes not yet decoded for a reader and direction */
+   unsigned char buf[1024];
+   int len;
+   unsigned char cmd;           /* Last command from host, so the response can be decoded */
+};
+stream_t stream[256][2];
+
+int hex = 0;
+int nodx = 0;
+
+static void
+show (uint32_t sec, uint32_t nsec, unsigned char id, unsigned char dir, int tfi, const unsigned char *d, int l)
+{                               /* One frame */
+   stream_t *h = &stream[id][0];     /* Host side has the last command */
+   time_t t = sec;
+   struct tm tm;
+   localtime_r (&t, &tm);
+   printf ("%02d:%02d:%02d.%06u %3u %s ", tm.tm_hour, tm.tm_min, tm.tm_sec, nsec / 1000, id, dir ? "<" : ">");
+   if (tfi == -1)
+      printf ("ACK");
+   else if (tfi == -2)
+      printf ("NAK");
+   else if (l < 1)
+      printf ("Empty");
+   else if ((tfi == 0xD4) != !dir)
+      printf ("Frame %02X in wrong direction", tfi);
+   else
+   {
+      unsigned char cmd = d[0] - dir;
+      const char *name = cmd_name (cmd);
+      if (name)
+         printf ("%s", name);
+      else
+         printf ("Command %02X", cmd);
+      if (dir)
+         printf (" response");
+      else
+         h->cmd = cmd;
+      if (cmd == 0x40 && !nodx)
+      {                         /* InDataExchange */
+         if (!dir && l >= 3)
+            printf (" Tg %u%s DESFire %02X", d[1] & 0x3F, (d[1] & 0x40) ? " MI" : "", d[2]);
+         else if (dir && l >= 2)
+         {
+            if (d[1] & 0x3F)
+               printf (" status %02X", d[1] & 0x3F);
+            else if (d[1] & 0x40)
+               printf (" MI");
+            else if (l >= 3)
+               printf (" DESFire %s", df_err (d[2]));
+         }
+      } else if (dir && h->cmd != cmd)
+         printf (" (expected %02X)", h->cmd + 1);
+   }
+   if (hex && l > 0)
+   {
+      printf (" [");
+      for (int i = 0; i < l; i++)
+         printf ("%s%02X", i ? " " : "", d[i]);
+      printf ("]");
+   }
+   printf ("\n");
+}
+
+int
+main (int argc, const char *argv[])
+{
+   const char *capfile = NULL;
+   poptContext optCon;
+   {
+      const struct poptOption optionsTable[] = {
+         {"hex", 'x', POPT_ARG_NONE, &hex, 0, "Show frame data"},
+         {"no-dx", 0, POPT_ARG_NONE, &nodx, 0, "Do not decode InDataExchange"},
+         POPT_AUTOHELP {}
+      };
+
+      optCon = poptGetContext (NULL, argc, argv, optionsTable, 0);
+      poptSetOtherOptionHelp (optCon, "capture-file");
+
+      int c;
+      if ((c = poptGetNextOpt (optCon)) < -1)
+         errx (1, "%s: %s\n", poptBadOption (optCon, POPT_BADOPTION_NOALIAS), poptStrerror (c));
+
+      if (poptPeekArg (optCon))
+         capfile = poptGetArg (optCon);
+
+      if (poptPeekArg (optCon) || !capfile)
+      {
+         poptPrintUsage (optCon, stderr, 0);
+         return -1;
+      }
+   }
+   FILE *f = fopen (capfile, "r");
+   if (!f)
+      err (1, "Cannot open %s", capfile);
+   uint32_t g[6];
+   if (fread (g, sizeof (g), 1, f) != 1 || g[0] != 0xA1B23C4D || g[5] != PN532_CAP_LINKTYPE)
+      errx (1, "%s is not a PN532 capture", capfile);
+   uint32_t h[4];
+   unsigned char rec[2 + 0xFFFF];
+   while (fread (h, sizeof (h), 1, f) == 1)
+   {
+      if (h[2] < 2 || h[2] > sizeof (rec) || fread (rec, h[2], 1, f) != 1)
+         errx (1, "Bad record in %s", capfile);
+      unsigned char dir = rec[0] & 1,
+         id = rec[1];
+      stream_t *s = &stream[id][dir];
+      const unsigned char *b = rec + 2;
+      int l = h[2] - 2;
+      while (l)
+      {
+         int n = sizeof (s->buf) - s->len;
+         if (n > l)
+            n = l;
+         memcpy (s->buf + s->len, b, n);
+         s->len += n;
+         b += n;
+         l -= n;
+         int r;
+         int tfi = 0;
+         const unsigned char *d = NULL;
+         int dl = 0;
+         while ((r = frame (s->buf, s->len, &tfi, &d, &dl)))
+         {
+            if (r > 0)
+               show (h[0], h[1], id, dir, tfi, d, dl);
+            else
+               r = -r;
+            memmove (s->buf, s->buf + r, s->len - r);
+            s->len -= r;
+         }
+         if (s->len == sizeof (s->buf))
+            s->len = 0;         /* Junk */
+      }
+   }
+   fclose (f);
+   poptFreeContext (optCon);
+   return 0;
+}
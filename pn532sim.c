@@ -0,0 +1,651 @@
+/* Simulated PN532 on a pseudo terminal, with an emulated DESFire card, for testing and timing without hardware */
+/* (c) Copyright 2022 Andrews & Arnold Ltd, Adrian Kennard */
+/*
+ * This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Prints the pty name for each reader, then runs until killed, e.g.
+ *   ./pn532sim --link /tmp/pn532 &
+ *   ./nfc --port /tmp/pn532 --bench 1000
+ *
+ * Each reader is a thread with its own pty and its own emulated cards (dfemu), so timing is the same with several readers.
+ * Timing is modelled with --uart-latency (USB serial adapter), --wire (bytes at the serial baud rate), --rf-latency (card
+ * processing per exchange), and --rf-rate (bytes over the air, faster after InPSL), and an absent card takes the RFConfiguration
+ * retry timeout. --rf-max makes faster bit rates fail, to test falling back.
+ */
+
+#define	_GNU_SOURCE             /* posix_openpt and ptsname */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <popt.h>
+#include <time.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <termios.h>
+#include <openssl/evp.h>
+#include "desfireaes.h"
+#include "dfemu.h"
+
+#define	MAXFRAME	600     /* Bigger than any frame the PN532 allows */
+#define	DXMAX	262             /* PN532 max InDataExchange data, longer uses MI */
+
+int debug = 0;
+int uartlatency = 0;            /* us before each frame from PN532 */
+int wire = 0;                   /* Model serial time at baud rate */
+int rflatency = 1000;           /* us card processing per exchange */
+int rfrate = 106000;            /* Bits/s over the air at 106kbps, 0 for no RF byte time */
+int rfmax = 848;                /* Fastest RF bit rate that works, faster gets CRC errors */
+int dxmax = DXMAX;              /* Max response data per InDataExchange */
+int targets = 1;                /* Cards in field */
+int format = 0;                 /* Format cards to AES */
+int cycle = 0;                  /* Card leaves after presence check, back after this many polls without it */
+int leave = 0;                  /* Card leaves after this many frames */
+const char *ats = "067577810280";       /* ATS from card, sets frame size */
+unsigned char *binats = NULL;
+int atslen = 0;
+
+typedef struct reader_s reader_t;
+struct reader_s
+{                               /* A simulated PN532 */
+   int id;
+   int m;                       /* pty master */
+   int slave;                   /* Kept open so the master does not see hangup between clients */
+   pthread_t thread;
+   unsigned int baud;
+   unsigned char rftimeout;     /* RFConfiguration item 2, fRetryTimeout */
+   unsigned char passive;       /* RFConfiguration item 5, MxRtyPassiveActivation */
+   unsigned char p3,            /* GPIO */
+     p7;
+   dfemu_t *card[2];
+   unsigned char dr[2],         /* Bit rate (InPSL BRit/BRti, 0 is 106kbps), to and from card */
+     ds[2];
+   unsigned char fresh[2];      /* Activated, no exchange yet, so InPSL allowed */
+   int present;                 /* Cards in field */
+   int gap;                     /* Polls until card back, 0 for not coming back */
+   int autopoll;                /* InAutoPoll in progress, period in 150ms units */
+   int polls;                   /* InAutoPoll polls left, 0xFF for forever */
+   unsigned char rx[MAXFRAME * 2];      /* From host */
+   int rxlen;
+   unsigned char last[MAXFRAME];        /* Last frame sent, resent for NAK */
+   int lastlen;
+   unsigned char tx[MAXFRAME];  /* InDataExchange chained command from host (MI) */
+   int txlen;
+   unsigned char res[MAXFRAME]; /* InDataExchange response still to send (MI) */
+   int reslen,
+     respos;
+};
+
+static void
+delay (long long us)
+{
+   if (us <= 0)
+      return;
+   struct timespec t = {.tv_sec = us / 1000000,.tv_nsec = (us % 1000000) * 1000 };
+   while (nanosleep (&t, &t) && errno == EINTR);
+}
+
+static void
+dump (reader_t * r, const char *dir, const unsigned char *buf, int len)
+{
+   if (!debug)
+      return;
+   flockfile (stderr);
+   fprintf (stderr, "%d%s", r->id, dir);
+   for (int i = 0; i < len; i++)
+      fprintf (stderr, " %02X", buf[i]);
+   fprintf (stderr, "\n");
+   funlockfile (stderr);
+}
+
+static void
+send (reader_t * r, const unsigned char *buf, int len)
+{                               /* Send to host, with serial timing */
+   delay (uartlatency + (wire ? len * 10000000LL / r->baud : 0));
+   dump (r, "<", buf, len);
+   while (len > 0)
+   {
+      int l = write (r->m, buf, len);
+      if (l < 0 && errno == EINTR)
+         continue;
+      if (l <= 0)
+         return;
+      buf += l;
+      len -= l;
+   }
+}
+
+static void
+ack (reader_t * r)
+{
+   static const unsigned char ack[] = { 0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00 };
+   send (r, ack, sizeof (ack));
+}
+
+static void
+respond (reader_t * r, unsigned char cmd, int len, const unsigned char *data)
+{                               /* Response frame, cmd is the command (response is cmd+1), or 0x7F for error frame */
+   unsigned char *b = r->last;
+   *b++ = 0x00;                 /* Preamble */
+   *b++ = 0x00;
+   *b++ = 0xFF;
+   if (cmd == 0x7F)
+   {                            /* Application level error */
+      *b++ = 0x01;
+      *b++ = 0xFF;
+      *b++ = 0x7F;
+      *b++ = 0x81;
+   } else
+   {
+      int l = len + 2;
+      if (l >= 0x100)
+      {
+         *b++ = 0xFF;           /* Extended */
+         *b++ = 0xFF;
+         *b++ = (l >> 8);
+         *b++ = (l & 0xFF);
+         *b++ = -(l >> 8) - (l & 0xFF);
+      } else
+      {
+         *b++ = l;
+         *b++ = -l;
+      }
+      unsigned char sum = 0xD5 + cmd + 1;
+      *b++ = 0xD5;              /* Direction (PN532 to host) */
+      *b++ = cmd + 1;
+      for (int i = 0; i < len; i++)
+         sum += (*b++ = data[i]);
+      *b++ = -sum;
+   }
+   *b++ = 0x00;                 /* Postamble */
+   r->lastlen = b - r->last;
+   send (r, r->last, r->lastlen);
+}
+
+static void
+arrive (reader_t * r)
+{                               /* Cards in field for a poll */
+   if (r->present || !r->gap || --r->gap)
+      return;
+   r->present = targets;
+   for (int t = 0; t < targets; t++)
+      dfemu_present (r->card[t], 1, leave);
+}
+
+static int
+target (reader_t * r, int t, unsigned char *buf)
+{                               /* Target data as InListPassiveTarget, 106kbps type A, returns length */
+   unsigned char *b = buf;
+   r->dr[t] = r->ds[t] = 0;     /* Activated at 106kbps */
+   r->fresh[t] = 1;
+   *b++ = t + 1;                /* Tg */
+   *b++ = 0x03;                 /* SENS_RES, DESFire */
+   *b++ = 0x44;
+   *b++ = 0x20;                 /* SEL_RES, ISO/IEC 14443-4 */
+   *b++ = 7;
+   memcpy (b, dfemu_uid (r->card[t]), 7);
+   b += 7;
+   memcpy (b, binats, atslen);
+   b += atslen;
+   return b - buf;
+}
+
+static void
+autopoll (reader_t * r)
+{                               /* InAutoPoll, respond if a card, or no more polls */
+   arrive (r);
+   unsigned char buf[MAXFRAME],
+    *b = buf;
+   if (!r->present && (r->polls == 0xFF || --r->polls > 0))
+      return;                   /* Keep polling */
+   *b++ = r->present;
+   for (int t = 0; t < r->present; t++)
+   {
+      *b++ = 0x10;              /* Generic 106kbps type A */
+      unsigned char *l = b++;
+      *l = target (r, t, b);
+      b += *l;
+   }
+   r->autopoll = 0;
+   respond (r, 0x60, b - buf, buf);
+}
+
+static long long
+rftime (int bytes, unsigned char br)
+{                               /* Time over the air for bytes at InPSL bit rate (9 bits per byte with parity) */
+   return rfrate ? bytes * 9000000LL / (rfrate << br) : 0;
+}
+
+static void
+psl (reader_t * r, const unsigned char *data, int len)
+{                               /* InPSL, PPS to card, only allowed straight after activation */
+   unsigned char status = 0x00;
+   int t = (len ? (data[0] & 0x3F) - 1 : -1);
+   unsigned char ta = (atslen >= 3 && (binats[1] & 0x10) ? binats[2] : 0);
+   if (len < 3 || t < 0 || t >= r->present || data[1] > 3 || data[2] > 3)
+      status = 0x27;            /* Not acceptable */
+   else if (!r->fresh[t])
+      status = 0x27;
+   else if ((data[1] && !(ta & (0x01 << (data[1] - 1)))) || (data[2] && !(ta & (0x10 << (data[2] - 1))))
+            || ((ta & 0x80) && data[1] != data[2]))
+      status = 0x01;            /* Card does not answer PPS it cannot do */
+   else
+   {
+      r->dr[t] = data[1];
+      r->ds[t] = data[2];
+      r->fresh[t] = 0;
+   }
+   delay (rflatency / 4 + rftime (5, 0));
+   respond (r, 0x4E, 1, &status);
+}
+
+static void
+dx (reader_t * r, const unsigned char *data, int len)
+{                               /* InDataExchange */
+   unsigned char buf[MAXFRAME];
+   if (len < 1)
+   {
+      respond (r, 0x7F, 0, NULL);
+      return;
+   }
+   unsigned char tg = (data[0] & 0x3F);
+   if (len == 1 && r->respos < r->reslen)
+   {                            /* Next part of response */
+      int l = r->reslen - r->respos;
+      if (l > dxmax)
+         l = dxmax;
+      buf[0] = (r->respos + l < r->reslen ? 0x40 : 0x00);
+      memcpy (buf + 1, r->res + r->respos, l);
+      r->respos += l;
+      respond (r, 0x40, l + 1, buf);
+      return;
+   }
+   r->reslen = r->respos = 0;
+   if (r->txlen + len - 1 > sizeof (r->tx))
+   {
+      r->txlen = 0;
+      respond (r, 0x7F, 0, NULL);
+      return;
+   }
+   memcpy (r->tx + r->txlen, data + 1, len - 1);
+   r->txlen += len - 1;
+   if (tg >= 1 && tg <= r->present)
+      r->fresh[tg - 1] = 0;
+   if (data[0] & 0x40)
+   {                            /* More to follow from host */
+      delay (tg >= 1 && tg <= 2 ? rftime (len - 1, r->dr[tg - 1]) : 0);
+      buf[0] = 0x00;
+      respond (r, 0x40, 1, buf);
+      return;
+   }
+   int l = -1;
+   if (tg >= 1 && tg <= r->present && (106 << r->dr[tg - 1] > rfmax || 106 << r->ds[tg - 1] > rfmax))
+   {                            /* Too fast for the RF link */
+      delay (rflatency);
+      r->txlen = 0;
+      buf[0] = 0x02;            /* CRC error */
+      respond (r, 0x40, 1, buf);
+      return;
+   }
+   if (tg >= 1 && tg <= r->present)
+   {
+      const char *e = NULL;
+      l = dfemu_dx (r->card[tg - 1], r->txlen, r->tx, sizeof (r->tx), &e);
+      if (!l)
+      {                         /* Left field */
+         r->present = 0;
+         r->gap = (cycle ? cycle + 1 : 0);
+      }
+   }
+   if (l > 0)
+      delay (rflatency + rftime (r->txlen, r->dr[tg - 1]) + rftime (l, r->ds[tg - 1]));
+   else
+      delay (2 * (100LL << ((r->rftimeout ? : 1) - 1)));        /* Retry timeout, tried twice */
+   r->txlen = 0;
+   if (l <= 0)
+   {
+      buf[0] = 0x01;            /* Timeout */
+      respond (r, 0x40, 1, buf);
+      return;
+   }
+   memcpy (r->res, r->tx, l);
+   r->reslen = l;
+   r->respos = 0;
+   dx (r, data, 1);
+}
+
+static void
+command (reader_t * r, unsigned char cmd, const unsigned char *data, int len)
+{                               /* A command from host */
+   unsigned char buf[MAXFRAME];
+   int l = 0;
+   ack (r);
+   switch (cmd)
+   {
+   case 0x00:                  /* Diagnose */
+      if (len && data[0] == 0x00)
+      {                         /* Communication line test, echo */
+         memcpy (buf, data, len);
+         l = len;
+      } else if (len && data[0] == 0x06)
+      {                         /* Card presence */
+         buf[l++] = (r->present ? 0x00 : 0x01);
+         if (r->present && cycle)
+         {                      /* Card taken away */
+            r->present = 0;
+            r->gap = cycle + 1;
+            for (int t = 0; t < targets; t++)
+               dfemu_present (r->card[t], 0, 0);
+         }
+      } else
+         buf[l++] = 0x00;
+      break;
+   case 0x02:                  /* GetFirmwareVersion */
+      buf[l++] = 0x32;          /* PN532 */
+      buf[l++] = 0x01;
+      buf[l++] = 0x06;
+      buf[l++] = 0x07;
+      break;
+   case 0x04:                  /* GetGeneralStatus */
+      buf[l++] = 0x00;          /* Err */
+      buf[l++] = 0x01;          /* Field */
+      buf[l++] = 0x00;          /* NbTg */
+      buf[l++] = 0x00;          /* SAM */
+      break;
+   case 0x06:                  /* ReadRegister */
+      for (int i = 0; i + 1 < len; i += 2)
+         buf[l++] = 0x00;
+      break;
+   case 0x0C:                  /* ReadGPIO */
+      buf[l++] = r->p3;
+      buf[l++] = r->p7;
+      buf[l++] = 0x00;
+      break;
+   case 0x0E:                  /* WriteGPIO */
+      if (len > 0 && (data[0] & 0x80))
+         r->p3 = (data[0] & 0x3F);
+      if (len > 1 && (data[1] & 0x80))
+         r->p7 = (data[1] & 0x06);
+      if (debug)
+         fprintf (stderr, "%d GPIO P3=%02X P7=%02X\n", r->id, r->p3, r->p7);
+      break;
+   case 0x10:                  /* SetSerialBaudRate */
+      {
+         static const unsigned int rates[] = { 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600, 1288000 };
+         if (len < 1 || data[0] >= sizeof (rates) / sizeof (*rates))
+         {
+            respond (r, 0x7F, 0, NULL);
+            return;
+         }
+         respond (r, cmd, 0, NULL);
+         r->baud = rates[data[0]];      /* After response, and host sends ACK at new rate */
+         return;
+      }
+   case 0x32:                  /* RFConfiguration */
+      if (len >= 4 && data[0] == 0x02)
+         r->rftimeout = data[3];
+      if (len >= 4 && data[0] == 0x05)
+         r->passive = data[3];
+      break;
+   case 0x40:                  /* InDataExchange */
+      dx (r, data, len);
+      return;
+   case 0x4A:                  /* InListPassiveTarget */
+      arrive (r);
+      {
+         int n = r->present;
+         if (len && n > data[0])
+            n = data[0];        /* MaxTg */
+         if (!n)
+            delay ((r->passive == 0xFF ? 1 : r->passive + 1) * 1000LL);     /* About 1ms per activation try, forever is one try here */
+         buf[l++] = n;
+         for (int t = 0; t < n; t++)
+            l += target (r, t, buf + l);
+      }
+      break;
+   case 0x4E:                  /* InPSL */
+      psl (r, data, len);
+      return;
+   case 0x60:                  /* InAutoPoll */
+      r->polls = (len && data[0] ? data[0] : 1);
+      r->autopoll = (len > 1 && data[1] ? data[1] : 1);
+      autopoll (r);
+      return;
+   case 0x14:                  /* SAMConfiguration */
+   case 0x08:                  /* WriteRegister */
+   case 0x12:                  /* SetParameters */
+      break;
+   case 0x44:                  /* InDeselect */
+   case 0x52:                  /* InRelease */
+   case 0x54:                  /* InSelect */
+      buf[l++] = 0x00;
+      break;
+   default:
+      respond (r, 0x7F, 0, NULL);
+      return;
+   }
+   respond (r, cmd, l, buf);
+}
+
+static void
+frames (reader_t * r)
+{                               /* Process frames received */
+   while (1)
+   {
+      unsigned char *b = r->rx;
+      int p = 0;
+      while (p + 1 < r->rxlen && (b[p] || b[p + 1] != 0xFF))
+         p++;                   /* Find start, skips wake up and preamble */
+      if (p + 1 >= r->rxlen)
+      {
+         if (p)
+         {
+            memmove (b, b + p, r->rxlen - p);
+            r->rxlen -= p;
+         }
+         return;
+      }
+      int s = p;
+      p += 2;
+      if (p + 3 > r->rxlen)
+         return;
+      int used = 0;
+      if ((!b[p] && b[p + 1] == 0xFF) || (b[p] == 0xFF && !b[p + 1]))
+      {                         /* ACK or NAK */
+         dump (r, ">", b + s, p + 3 - s);
+         if (b[p])
+            send (r, r->last, r->lastlen);      /* NAK, send last frame again */
+         else
+            r->autopoll = 0;    /* ACK, abort command */
+         used = p + 3;
+      } else
+      {
+         int l,
+           ok = 1;
+         if (b[p] == 0xFF && b[p + 1] == 0xFF)
+         {                      /* Extended */
+            if (p + 5 > r->rxlen)
+               return;
+            ok = !(unsigned char) (b[p + 2] + b[p + 3] + b[p + 4]);
+            l = (b[p + 2] << 8) + b[p + 3];
+            p += 5;
+         } else
+         {
+            ok = !(unsigned char) (b[p] + b[p + 1]);
+            l = b[p];
+            p += 2;
+         }
+         if (!ok || l < 2 || l > MAXFRAME)
+            used = p;           /* Bad length, ignore, host will time out */
+         else
+         {
+            if (p + l + 2 > r->rxlen)
+               return;
+            dump (r, ">", b + s, p + l + 2 - s);
+            unsigned char sum = 0;
+            for (int i = 0; i <= l; i++)
+               sum += b[p + i];
+            used = p + l + 2;
+            if (wire)
+               delay (used * 10000000LL / r->baud);     /* Time to receive from host */
+            if (!sum && b[p] == 0xD4)
+               command (r, b[p + 1], b + p + 2, l - 2);
+            else if (!sum)
+               respond (r, 0x7F, 0, NULL);
+         }
+      }
+      memmove (b, b + used, r->rxlen - used);
+      r->rxlen -= used;
+   }
+}
+
+static void *
+reader_thread (void *arg)
+{
+   reader_t *r = arg;
+   while (1)
+   {
+      struct pollfd f = {.fd = r->m,.events = POLLIN };
+      int p = poll (&f, 1, r->autopoll ? r->autopoll * 150 : -1);
+      if (p < 0 && errno == EINTR)
+         continue;
+      if (p < 0)
+         err (1, "poll");
+      if (!p)
+      {
+         autopoll (r);
+         continue;
+      }
+      int l = read (r->m, r->rx + r->rxlen, sizeof (r->rx) - r->rxlen);
+      if (l < 0 && (errno == EINTR || errno == EAGAIN))
+         continue;
+      if (l <= 0)
+      {                         /* Host not connected */
+         delay (10000);
+         continue;
+      }
+      r->rxlen += l;
+      frames (r);
+      if (r->rxlen == sizeof (r->rx))
+         r->rxlen = 0;          /* Junk */
+   }
+   return NULL;
+}
+
+int
+main (int argc, const char *argv[])
+{
+   int readers = 1;
+   const char *linkname = NULL;
+   poptContext optCon;
+   {
+      const struct poptOption optionsTable[] = {
+         {"readers", 'n', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &readers, 0, "Readers", "N"},
+         {"link", 'l', POPT_ARG_STRING, &linkname, 0, "Symlink to pty (reader number appended if more than one)", "path"},
+         {"targets", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &targets, 0, "Cards in field (1 or 2)", "N"},
+         {"format", 0, POPT_ARG_NONE, &format, 0, "Format cards to AES zero key first"},
+         {"ats", 0, POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &ats, 0, "Card ATS", "hex"},
+         {"cycle", 0, POPT_ARG_INT, &cycle, 0, "Card leaves after presence check, and is back after N polls without it", "N"},
+         {"leave", 0, POPT_ARG_INT, &leave, 0, "Card leaves after N frames", "N"},
+         {"uart-latency", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &uartlatency, 0, "Delay before each frame to host", "us"},
+         {"wire", 0, POPT_ARG_NONE, &wire, 0, "Add serial time for each frame to host at the baud rate"},
+         {"rf-latency", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &rflatency, 0, "Card time per exchange", "us"},
+         {"rf-rate", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &rfrate, 0, "RF bit rate at 106kbps for byte time, 0 for none", "bits/s"},
+         {"rf-max", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &rfmax, 0, "Fastest bit rate after InPSL that works, faster gets CRC errors", "kbps"},
+         {"dx-max", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &dxmax, 0, "Max InDataExchange response data, longer uses MI", "N"},
+         {"debug", 'v', POPT_ARG_NONE, &debug, 0, "Debug"},
+         POPT_AUTOHELP {}
+      };
+
+      optCon = poptGetContext (NULL, argc, argv, optionsTable, 0);
+
+      int c;
+      if ((c = poptGetNextOpt (optCon)) < -1)
+         errx (1, "%s: %s\n", poptBadOption (optCon, POPT_BADOPTION_NOALIAS), poptStrerror (c));
+
+      if (poptPeekArg (optCon))
+      {
+         poptPrintUsage (optCon, stderr, 0);
+         return -1;
+      }
+   }
+   if (readers < 1 || targets < 1 || targets > 2 || dxmax < 1 || dxmax > DXMAX)
+      errx (1, "--readers 1 or more, --targets 1 or 2, --dx-max 1 to %d", DXMAX);
+   atslen = strlen (ats) / 2;
+   binats = malloc (atslen);
+   for (int i = 0; i < atslen; i++)
+      if (!binats || sscanf (ats + i * 2, "%2hhx", binats + i) != 1)
+         errx (1, "--ats is hex");
+   if (!atslen || binats[0] != atslen)
+      errx (1, "--ats starts with its length");
+   reader_t *reader = calloc (readers, sizeof (*reader));
+   if (!reader)
+      errx (1, "malloc");
+   for (int n = 0; n < readers; n++)
+   {
+      reader_t *r = &reader[n];
+      r->id = n;
+      r->baud = 115200;
+      r->rftimeout = 0x0B;      /* PN532 defaults, 102.4ms */
+      r->passive = 0xFF;
+      r->present = targets;
+      if ((r->m = posix_openpt (O_RDWR | O_NOCTTY)) < 0 || grantpt (r->m) || unlockpt (r->m))
+         err (1, "pty");
+      const char *name = ptsname (r->m);
+      if ((r->slave = open (name, O_RDWR | O_NOCTTY)) < 0)
+         err (1, "Cannot open %s", name);
+      struct termios t;
+      if (!tcgetattr (r->slave, &t))
+      {
+         cfmakeraw (&t);
+         tcsetattr (r->slave, TCSANOW, &t);
+      }
+      for (int c = 0; c < targets; c++)
+      {
+         if (!(r->card[c] = dfemu_new ()))
+            errx (1, "malloc");
+         if (format)
+         {
+            df_t d;
+            const char *e;
+            if ((e = df_init (&d, r->card[c], &dfemu_dx)) || (e = df_format (&d, 0, NULL)))
+               errx (1, "Cannot format card: %s", e);
+            df_free (&d);
+            dfemu_present (r->card[c], 0, 0);   /* Reset, as if presented again */
+         }
+         dfemu_present (r->card[c], 1, leave);
+      }
+      if (linkname)
+      {
+         char l[1000];
+         if (readers > 1)
+            snprintf (l, sizeof (l), "%s%d", linkname, n);
+         else
+            snprintf (l, sizeof (l), "%s", linkname);
+         unlink (l);
+         if (symlink (name, l))
+            err (1, "Cannot link %s", l);
+      }
+      printf ("%s\n", name);
+   }
+   fflush (stdout);
+   for (int n = 0; n < readers; n++)
+      if (pthread_create (&reader[n].thread, NULL, reader_thread, &reader[n]))
+         errx (1, "Cannot start thread");
+   for (int n = 0; n < readers; n++)
+      pthread_join (reader[n].thread, NULL);
+   poptFreeContext (optCon);
+   return 0;
+}
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Smoke tests for the daemons against emulated readers (pn532sim), see make smoke
+# BIN is where the tools are (default .)
+
+BIN=${BIN:-.}
+T=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null; rm -rf "$T"' EXIT
+fail()
+{
+	echo "Fail: $*"
+	exit 1
+}
+
+# nfcd: reader not there at start, then there, then gone, then back, nfcd must keep running and reopen it
+$BIN/nfcd --retry 1 $T/r > $T/nfcd.out 2> $T/nfcd.err &
+NFCD=$!
+sleep 1
+$BIN/pn532sim --link $T/r --format --cycle 3 > /dev/null &
+SIM=$!
+sleep 3
+kill $SIM
+wait $SIM 2>/dev/null
+sleep 1
+FIRST=$(wc -l < $T/nfcd.out)
+kill -0 $NFCD 2>/dev/null || fail "nfcd exited when the reader went"
+$BIN/pn532sim --link $T/r --format --cycle 3 > /dev/null &
+SIM=$!
+sleep 3
+kill $SIM $NFCD
+wait $SIM $NFCD 2>/dev/null
+[ "$FIRST" -gt 0 ] || fail "nfcd found no cards"
+[ "$(wc -l < $T/nfcd.out)" -gt "$FIRST" ] || fail "nfcd did not reopen the reader"
+
+# nfcissue: reader a works, cards on reader b always leave part way (retried on another reader), reader c has one card that
+# leaves at once then no more (its jobs must be taken by the others), all jobs must be done by a
+printf 'aid 010203 EB 1\nfile 1 D 3 0000 32 00112233\ncards 9\n' > $T/jobs
+$BIN/pn532sim --link $T/a --cycle 2 > /dev/null &
+$BIN/pn532sim --link $T/b --cycle 2 --leave 5 > /dev/null &
+$BIN/pn532sim --link $T/c --leave 1 > /dev/null &
+sleep 1
+timeout 60 $BIN/nfcissue --jobs $T/jobs --retries 9 $T/a $T/b $T/c > $T/nfcissue.out 2> $T/nfcissue.err || fail "nfcissue did not finish"
+tail -1 $T/nfcissue.out | grep -q '"cards":9,' || fail "nfcissue did not do all cards"
+grep -q "\"port\":\"$T/b\".*\"error\"" $T/nfcissue.out || fail "nfcissue had no failures on reader b"
+grep -q "\"port\":\"$T/c\".*\"error\"" $T/nfcissue.out || fail "nfcissue had no failure on reader c"
+grep -q "\"port\":\"$T/a\",.*\"uid\"" $T/nfcissue.out || fail "nfcissue did no cards on reader a"
+[ "$(grep -c '"uid"' $T/nfcissue.out)" = 9 ] || fail "nfcissue issued the wrong number of cards"
+
+echo "Smoke tests passed"